@@ -23,7 +23,7 @@
 #define _ARCH_AVR_H
 
 // Defines and includes.  {{{
-// Note: When changing this, also change max in cdriver/space.cpp
+// Note: When changing this, also change arch_max_steps() in server/cdriver/arch-avr.h and arch-null.h
 #ifdef FAST_ISR
 #define TIME_PER_ISR 75
 #ifndef STEPS_DELAY // {{{
@@ -554,15 +554,23 @@ static inline void arch_msetup(uint8_t m) { // {{{
 	}
 } // }}}
 
+static inline uint16_t arch_timer_top(uint16_t count, uint8_t phase) { // {{{
+	return uint32_t(count) * 16 / phase;
+} // }}}
+
+static inline void arch_set_timer_top(uint16_t top) { // {{{
+	// Called from the ISR at the start of a fragment; the counter has just been cleared, so it is below the new TOP.
+	OCR1AH = (top >> 8) & 0xff;
+	OCR1AL = top & 0xff;
+} // }}}
+
 static inline void arch_set_speed(uint16_t count) { // {{{
 	if (count == 0) {
 		TIMSK1 = 0;
 		step_state = STEP_STATE_STOP;
 	}
 	else {
-		uint32_t c = count;
-		c *= 16;
-		c /= full_phase;
+		uint16_t c = arch_timer_top(count, full_phase);
 		// Set TOP.
 		OCR1AH = (c >> 8) & 0xff;
 		OCR1AL = c & 0xff;
@@ -903,7 +911,16 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 		"\t"	"dec 16"			"\n" \
 		"\t"	"brne 1b"			"\n" \
 	"2:\t"		"ldd 16, y + %[len]"		"\n" \
-		"\t"	"sts current_len, 16"		"\n"
+		"\t"	"sts current_len, 16"		"\n" \
+		/* Set sample time; write TOP high byte first. */ \
+		"\t"	"ldd 16, y + %[phase]"		"\n" \
+		"\t"	"sts full_phase, 16"		"\n" \
+		"\t"	"ldd 16, y + %[phase_bits]"	"\n" \
+		"\t"	"sts %[full_phase_bits], 16"	"\n" \
+		"\t"	"ldd 16, y + %[timer_top] + 1"	"\n" \
+		"\t"	"sts %[ocr1ah], 16"		"\n" \
+		"\t"	"ldd 16, y + %[timer_top]"	"\n" \
+		"\t"	"sts %[ocr1al], 16"		"\n"
 
 		next_fragment(
 		/* Activation of all motors. */
@@ -1104,6 +1121,11 @@ ISR(TIMER1_COMPA_vect, ISR_NAKED) { // {{{
 			[motor_size] "" (sizeof(Motor)),
 			[settings_size] "I" (sizeof(Settings)),
 			[len] "I" (offsetof(Settings, len)),
+			[phase] "I" (offsetof(Settings, phase)),
+			[phase_bits] "I" (offsetof(Settings, phase_bits)),
+			[timer_top] "I" (offsetof(Settings, timer_top)),
+			[ocr1ah] "M" (_SFR_MEM_ADDR(OCR1AH)),
+			[ocr1al] "M" (_SFR_MEM_ADDR(OCR1AL)),
 			[timsk] "M" (_SFR_MEM_ADDR(TIMSK1)),
 			[timskval] "M" (1 << OCIE1A),
 			[state_probe] "M" (STEP_STATE_PROBE),
@@ -138,6 +138,15 @@ static inline void arch_set_speed(uint16_t count) {
 		step_state = STEP_STATE_STOP;
 }
 
+static inline uint16_t arch_timer_top(uint16_t count, uint8_t phase) {
+	(void)&phase;
+	return count;
+}
+
+static inline void arch_set_timer_top(uint16_t top) {
+	(void)&top;
+}
+
 static inline void arch_tick() {
 	while (true) {
 		int c = fgetc(stdin);
@@ -67,6 +67,9 @@
 
 #define SERIAL_BUFFER_SIZE (1 << SERIAL_SIZE_BITS)
 #define SERIAL_MASK (SERIAL_BUFFER_SIZE - 1)
+// Largest number of packets the host may have in flight with the sliding window link extension.  They must all fit in the serial buffer.
+#define LINK_PACKET_SIZE (((3 + BYTES_PER_FRAGMENT) * 4 + 2) / 3)
+#define LINK_WINDOW_MAX (SERIAL_BUFFER_SIZE / LINK_PACKET_SIZE - 1 > 32 ? 32 : SERIAL_BUFFER_SIZE / LINK_PACKET_SIZE - 1)
 #define FRAGMENTS_PER_MOTOR_MASK ((1 << FRAGMENTS_PER_MOTOR_BITS) - 1)
 
 #ifndef NO_DEBUG
@@ -80,6 +83,8 @@ static inline void debug_dump() {}
 #endif
 
 static inline void arch_msetup(uint8_t m);
+static inline uint16_t arch_timer_top(uint16_t count, uint8_t phase);
+static inline void arch_set_timer_top(uint16_t top);
 
 template <typename _A, typename _B> _A min(_A a, _B b) { return a < b ? a : b; }
 template <typename _A, typename _B> _A max(_A a, _B b) { return a > b ? a : b; }
@@ -113,11 +118,13 @@ EXTERN uint8_t reply_ready, adcreply_ready;
 EXTERN bool timeout;
 EXTERN uint8_t ff_in;
 EXTERN uint8_t ff_out;
+EXTERN uint8_t link_window;	// 0 for the 2 bit flipflop protocol; otherwise the number of packets the host may have in flight, using 8 bit serials.
 EXTERN uint8_t pending_packet[4][REPLY_BUFFER_SIZE];
 EXTERN int16_t pending_len[4];
 EXTERN uint8_t filling;
 EXTERN uint8_t led_fast;
 EXTERN uint16_t led_last, led_phase, time_per_sample;
+EXTERN uint16_t next_time_per_sample;	// Sample time for the next START_MOVE; reset to time_per_sample after it.
 EXTERN uint8_t led_pin, stop_pin, probe_pin, pin_flags;
 EXTERN uint8_t spiss_pin;
 EXTERN uint16_t timeout_time, last_active;
@@ -242,12 +249,20 @@ enum Command {
 	CMD_GETPIN,	// 1:pin
 	CMD_SPI,	// 1:size, size: data.
 	CMD_PINNAME,	// 1:pin (0-127: digital, 128-255: analog)
+	CMD_MOVE_PACKED,// 1:which (bit 7: single), 1:length, length:encoded samples
+	CMD_SAMPLE_TIME,// 2:us/sample for the next fragment
+};
+
+// Optional features, reported in CMD_READY.
+enum Feature {
+	FEATURE_MOVE_PACKED = 1,
+	FEATURE_SAMPLE_TIME = 2
 };
 
 enum RCommand {
 	// to host
 		// responses to host requests; only one active at a time.
-	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment
+	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment, 1:link window, 1:features
 	CMD_PONG,	// 1:code
 	CMD_HOMED,	// {4:motor_pos}*
 	CMD_PIN,	// 1:state
@@ -261,6 +276,13 @@ enum RCommand {
 	CMD_LIMIT,	// 1:which, 1:pos, {4:motor_pos}*
 	CMD_TIMEOUT,	// 0
 	CMD_PINCHANGE,	// 1:which, 1: state
+	CMD_LINK,	// 1:serial, 1:LinkType; only with link_window, not acked.
+};
+
+enum LinkType {
+	LINK_ACK,	// All packets up to and including serial were accepted.
+	LINK_NACK,	// Packets before serial were accepted; resend from serial on.
+	LINK_STALL	// Packet serial was received, but not accepted.
 };
 
 static inline uint8_t command(int16_t pos) {
@@ -308,6 +330,10 @@ static inline int16_t minpacketlen() {
 		return 2;
 	case CMD_PINNAME:
 		return 2;
+	case CMD_MOVE_PACKED:
+		return 3;
+	case CMD_SAMPLE_TIME:
+		return 3;
 	default:
 		debug("invalid command passed to minpacketlen: %x", command(0));
 		return 1;
@@ -385,6 +411,10 @@ EXTERN uint8_t homers;
 struct Settings {
 	uint8_t flags;
 	uint8_t len;
+	uint16_t time_per_sample;
+	uint16_t timer_top;	// arch_timer_top() of time_per_sample, for the switch to this fragment in the ISR.
+	uint8_t phase;	// full_phase while running this fragment.
+	uint8_t phase_bits;	// full_phase_bits while running this fragment.
 	enum {
 		PROBING = 1
 	};
@@ -402,6 +432,22 @@ enum StepState {
 };
 #define NUM_NON_MOVING_STATES 3
 EXTERN Settings settings[1 << FRAGMENTS_PER_MOTOR_BITS];
+
+static inline uint8_t sample_phase_bits(uint16_t us) {
+	// Number of ISR calls per sample is 1 << this; full_phase must fit in 8 bits.
+	uint8_t fpb = 0;
+	while (fpb < 8 && us / TIME_PER_ISR >= uint16_t(1) << fpb)
+		fpb += 1;
+	return fpb > 0 ? fpb - 1 : 0;
+}
+
+static inline void setup_sample_time(uint8_t fragment, uint16_t us) {
+	Settings &s = settings[fragment];
+	s.time_per_sample = us;
+	s.phase_bits = audio ? 0 : sample_phase_bits(us);
+	s.phase = 1 << s.phase_bits;
+	s.timer_top = arch_timer_top(us, s.phase);
+}
 EXTERN uint8_t notified_current_fragment;
 
 EXTERN uint8_t limit_fragment_pos;
@@ -530,6 +576,9 @@ static inline void SLOW_ISR() {
 				}
 				BUFFER_CHECK(settings, current_fragment);
 				current_len = settings[current_fragment].len;
+				full_phase = settings[current_fragment].phase;
+				full_phase_bits = settings[current_fragment].phase_bits;
+				arch_set_timer_top(settings[current_fragment].timer_top);
 			}
 			else {
 				// Underrun.
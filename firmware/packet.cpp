@@ -28,6 +28,39 @@ static uint16_t read_16(int pos) {
 	return command(pos) | (command(pos + 1) << 8);
 }
 
+static bool unpack_move(uint8_t m) {
+	// Decode the samples of CMD_MOVE_PACKED.  Each code byte is one of:
+	// 0ddddddd: add the 7 bit signed delta d to the value; one sample.
+	// 10cccccc: repeat the value c + 1 times.
+	// 11000000: the next 2 bytes are the new value; one sample.
+	// The value starts at 0.
+	uint8_t len = command(2);
+	uint8_t b = 0;
+	int16_t value = 0;
+	uint8_t i = 0;
+	while (i < len) {
+		uint8_t code = command(3 + i++);
+		uint8_t count = 1;
+		if ((code & 0x80) == 0)
+			value += int8_t(code << 1) >> 1;
+		else if ((code & 0x40) == 0)
+			count = (code & 0x3f) + 1;
+		else {
+			if (i + 2 > len)
+				return false;
+			value = read_16(3 + i);
+			i += 2;
+		}
+		if (b + 2 * count > last_len)
+			return false;
+		while (count--) {
+			buffer[last_fragment][m][b++] = value & 0xff;
+			buffer[last_fragment][m][b++] = (value >> 8) & 0xff;
+		}
+	}
+	return b == last_len;
+}
+
 static uint32_t read_32(int pos) {
 	uint32_t ret = 0;
 	for (uint8_t b = 0; b < 4; ++b)
@@ -63,8 +96,22 @@ void packet()
 		reply[8] = NUM_MOTORS;
 		reply[9] = 1 << FRAGMENTS_PER_MOTOR_BITS;
 		reply[10] = BYTES_PER_FRAGMENT;
+		// A host that supports the sliding window link extension sends its window size as an extra byte.
+		uint8_t window = 0;
+		if (command(1) > 10) {
+			window = command(10) < LINK_WINDOW_MAX ? command(10) : LINK_WINDOW_MAX;
+			if (window <= 3)
+				window = 0;
+		}
+		reply[1] = 13;
+		reply[11] = window;
+		reply[12] = FEATURE_MOVE_PACKED | FEATURE_SAMPLE_TIME;
 		reply_ready = reply[1];	// Update the length there if it needs to change.
 		write_ack();
+		// The ack for this packet uses the old protocol; everything after it uses the new setting.
+		link_window = window;
+		if (!link_window)
+			ff_in &= 3;
 		return;
 	}
 	case CMD_PING:
@@ -99,6 +146,7 @@ void packet()
 			motor[m].disable(m);
 		active_motors = command(1);
 		time_per_sample = read_32(2);
+		next_time_per_sample = time_per_sample;
 		uint8_t p = led_pin;
 		led_pin = command(6);
 		if (p != led_pin) {
@@ -132,10 +180,7 @@ void packet()
 			audio_motor = &motor[command(13)];
 		}
 		else {
-			uint8_t fpb = 0;
-			while (time_per_sample / TIME_PER_ISR >= uint16_t(1) << fpb)
-				fpb += 1;
-			fpb -= 1;
+			uint8_t fpb = sample_phase_bits(time_per_sample);
 			cli();
 			audio = 0;
 			audio_motor = 0;
@@ -359,6 +404,11 @@ void packet()
 			BUFFER_CHECK(buffer, current_fragment);
 			current_buffer = &buffer[current_fragment];
 			current_sample = 0;
+			if (!audio) {
+				// The last fragment may have used a different sample time.
+				full_phase_bits = sample_phase_bits(time_per_sample);
+				full_phase = 1 << full_phase_bits;
+			}
 			//debug("step_state home 0");
 			step_state = STEP_STATE_PROBE;
 			arch_set_speed(home_step_time);
@@ -375,6 +425,8 @@ void packet()
 	{
 		cmddebug("CMD_START_MOVE");
 		last_len = command(1);	// Do this even when ignoring the command.
+		uint16_t sample_time = next_time_per_sample;	// This too.
+		next_time_per_sample = time_per_sample;
 		if (stopping >= 0) {
 			//debug("ignoring start move while stopping");
 			write_ack();
@@ -402,6 +454,7 @@ void packet()
 			return;
 		}
 		settings[last_fragment].len = command(1);
+		setup_sample_time(last_fragment, sample_time);
 		filling = command(2);
 		for (uint8_t m = 0; m < active_motors; ++m) {
 			buffer[last_fragment][m][0] = 0x00;	// Sentinel indicating no data is available for this motor.
@@ -423,9 +476,16 @@ void packet()
 	}
 	case CMD_MOVE:
 	case CMD_MOVE_SINGLE:
+	case CMD_MOVE_PACKED:
 	{
 		cmddebug("CMD_MOVE(_SINGLE)");
 		uint8_t m = command(1);
+		bool single = command(0) == CMD_MOVE_SINGLE;
+		if (command(0) == CMD_MOVE_PACKED) {
+			// Bit 7 of the motor means single.
+			single = m & 0x80;
+			m &= 0x7f;
+		}
 		if (m >= NUM_MOTORS) {
 			debug("invalid buffer %d to fill", m);
 			write_stall();
@@ -446,9 +506,20 @@ void packet()
 			write_stall();
 			return;
 		}
-		for (uint8_t b = 0; b < last_len; ++b)
-			buffer[last_fragment][m][b] = static_cast <uint8_t>(command(2 + b));
-		if (command(0) != CMD_MOVE_SINGLE) {
+		if (command(0) == CMD_MOVE_PACKED) {
+			if (!unpack_move(m)) {
+				debug("invalid packed move for %d", m);
+				buffer[last_fragment][m][0] = 0x00;
+				buffer[last_fragment][m][1] = 0x80;
+				write_stall();
+				return;
+			}
+		}
+		else {
+			for (uint8_t b = 0; b < last_len; ++b)
+				buffer[last_fragment][m][b] = static_cast <uint8_t>(command(2 + b));
+		}
+		if (!single) {
 			for (uint8_t f = 0; f < active_motors; ++f) {
 				if ((motor[f].follow & 0x7f) == m) {
 					for (uint8_t b = 0; b < last_len; b += 2) {
@@ -468,6 +539,14 @@ void packet()
 		write_ack();
 		return;
 	}
+	case CMD_SAMPLE_TIME:
+	{
+		cmddebug("CMD_SAMPLE_TIME");
+		// This applies to the next START_MOVE or START_PROBE only.
+		next_time_per_sample = read_16(1);
+		write_ack();
+		return;
+	}
 	case CMD_START:
 	{
 		cmddebug("CMD_START");
@@ -499,9 +578,11 @@ void packet()
 		}
 		current_sample = 0;
 		current_len = settings[current_fragment].len;
+		full_phase = settings[current_fragment].phase;
+		full_phase_bits = settings[current_fragment].phase_bits;
 		//debug("step_state start 0");
 		step_state = STEP_STATE_PROBE;
-		arch_set_speed(time_per_sample);
+		arch_set_speed(settings[current_fragment].time_per_sample);
 		write_ack();
 		return;
 	}
@@ -41,6 +41,13 @@
 // static const uint8_t MASK1[3] = {0x4b, 0x2d, 0x1e}
 // Codes (low nybble is data): f0 91 a2 c3 c4 a5 96 f7 88 e9 da bb bc dd ee (8f)
 // These are defined in firmware.h.
+
+// Sliding window extension: if the host sends its window size in CMD_BEGIN,
+// more than 3 packets can be in flight.  Packets from the host then carry an
+// 8 bit serial as an extra last data byte, and they are acknowledged with
+// CMD_LINK packets instead of single bytes.  Acks are cumulative; a nack
+// requests a resend starting at the first missing packet.  Packets to the
+// host still use the 2 bit flipflop.  CMD_ID returns to the old protocol.
 // }}}
 
 // Static variables. {{{
@@ -59,6 +66,10 @@ static const uint8_t MASK[5][4] = {
 static const uint8_t cmd_ack[4] = { CMD_ACK0, CMD_ACK1, CMD_ACK2, CMD_ACK3 };
 static const uint8_t cmd_nack[4] = { CMD_NACK0, CMD_NACK1, CMD_NACK2, CMD_NACK3 };
 static const uint8_t cmd_stall[4] = { CMD_STALL0, CMD_STALL1, CMD_STALL2, CMD_STALL3 };
+
+// With the sliding window, a gap is reported only once until it is filled.
+static bool link_nacked = false;
+static void send_link(uint8_t type, uint8_t which);
 // }}}
 
 static inline int16_t fullpacketlen() { // {{{
@@ -74,6 +85,9 @@ static inline int16_t fullpacketlen() { // {{{
 	else if ((command(0) & 0x1f) == CMD_SPI) {
 		return 2 + ((command(1) + 7) >> 3);
 	}
+	else if ((command(0) & 0x1f) == CMD_MOVE_PACKED) {
+		return 3 + command(2);
+	}
 	else
 		return minpacketlen();
 }
@@ -86,7 +100,10 @@ static void clear_overflow() { // {{{
 	serial_buffer_tail = serial_buffer;
 	serial_overflow = false;
 	debug_dump();
-	arch_serial_write(cmd_nack[ff_in]);
+	if (link_window)
+		send_link(LINK_NACK, ff_in);
+	else
+		arch_serial_write(cmd_nack[ff_in]);
 }
 // }}}
 
@@ -204,6 +221,9 @@ void serial() { // {{{
 			// and can happen at any time.
 			// Response is to send the machine id, and temporarily disable all temperature readings.
 			arch_claim_serial();
+			// A new connection starts with the flipflop protocol.
+			link_window = 0;
+			ff_in &= 3;
 			send_id(CMD_ID);
 			inc_tail(1);
 			continue;
@@ -249,7 +269,8 @@ void serial() { // {{{
 			return;
 		}
 	}
-	int16_t fulllen = fullpacketlen();
+	// With the sliding window, the full serial is sent as an extra last byte.
+	int16_t fulllen = fullpacketlen() + (link_window ? 1 : 0);
 	cmd_len = fulllen + (fulllen + 2) / 3;
 	sdebug("len %d %d %d", len, cmd_len, fulllen);
 	if (command_end + len > cmd_len) {
@@ -307,23 +328,45 @@ void serial() { // {{{
 	sdebug2("good");
 	if (had_stall) {
 		debug("repeating stall");
-		arch_serial_write(cmd_stall[ff_in]);
+		if (link_window)
+			send_link(LINK_STALL, ff_in);
+		else
+			arch_serial_write(cmd_stall[ff_in]);
 		inc_tail(cmd_len);
 		return;
 	}
-	// Flip-flop must have good state.
-	uint8_t which = (command(0) >> 5) & 3;
-	if (which != ff_in)
-	{
-		// Wrong: this must be a retry to send the previous packet, so our ack was lost.
-		// Resend the ack, but don't do anything (the action has already been taken).
-		debug("duplicate %d %d len: %d", ff_in, which, cmd_len);
+	if (link_window) {
+		uint8_t which = command(fulllen - 1);
+		if (which != ff_in) {
+			inc_tail(cmd_len);
+			if (uint8_t(ff_in - which) <= link_window) {
+				// Retry of a packet that was already handled; our ack was lost.
+				send_link(LINK_ACK, ff_in - 1);
+			}
+			else if (!link_nacked) {
+				// A packet before this one was lost; request everything from there.
+				debug("gap %d %d", ff_in, which);
+				link_nacked = true;
+				send_link(LINK_NACK, ff_in);
+			}
+			return;
+		}
+	}
+	else {
+		// Flip-flop must have good state.
+		uint8_t which = (command(0) >> 5) & 3;
+		if (which != ff_in)
+		{
+			// Wrong: this must be a retry to send the previous packet, so our ack was lost.
+			// Resend the ack, but don't do anything (the action has already been taken).
+			debug("duplicate %d %d len: %d", ff_in, which, cmd_len);
 #ifdef DEBUG_FF
-		debug("old ff_in: %d", ff_in);
+			debug("old ff_in: %d", ff_in);
 #endif
-		inc_tail(cmd_len);
-		arch_serial_write(cmd_ack[which]);
-		return;
+			inc_tail(cmd_len);
+			arch_serial_write(cmd_ack[which]);
+			return;
+		}
 	}
 #ifdef DEBUG_FF
 	debug("new ff_in: %d", ff_in);
@@ -408,6 +451,17 @@ void send_packet()
 }
 // }}}
 
+// Send sliding window status; this packet has no serial and is not acked.
+static void send_link(uint8_t type, uint8_t which) { // {{{
+	uint8_t link[4];
+	link[0] = CMD_LINK;
+	link[1] = which;
+	link[2] = type;
+	int16_t len = prepare_packet(3, link);
+	for (uint8_t i = 0; i < len; ++i)
+		arch_serial_write(link[i]);
+} // }}}
+
 void send_id(uint8_t cmd) { // {{{
 	machineid[0] = cmd;
 	int16_t len = prepare_packet(ID_SIZE + UUID_SIZE + 1, machineid);
@@ -567,6 +621,12 @@ void write_ack()
 	//debug("acking %d", out_busy);
 	//debug_dump();
 	had_stall = false;
+	if (link_window) {
+		send_link(LINK_ACK, ff_in);
+		ff_in += 1;
+		link_nacked = false;
+		return;
+	}
 	arch_serial_write(cmd_ack[ff_in]);
 	ff_in = (ff_in + 1) & 3;
 }
@@ -575,6 +635,9 @@ void write_stall()
 {
 	//debug("stalling");
 	had_stall = true;
-	arch_serial_write(cmd_stall[ff_in]);
+	if (link_window)
+		send_link(LINK_STALL, ff_in);
+	else
+		arch_serial_write(cmd_stall[ff_in]);
 }
 // }}}
@@ -58,6 +58,7 @@ void setup()
 	out_busy = 0;
 	ff_in = 0;
 	ff_out = 0;
+	link_window = 0;
 	reply_ready = 0;
 	adcreply_ready = 0;
 	timeout = false;
@@ -87,6 +87,13 @@ enum HWCommands { // {{{
 	HWC_GETPIN,	// 10
 	HWC_SPI,	// 11
 	HWC_PINNAME,	// 12
+	HWC_MOVE_PACKED,// 13
+	HWC_SAMPLE_TIME,// 14
+};
+
+enum HWFeatures {
+	HWF_MOVE_PACKED = 1,
+	HWF_SAMPLE_TIME = 2
 };
 
 enum HWResponses {
@@ -103,6 +110,13 @@ enum HWResponses {
 	HWC_LIMIT,	// 19
 	HWC_TIMEOUT,	// 1a
 	HWC_PINCHANGE,	// 1b
+	HWC_LINK,	// 1c
+};
+
+enum LinkType {
+	LINK_ACK,	// All packets up to and including the serial were accepted.
+	LINK_NACK,	// Packets before the serial were accepted; resend from there.
+	LINK_STALL	// The packet was received, but not accepted.
 }; // }}}
 
 // Function declarations. {{{
@@ -110,6 +124,7 @@ int hwpacketsize(int len, int *available);
 void try_send_control();
 void arch_had_ack();
 void avr_send();
+void avr_send_fragment_packets();
 void avr_call1(uint8_t cmd, uint8_t arg);
 void avr_get_current_pos(int offset, bool check);
 bool hwpacket(int len);
@@ -146,8 +161,14 @@ void arch_addpos(int s, int m, double diff);
 void arch_stop(bool fake);
 void avr_stop2();
 bool arch_send_fragment();
+#ifdef PLANNER_THREAD
+void arch_store_fragment();
+bool arch_send_stored_fragment(int fragment);
+#endif
 void arch_start_move(int extra);
 bool arch_running();
+int arch_sample_time(int wanted);
+int arch_max_steps(int sample_time);
 void arch_home();
 off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor);
 void arch_do_discard();
@@ -161,6 +182,9 @@ void END_DEBUG();
 struct AVRSerial : public Serial_t { // {{{
 	char buffer[256];
 	int start, end_, fd;
+	// Written bytes are collected here until flush(); a whole packet is sent with one system call.
+	char out_buffer[FULL_SERIAL_COMMAND_SIZE];
+	int out_used;
 	void begin(char const *port);
 	void end() { close(fd); }
 	void write(char c);
@@ -171,7 +195,7 @@ struct AVRSerial : public Serial_t { // {{{
 			*target++ = read();
 		return len;
 	}
-	void flush() {}
+	void flush();
 	int available() {
 		if (start == end_)
 			refill();
@@ -208,6 +232,15 @@ EXTERN void (*avr_cb)();
 EXTERN int *avr_pin_name_len;
 EXTERN char **avr_pin_name;
 EXTERN bool avr_uuid_dirty;
+EXTERN uint8_t avr_features;
+// Packets of each fragment in the buffer: avr_tx_count[f] packets of at most AVR_TX_SIZE bytes.
+// Fragment avr_tx_fragment is being sent: avr_tx_next of its avr_tx_num packets are done.
+EXTERN char *avr_tx_data;
+EXTERN int *avr_tx_len;
+EXTERN int *avr_tx_count;
+EXTERN int avr_tx_fragment, avr_tx_num, avr_tx_next;
+#define AVR_TX_SIZE (3 + BYTES_PER_FRAGMENT)
+#define AVR_TX_PACKETS (NUM_MOTORS + 2)	// Per fragment.
 // }}}
 
 #define avr_write_ack(reason) do { \
@@ -218,7 +251,7 @@ EXTERN bool avr_uuid_dirty;
 #ifdef DEFINE_VARIABLES
 // Serial port communication. {{{
 int hwpacketsize(int len, int *available) { // {{{
-	int const arch_packetsize[16] = { 0, 2, 0, 2, 0, 0, 3, 0, 4, 0, 1, 3, -1, -1, -1, -1 };
+	int const arch_packetsize[16] = { 0, 2, 0, 2, 0, 0, 3, 0, 4, 0, 1, 3, 3, -1, -1, -1 };
 	if (arch_packetsize[command[1][0] & 0xf] > 0)
 		return arch_packetsize[command[1][0] & 0xf];
 	if (len < 2) {
@@ -247,7 +280,7 @@ int hwpacketsize(int len, int *available) { // {{{
 } // }}}
 
 void try_send_control() { // {{{
-	if (!avr_connected || preparing || out_busy >= 3 || avr_control_queue_length == 0)
+	if (!avr_connected || preparing || out_busy >= link_window || avr_control_queue_length == 0)
 		return;
 	avr_control_queue_length -= 1;
 	avr_buffer[0] = HWC_CONTROL;
@@ -260,6 +293,8 @@ void try_send_control() { // {{{
 } // }}}
 
 void arch_had_ack() { // {{{
+	avr_send_fragment_packets();
+	planner_send();
 	if (out_busy == 0)
 		try_send_control();
 } // }}}
@@ -270,7 +305,7 @@ void avr_send() { // {{{
 		debug("send called while not connected");
 		abort();
 	}
-	while (out_busy >= 3) {
+	while (out_busy >= link_window) {
 		//debug("avr send");
 		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
@@ -278,7 +313,7 @@ void avr_send() { // {{{
 	serial_cb[out_busy] = avr_cb;
 	avr_cb = NULL;
 	send_packet();
-	if (out_busy < 3)
+	if (out_busy < link_window)
 		try_send_control();
 } // }}}
 
@@ -430,7 +465,7 @@ bool hwpacket(int len) { // {{{
 		avr_running = false;
 		if (computing_move) {
 			//debug("underrun %d %d %d", sending_fragment, current_fragment, running_fragment);
-			if (!sending_fragment && (current_fragment - (running_fragment + command[1][2] + command[1][3]) + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > 1)
+			if (!sending_fragment && (SENT_FRAGMENT - (running_fragment + command[1][2] + command[1][3]) + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > 1)
 				arch_start_move(command[1][2]);
 			// Buffer is too slow with refilling; this will fix itself.
 		}
@@ -473,6 +508,8 @@ bool hwpacket(int len) { // {{{
 			//debug("fragment %d: cbs=%d current=%d", f, history[f].cbs, current_fragment);
 			cbs += history[f].cbs;
 			history[f].cbs = 0;
+			run_events_fire(history[f].event_end);
+			history[f].event_end = 0;
 		}
 		if (!avr_running) {
 			cbs += cbs_after_current_move;
@@ -481,8 +518,8 @@ bool hwpacket(int len) { // {{{
 		//debug("cbs: %d after current %d computing %d", cbs, cbs_after_current_move, computing_move);
 		if (cbs && !host_block)
 			send_host(CMD_MOVECB, cbs);
-		if ((current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER + 1 < command[1][offset + 1] + command[1][offset + 2]) {
-			debug("Done count %d+%d higher than busy fragments %d+1; clipping", command[1][offset + 1], command[1][offset + 2], (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER);
+		if ((SENT_FRAGMENT - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER + 1 < command[1][offset + 1] + command[1][offset + 2]) {
+			debug("Done count %d+%d higher than busy fragments %d+1; clipping", command[1][offset + 1], command[1][offset + 2], (SENT_FRAGMENT - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER);
 			avr_write_ack("invalid done");
 			//abort();
 		}
@@ -490,11 +527,11 @@ bool hwpacket(int len) { // {{{
 			avr_write_ack("done");
 		running_fragment = (running_fragment + command[1][offset + 1]) % FRAGMENTS_PER_BUFFER;
 		//debug("running -> %x", running_fragment);
-		if (current_fragment == running_fragment && command[1][0] == HWC_DONE) {
+		if (SENT_FRAGMENT == running_fragment && command[1][0] == HWC_DONE) {
 			debug("Done received, but should be underrun");
 			//abort();
 		}
-		if (out_busy < 3)
+		if (out_busy < link_window)
 			buffer_refill();
 		//else
 		//	debug("no refill");
@@ -724,6 +761,10 @@ void arch_reset() { // {{{
 	}
 	// Wait for reset to complete.
 	sleep(2);
+	// The firmware returns to the flipflop protocol when it receives CMD_ID.
+	link_window = 3;
+	link_mask = 3;
+	ff_out &= 3;
 	avr_serial.write(CMD_ACK1);
 	avr_serial.write(CMD_ACK2);
 	avr_serial.write(CMD_ACK3);
@@ -734,6 +775,7 @@ void arch_reset() { // {{{
 	avr_serial.write(CMD_STALLACK);
 	// Just in case the controller was reset: reclaim port by requesting ID.
 	avr_serial.write(CMD_ID);
+	avr_serial.flush();
 	avr_call1(HWC_PING, 0);
 	avr_call1(HWC_PING, 1);
 	avr_call1(HWC_PING, 2);
@@ -867,7 +909,7 @@ void arch_change(bool motors) { // {{{
 } // }}}
 
 void arch_motors_change() { // {{{
-	if (preparing || out_busy >= 3) {
+	if (preparing || out_busy >= link_window) {
 		change_pending = true;
 		return;
 	}
@@ -945,6 +987,15 @@ static void avr_connect3() { // {{{
 				sp.motor[m]->avr_data = new DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(DATA_TYPE)];
 			}
 		}
+		delete[] avr_tx_data;
+		delete[] avr_tx_len;
+		delete[] avr_tx_count;
+		avr_tx_data = new char[FRAGMENTS_PER_BUFFER * AVR_TX_PACKETS * AVR_TX_SIZE];
+		avr_tx_len = new int[FRAGMENTS_PER_BUFFER * AVR_TX_PACKETS];
+		avr_tx_count = new int[FRAGMENTS_PER_BUFFER];
+		avr_tx_fragment = 0;
+		avr_tx_num = 0;
+		avr_tx_next = 0;
 		connect_end();
 		return;
 	}
@@ -965,6 +1016,17 @@ void avr_connect2() { // {{{
 	NUM_MOTORS = command[1][8];
 	FRAGMENTS_PER_BUFFER = command[1][9];
 	BYTES_PER_FRAGMENT = command[1][10];
+	avr_features = command[1][1] > 12 ? command[1][12] : 0;
+	// Firmware that supports the sliding window link extension reports its window; it is used from the next packet.
+	if (command[1][1] > 11 && uint8_t(command[1][11]) > 3) {
+		link_window = uint8_t(command[1][11]) < LINK_WINDOW ? uint8_t(command[1][11]) : LINK_WINDOW;
+		link_mask = 0xff;
+	}
+	else {
+		link_window = 3;
+		link_mask = 3;
+		ff_out &= 3;
+	}
 	//id[0][:8] + '-' + id[0][8:12] + '-' + id[0][12:16] + '-' + id[0][16:20] + '-' + id[0][20:32]
 	for (int i = 0; i < UUID_SIZE; ++i)
 		uuid[i] = command[1][11 + i];
@@ -1000,11 +1062,13 @@ void arch_connect(char const *run_id, char const *port) { // {{{
 	arch_reset();
 	// Get constants.
 	avr_buffer[0] = HWC_BEGIN;
-	avr_buffer[1] = 10;
+	avr_buffer[1] = 11;
 	for (int i = 0; i < ID_SIZE; ++i)
 		avr_buffer[2 + i] = run_id[i];
+	// Requested window; older firmware ignores this byte.
+	avr_buffer[10] = LINK_WINDOW;
 	wait_for_reply[expected_replies++] = avr_connect2;
-	prepare_packet(avr_buffer, 10);
+	prepare_packet(avr_buffer, 11);
 	avr_send();
 } // }}}
 
@@ -1026,7 +1090,7 @@ void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bo
 	}
 	// Make sure the controls for the heater and fan have been sent, otherwise they override this.
 	try_send_control();
-	while (out_busy >= 3) {
+	while (out_busy >= link_window) {
 		//debug("avr send");
 		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
@@ -1101,6 +1165,7 @@ void arch_reconnect(char *port) { // {{{
 		return;
 	for (int i = 0; i < 4; ++i)
 		avr_serial.write(cmd_nack[i]);	// Just to be sure.
+	avr_serial.flush();
 } // }}}
 // }}}
 
@@ -1108,6 +1173,8 @@ void arch_reconnect(char *port) { // {{{
 int arch_tick() { // {{{
 	if (avr_connected) {
 		serial(1);
+		avr_send_fragment_packets();
+		planner_send();
 		return 500;
 	}
 	return -1;
@@ -1130,13 +1197,14 @@ void arch_addpos(int s, int m, double diff) { // {{{
 } // }}}
 
 void arch_stop(bool fake) { // {{{
+	planner_stop();
 	if (!avr_connected) {
 		stop_pending = true;
 		return;
 	}
 	//debug("blocking host");
 	host_block = true;
-	if (preparing || out_busy >= 3) {
+	if (preparing || out_busy >= link_window) {
 		//debug("not yet stopping");
 		stop_pending = true;
 		return;
@@ -1165,6 +1233,7 @@ void avr_stop2() { // {{{
 	avr_get_current_pos(3, false);
 	current_fragment = running_fragment;
 	//debug("current_fragment = running_fragment; %d", current_fragment);
+	planner_drop();
 	current_fragment_pos = 0;
 	num_active_motors = 0;
 	//debug("no longer blocking host 2");
@@ -1173,6 +1242,43 @@ void avr_stop2() { // {{{
 	serial(0);	// Handle any data that was refused before.
 } // }}}
 
+static int avr_pack_fragment(int const *value, int num, char *target, int max) { // {{{
+	// Encode samples for HWC_MOVE_PACKED.  Each code byte is one of:
+	// 0ddddddd: add the 7 bit signed delta d to the value; one sample.
+	// 10cccccc: repeat the value c + 1 times.
+	// 11000000: the next 2 bytes are the new value; one sample.
+	// The value starts at 0.  Returns the length, or -1 if it doesn't fit in max.
+	int len = 0;
+	int current = 0;
+	for (int i = 0; i < num; ) {
+		if (value[i] == current) {
+			int count = 1;
+			while (i + count < num && count < 0x40 && value[i + count] == current)
+				++count;
+			if (len + 1 > max)
+				return -1;
+			target[len++] = 0x80 | (count - 1);
+			i += count;
+			continue;
+		}
+		int delta = value[i] - current;
+		if (delta >= -0x40 && delta < 0x40) {
+			if (len + 1 > max)
+				return -1;
+			target[len++] = delta & 0x7f;
+		}
+		else {
+			if (len + 3 > max)
+				return -1;
+			target[len++] = 0xc0;
+			target[len++] = value[i] & 0xff;
+			target[len++] = (value[i] >> 8) & 0xff;
+		}
+		current = value[i++];
+	}
+	return len;
+} // }}}
+
 static void avr_sent_fragment() { // {{{
 	if (sending_fragment == 0) {
 		debug("calling avr_sent_fragment with zero sending_fragment");
@@ -1185,66 +1291,122 @@ static void avr_sent_fragment() { // {{{
 	}
 } // }}}
 
-bool arch_send_fragment() { // {{{
-	if (!avr_connected || host_block || stopping || discard_pending || stop_pending) {
-		//debug("not sending arch frag %d %d %d %d", host_block, stopping, discard_pending, stop_pending);
-		return false;
+void avr_send_fragment_packets() { // {{{
+	// Send as many packets of the current fragment as the link allows.
+	// This is called again when acks arrive, so it never waits.
+	while (avr_tx_next < avr_tx_num && !preparing && out_busy < link_window) {
+		if (host_block || stopping || stop_pending) {
+			// The fragment will not be used anymore.
+			avr_tx_next = avr_tx_num;
+			break;
+		}
+		int slot = avr_tx_fragment * AVR_TX_PACKETS + avr_tx_next;
+		int len = avr_tx_len[slot];
+		memcpy(avr_buffer, &avr_tx_data[slot * AVR_TX_SIZE], len);
+		avr_tx_next += 1;
+		if (!prepare_packet(avr_buffer, len)) {
+			avr_tx_next = avr_tx_num;
+			break;
+		}
+		avr_cb = &avr_sent_fragment;
+		avr_send();
 	}
-	while (out_busy >= 3) {
-		poll(&pollfds[BASE_FDS], 1, -1);
-		serial(1);
+	if (avr_tx_next >= avr_tx_num && transmitting_fragment) {
+		transmitting_fragment = false;
+		avr_filling = false;
 	}
-	if (stop_pending || discard_pending)
-		return false;
-	avr_buffer[0] = settings.probing ? HWC_START_PROBE : HWC_START_MOVE;
+} // }}}
+
+static void avr_store_fragment(int fragment) { // {{{
+	// Store all packets for the current fragment; they are sent from the main loop as the link has room.
+	int first = fragment * AVR_TX_PACKETS;
+	char *packet = &avr_tx_data[first * AVR_TX_SIZE];
+	int num = 0;
+	if (settings.sample_time != hwtime_step) {
+		// Only sent when it differs; the firmware uses the time from setup otherwise.
+		packet[0] = HWC_SAMPLE_TIME;
+		packet[1] = settings.sample_time & 0xff;
+		packet[2] = (settings.sample_time >> 8) & 0xff;
+		avr_tx_len[first + num++] = 3;
+		packet = &avr_tx_data[(first + num) * AVR_TX_SIZE];
+	}
+	packet[0] = settings.probing ? HWC_START_PROBE : HWC_START_MOVE;
 	//debug("send fragment current-fragment-pos=%d current-fragment=%d active-moters=%d running=%d num-running=0x%x", current_fragment_pos, current_fragment, num_active_motors, running_fragment, (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER);
-	avr_buffer[1] = current_fragment_pos * 2;
-	avr_buffer[2] = num_active_motors;
-	sending_fragment = num_active_motors + 1;
-	if (prepare_packet(avr_buffer, 3)) {
-		transmitting_fragment = true;
-		avr_cb = &avr_sent_fragment;
-		avr_send();
-		int mi = 0;
-		avr_filling = true;
-		int cfp = current_fragment_pos;
-		for (int s = 0; !host_block && !stopping && !discard_pending && !stop_pending && s < NUM_SPACES; mi += spaces[s++].num_motors) {
-			for (uint8_t m = 0; !host_block && !stopping && !discard_pending && !stop_pending && m < spaces[s].num_motors; ++m) {
-				if (!spaces[s].motor[m]->active)
-					continue;
-				cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
-				//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
-				while (out_busy >= 3) {
-					poll(&pollfds[BASE_FDS], 1, -1);
-					serial(1);
-				}
-				if (stop_pending || discard_pending)
-					break;
-				avr_buffer[0] = settings.single ? HWC_MOVE_SINGLE : HWC_MOVE;
-				avr_buffer[1] = mi + m;
+	packet[1] = current_fragment_pos * 2;
+	packet[2] = num_active_motors;
+	avr_tx_len[first + num++] = 3;
+	int mi = 0;
+	int cfp = current_fragment_pos;
+	for (int s = 0; s < NUM_SPACES; mi += spaces[s++].num_motors) {
+		for (uint8_t m = 0; m < spaces[s].num_motors; ++m) {
+			if (!spaces[s].motor[m]->active)
+				continue;
+			cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
+			//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
+			packet = &avr_tx_data[(first + num) * AVR_TX_SIZE];
+			int value[0x80];	// SAMPLES_PER_FRAGMENT is less than this, because BYTES_PER_FRAGMENT is 8 bit.
+			for (int i = 0; i < cfp; ++i)
+				value[i] = int16_t((spaces[s].motor[m]->dir_pin.inverted() ? -1 : 1) * spaces[s].motor[m]->avr_data[i]);
+			// Use the packed encoding if the firmware supports it and it is shorter.
+			int packed = avr_features & HWF_MOVE_PACKED ? avr_pack_fragment(value, cfp, &packet[3], 2 * cfp - 2) : -1;
+			if (packed >= 0) {
+				packet[0] = HWC_MOVE_PACKED;
+				packet[1] = (mi + m) | (settings.single ? 0x80 : 0);
+				packet[2] = packed;
+				avr_tx_len[first + num++] = 3 + packed;
+			}
+			else {
+				packet[0] = settings.single ? HWC_MOVE_SINGLE : HWC_MOVE;
+				packet[1] = mi + m;
 				for (int i = 0; i < cfp; ++i) {
-					int value = (spaces[s].motor[m]->dir_pin.inverted() ? -1 : 1) * spaces[s].motor[m]->avr_data[i];
-					avr_buffer[2 + 2 * i] = value & 0xff;
-					avr_buffer[2 + 2 * i + 1] = (value >> 8) & 0xff;
-				}
-				if (prepare_packet(avr_buffer, 2 + 2 * cfp)) {
-					avr_cb = &avr_sent_fragment;
-					avr_send();
+					packet[2 + 2 * i] = value[i] & 0xff;
+					packet[2 + 2 * i + 1] = (value[i] >> 8) & 0xff;
 				}
-				else
-					break;
+				avr_tx_len[first + num++] = 2 + 2 * cfp;
 			}
 		}
-		transmitting_fragment = false;
 	}
-	avr_filling = false;
-	return !host_block && !stopping && !discard_pending && !stop_pending;
+	avr_tx_count[fragment] = num;
+} // }}}
+
+static void avr_transmit_fragment(int fragment) { // {{{
+	avr_tx_fragment = fragment;
+	avr_tx_num = avr_tx_count[fragment];
+	avr_tx_next = 0;
+	sending_fragment = avr_tx_num;
+	transmitting_fragment = true;
+	avr_filling = true;
+	avr_send_fragment_packets();
 } // }}}
 
+bool arch_send_fragment() { // {{{
+	if (!avr_connected || host_block || stopping || discard_pending || stop_pending || transmitting_fragment) {
+		//debug("not sending arch frag %d %d %d %d", host_block, stopping, discard_pending, stop_pending);
+		return false;
+	}
+	avr_store_fragment(current_fragment);
+	avr_transmit_fragment(current_fragment);
+	return true;
+} // }}}
+
+#ifdef PLANNER_THREAD
+void arch_store_fragment() { // {{{
+	// Called by the planner thread; the fragment is sent later by arch_send_stored_fragment().
+	avr_store_fragment(current_fragment);
+} // }}}
+
+bool arch_send_stored_fragment(int fragment) { // {{{
+	if (!avr_connected || host_block || stopping || discard_pending || stop_pending || transmitting_fragment || sending_fragment)
+		return false;
+	avr_transmit_fragment(fragment);
+	return true;
+} // }}}
+#endif
+
 void arch_start_move(int extra) { // {{{
 	if (host_block)
 		return;
-	if (!avr_connected || preparing || sending_fragment || out_busy >= 3) {
+	if (!avr_connected || preparing || sending_fragment || out_busy >= link_window) {
 		//debug("no start yet");
 		start_pending = true;
 		return;
@@ -1253,12 +1415,12 @@ void arch_start_move(int extra) { // {{{
 		//debug("not startable");
 		return;
 	}
-	if ((running_fragment - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER <= extra + 2) {
+	if ((running_fragment - SENT_FRAGMENT + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER <= extra + 2) {
 		//debug("no buffer no start");
 		return;
 	}
 	//debug("start move %d %d %d %d", current_fragment, running_fragment, sending_fragment, extra);
-	while (out_busy >= 3) {
+	while (out_busy >= link_window) {
 		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
 	}
@@ -1277,7 +1439,7 @@ void arch_home() { // {{{
 	if (!avr_connected)
 		return;
 	avr_homing = true;
-	while (out_busy >= 3) {
+	while (out_busy >= link_window) {
 		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
 	}
@@ -1302,6 +1464,22 @@ void arch_home() { // {{{
 		avr_send();
 } // }}}
 
+int arch_sample_time(int wanted) { // {{{
+	// Older firmware only knows the sample time from setup.  The firmware
+	// stores it in 16 bits and needs a few ISR calls per sample.
+	if (!(avr_features & HWF_SAMPLE_TIME))
+		return hwtime_step;
+	return max(min(wanted, 0xffff), min(hwtime_step, 1000));
+} // }}}
+
+int arch_max_steps(int sample_time) { // {{{
+	// The firmware does at most 0x7e steps per ISR call and at most 128 ISR calls per sample, one every 75 μs.
+	int phase = 1;
+	while (phase < 128 && sample_time / 75 >= phase * 2)
+		phase *= 2;
+	return 0x7e * phase;
+} // }}}
+
 void arch_stop_audio() { // {{{
 	if (avr_audio < 0)
 		return;
@@ -1322,7 +1500,7 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 	int len = max - pos >= NUM_MOTORS * BYTES_PER_FRAGMENT ? BYTES_PER_FRAGMENT : (max - pos) / NUM_MOTORS;
 	if (len <= 0)
 		return max;
-	while (out_busy >= 3) {
+	while (out_busy >= link_window) {
 		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
 	}
@@ -1338,7 +1516,7 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 	avr_send();
 	avr_filling = true;
 	for (int m = 0; m < NUM_MOTORS; ++m) {
-		while (out_busy >= 3) {
+		while (out_busy >= link_window) {
 			poll(&pollfds[BASE_FDS], 1, -1);
 			serial(1);
 		}
@@ -1358,8 +1536,12 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 } // }}}
 
 void arch_do_discard() { // {{{
+	if (avr_filling)
+		return;	// This is called again when the fragment has been sent.
+	planner_stop();
 	int cbs = 0;
-	while (out_busy >= 3) {
+	int event_end = 0;
+	while (out_busy >= link_window) {
 		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
 	}
@@ -1369,20 +1551,30 @@ void arch_do_discard() { // {{{
 	int fragments = (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
 	if (fragments <= 2)
 		return;
+	// Fragments that are still in the planner ring were not sent; they are dropped without telling the firmware.
+	int sent = (SENT_FRAGMENT - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
 	for (int i = 0; i < fragments - 2; ++i) {
 		current_fragment = (current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
 		//debug("current_fragment = (current_fragment - 1 + FRAGMENTS_PER_BUFFER) %% FRAGMENTS_PER_BUFFER; %d", current_fragment);
 		//debug("restoring %d %d", current_fragment, history[current_fragment].cbs);
 		cbs += history[current_fragment].cbs;
+		if (history[current_fragment].event_end > event_end)
+			event_end = history[current_fragment].event_end;
 	}
 	restore_settings();
+	planner_drop();
 	history[(current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER].cbs += cbs + cbs_after_current_move;
+	// Events from discarded fragments happen a bit early, like the cbs.
+	run_events_attach(event_end > event_after_current_move ? event_end : event_after_current_move);
+	event_after_current_move = 0;
 	//debug("cbs after current cleared after setting %d+%d in history", cbs, cbs_after_current_move);
 	cbs_after_current_move = 0;
-	avr_buffer[0] = HWC_DISCARD;
-	avr_buffer[1] = fragments - 2;
 	// We're in the middle of a move again, so make sure the computation is restarted.
 	computing_move = true;
+	if (sent <= 2)
+		return;
+	avr_buffer[0] = HWC_DISCARD;
+	avr_buffer[1] = sent - 2;
 	if (prepare_packet(avr_buffer, 2))
 		avr_send();
 } // }}}
@@ -1399,7 +1591,7 @@ void arch_discard() { // {{{
 void arch_send_spi(int bits, uint8_t *data) { // {{{
 	if (!avr_connected)
 		return;
-	while (out_busy >= 3) {
+	while (out_busy >= link_window) {
 		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
 	}
@@ -1464,6 +1656,7 @@ void AVRSerial::begin(char const *port) { // {{{
 	pollfds[BASE_FDS].revents = 0;
 	start = 0;
 	end_ = 0;
+	out_used = 0;
 	fcntl(fd, F_SETFL, O_NONBLOCK);
 } // }}}
 
@@ -1475,17 +1668,33 @@ void AVRSerial::write(char c) { // {{{
 		debug("writing to serial while not connected");
 		abort();
 	}
-	while (true) {
+	if (out_used == int(sizeof(out_buffer)))
+		flush();
+	out_buffer[out_used++] = c;
+} // }}}
+
+void AVRSerial::flush() { // {{{
+	int done = 0;
+	while (done < out_used) {
 		errno = 0;
-		int ret = ::write(fd, &c, 1);
-		if (ret == 1)
-			break;
+		int ret = ::write(fd, &out_buffer[done], out_used - done);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			debug("write to avr failed: %d %s", ret, strerror(errno));
+			out_used = 0;
 			disconnect(true);
 			return;	// This causes protocol errors during reconnect, but they will be handled.
 		}
+		// Wait until the port accepts more data, instead of spinning.
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, -1);
 	}
+	out_used = 0;
 } // }}}
 
 void AVRSerial::refill() { // {{{
@@ -122,6 +122,8 @@ struct bbb_Pru { // {{{
 	// These must be bytes, because read and write must be atomic.
 	volatile uint8_t current_sample, current_fragment, next_fragment, state;
 	volatile uint16_t buffer[FRAGMENTS_PER_BUFFER][SAMPLES_PER_FRAGMENT][2];
+	// Ticks of 1 μs per sample, minus the 5 that are used for the step, for every fragment.
+	volatile uint16_t ticks[FRAGMENTS_PER_BUFFER];
 } __attribute__ ((packed)); // }}}
 
 // Function declarations. {{{
@@ -143,6 +145,12 @@ void arch_home();
 bool arch_running();
 void arch_start_move(int extra);
 bool arch_send_fragment();
+#ifdef PLANNER_THREAD
+void arch_store_fragment();
+bool arch_send_stored_fragment(int fragment);
+#endif
+int arch_sample_time(int wanted);
+int arch_max_steps(int sample_time);
 int arch_fds();
 int arch_tick();
 void arch_set_duty(Pin_t pin, double duty);
@@ -416,6 +424,8 @@ void arch_setup_start() { // {{{
 	bbb_pru->current_sample = 0;
 	bbb_pru->next_fragment = 0;
 	bbb_pru->state = 1;
+	for (int f = 0; f < FRAGMENTS_PER_BUFFER; ++f)
+		bbb_pru->ticks[f] = 40 - 5;
 #ifndef FAKE
 	debug("pru exec %d", prussdrv_exec_program(PRU, "/usr/lib/franklin/bb/bbb_pru.bin"));
 #endif
@@ -546,17 +556,21 @@ int arch_tick() { // {{{
 	int cf = bbb_pru->current_fragment;
 	if (cf != running_fragment) {
 		debug("cf=%d, runn=%d", cf, running_fragment);
+		planner_stop();
 		int cbs = 0;
 		while (cf != running_fragment) {
 			cbs += history[running_fragment].cbs;
 			history[running_fragment].cbs = 0;
+			run_events_fire(history[running_fragment].event_end);
+			history[running_fragment].event_end = 0;
 			running_fragment = (running_fragment + 1) % FRAGMENTS_PER_BUFFER;
 		}
 		if (cbs)
 			send_host(CMD_MOVECB, cbs);
 		buffer_refill();
 		run_file_fill_queue();
-		if (!computing_move && run_file_finishing) {
+		// Events after the last motion happen when its fragment is done; wait for that.
+		if (!computing_move && !planner_pending() && run_file_finishing && running_fragment == SENT_FRAGMENT) {
 			send_host(CMD_FILE_DONE);
 			abort_run_file();
 		}
@@ -749,10 +763,36 @@ void arch_start_move(int extra) { // {{{
 bool arch_send_fragment() { // {{{
 	if (stopping)
 		return false;
+	bbb_pru->ticks[current_fragment] = settings.sample_time - 5;
 	bbb_pru->next_fragment = (bbb_pru->next_fragment + 1) & BBB_PRU_FRAGMENT_MASK;
 	return true;
 } // }}}
 
+#ifdef PLANNER_THREAD
+void arch_store_fragment() { // {{{
+	// The samples are already in pru memory; the pru doesn't use them until they are sent.
+	bbb_pru->ticks[current_fragment] = settings.sample_time - 5;
+} // }}}
+
+bool arch_send_stored_fragment(int fragment) { // {{{
+	(void)&fragment;
+	if (stopping)
+		return false;
+	bbb_pru->next_fragment = (bbb_pru->next_fragment + 1) & BBB_PRU_FRAGMENT_MASK;
+	return true;
+} // }}}
+#endif
+
+int arch_sample_time(int wanted) { // {{{
+	// Every sample can do only one step, so never use shorter samples.
+	return max(wanted, hwtime_step);
+} // }}}
+
+int arch_max_steps(int sample_time) { // {{{
+	(void)&sample_time;
+	return 1;
+} // }}}
+
 int arch_fds() { // {{{
 	return ARCH_MAX_FDS;
 } // }}}
@@ -774,13 +814,15 @@ void arch_set_duty(Pin_t _pin, double duty) { // TODO
 }
 
 void arch_discard() { // {{{
+	planner_stop();
 	int fragments = (current_fragment - bbb_pru->current_fragment) & BBB_PRU_FRAGMENT_MASK;
 	if (fragments <= 2)
 		return;
 	current_fragment = (current_fragment - (fragments - 2)) & BBB_PRU_FRAGMENT_MASK;
 	//debug("current_fragment = (current_fragment - (fragments - 2)) & BBB_PRU_FRAGMENT_MASK; %d", current_fragment);
-	bbb_pru->next_fragment = current_fragment;
 	restore_settings();
+	planner_drop();
+	bbb_pru->next_fragment = SENT_FRAGMENT;
 } // }}}
 
 void arch_send_spi(int bits, uint8_t *data) { // {{{
@@ -0,0 +1,337 @@
+/* arch-null.h - null backend for benchmarking Franklin {{{
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * }}} */
+
+// This backend has no hardware behind it.  Fragments are accepted as soon
+// as they are sent and retired on the next arch_tick(), so the planner runs
+// as fast as the cpu allows.  Until then, arch_discard() can drop them like
+// the beaglebone backend does.  It is used by franklin-cdriver-bench.
+
+#ifndef ADCBITS
+
+// Includes and defines. {{{
+#include <stdint.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#define NUM_DIGITAL_PINS 32
+#define NUM_ANALOG_INPUTS 8
+#define NUM_PINS (NUM_DIGITAL_PINS + NUM_ANALOG_INPUTS)
+#define ADCBITS 10
+// Same buffer geometry as an atmega2560 build of the firmware.
+#define FRAGMENTS_PER_BUFFER 16
+#define SAMPLES_PER_FRAGMENT 8
+
+#define ARCH_MOTOR
+#define ARCH_SPACE
+#define ARCH_NEW_MOTOR(s, m, base) do {} while (0)
+#define DATA_DELETE(s, m) do {} while (0)
+#define DATA_CLEAR(s, m) do {} while (0)
+#define DATA_SET(s, m, v) do { null_steps += abs(v); null_fragment_steps[current_fragment] += abs(v); } while (0)
+
+#define ARCH_MAX_FDS 0	// Maximum number of fds for arch-specific purposes.
+// }}}
+
+#else
+
+// Variables. {{{
+EXTERN bool null_running;
+EXTERN int64_t null_fragments;	// Number of fragments accepted.
+EXTERN int64_t null_samples;	// Number of samples in those fragments.
+EXTERN int64_t null_time;	// Duration of those samples [μs].
+EXTERN int64_t null_steps;	// Number of steps in those samples, for all motors.
+EXTERN int null_stored_samples[FRAGMENTS_PER_BUFFER];	// Samples in finished fragments, for taking them back when they are discarded.
+EXTERN int null_stored_time[FRAGMENTS_PER_BUFFER];	// Sample time of those fragments [μs].
+EXTERN int64_t null_fragment_steps[FRAGMENTS_PER_BUFFER];	// Steps in each fragment.
+// }}}
+
+// Function declarations. {{{
+void SET_OUTPUT(Pin_t _pin);
+void SET_INPUT(Pin_t _pin);
+void SET_INPUT_NOPULLUP(Pin_t _pin);
+void SET(Pin_t _pin);
+void RESET(Pin_t _pin);
+void GET(Pin_t _pin, bool _default, void(*cb)(bool));
+void arch_setup_start();
+void arch_setup_end();
+void arch_connect(char const *run_id, char const *port);
+void arch_request_temp(int which);
+void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin = ~0, bool heater_invert = false, int heater_adctemp = 0, int heater_limit_l = ~0, int heater_limit_h = ~0, int fan_pin = ~0, bool fan_invert = false, int fan_adctemp = 0, int fan_limit_l = ~0, int fan_limit_h = ~0, double hold_time = 0);
+void arch_motors_change();
+void arch_addpos(int s, int m, double diff);
+void arch_stop(bool fake);
+void arch_home();
+bool arch_running();
+void arch_start_move(int extra);
+bool arch_send_fragment();
+#ifdef PLANNER_THREAD
+void arch_store_fragment();
+bool arch_send_stored_fragment(int fragment);
+#endif
+int arch_sample_time(int wanted);
+int arch_max_steps(int sample_time);
+int arch_fds();
+int arch_tick();
+void arch_set_duty(Pin_t pin, double duty);
+double arch_get_duty(Pin_t pin);
+void arch_discard();
+void arch_send_spi(int bits, uint8_t *data);
+off_t arch_send_audio(uint8_t *data, off_t sample, off_t num_records, int motor);
+// }}}
+
+#ifdef DEFINE_VARIABLES
+// Pins. {{{
+void SET_OUTPUT(Pin_t _pin) { // {{{
+	(void)&_pin;
+} // }}}
+
+void SET_INPUT(Pin_t _pin) { // {{{
+	(void)&_pin;
+} // }}}
+
+void SET_INPUT_NOPULLUP(Pin_t _pin) { // {{{
+	(void)&_pin;
+} // }}}
+
+void SET(Pin_t _pin) { // {{{
+	(void)&_pin;
+} // }}}
+
+void RESET(Pin_t _pin) { // {{{
+	(void)&_pin;
+} // }}}
+
+void GET(Pin_t _pin, bool _default, void(*cb)(bool)) { // {{{
+	(void)&_pin;
+	cb(_default);
+} // }}}
+
+double arch_get_duty(Pin_t _pin) { // {{{
+	(void)&_pin;
+	return 1;
+} // }}}
+
+void arch_set_duty(Pin_t _pin, double duty) { // {{{
+	(void)&_pin;
+	(void)&duty;
+} // }}}
+// }}}
+
+// Setup helpers. {{{
+void arch_setup_start() { // {{{
+	null_running = false;
+	null_fragments = 0;
+	null_samples = 0;
+	null_time = 0;
+	null_steps = 0;
+	// Claim that firmware has correct version.
+	protocol_version = PROTOCOL_VERSION;
+} // }}}
+
+void arch_setup_end() { // {{{
+	connect_end();
+} // }}}
+
+void arch_connect(char const *run_id, char const *port) { // {{{
+	(void)&run_id;
+	(void)&port;
+} // }}}
+
+void arch_request_temp(int which) { // {{{
+	(void)&which;
+	requested_temp = ~0;
+	send_host(CMD_TEMP, 0, 0, NAN);
+} // }}}
+
+void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bool heater_invert, int heater_adctemp, int heater_limit_l, int heater_limit_h, int fan_pin, bool fan_invert, int fan_adctemp, int fan_limit_l, int fan_limit_h, double hold_time) { // {{{
+	(void)&id;
+	(void)&thermistor_pin;
+	(void)&active;
+	(void)&heater_pin;
+	(void)&heater_invert;
+	(void)&heater_adctemp;
+	(void)&heater_limit_l;
+	(void)&heater_limit_h;
+	(void)&fan_pin;
+	(void)&fan_invert;
+	(void)&fan_adctemp;
+	(void)&fan_limit_l;
+	(void)&fan_limit_h;
+	(void)&hold_time;
+} // }}}
+
+void arch_motors_change() { // {{{
+} // }}}
+// }}}
+
+// Runtime helpers. {{{
+int arch_tick() { // {{{
+	// All sent fragments are done as soon as we look.
+	planner_stop();
+	if (running_fragment != SENT_FRAGMENT) {
+		int cbs = 0;
+		while (running_fragment != SENT_FRAGMENT) {
+			cbs += history[running_fragment].cbs;
+			history[running_fragment].cbs = 0;
+			run_events_fire(history[running_fragment].event_end);
+			history[running_fragment].event_end = 0;
+			running_fragment = (running_fragment + 1) % FRAGMENTS_PER_BUFFER;
+		}
+		if (cbs)
+			send_host(CMD_MOVECB, cbs);
+	}
+	null_running = false;
+	buffer_refill();
+	run_file_fill_queue();
+	// Events after the last motion happen when its fragment is done; wait for that.
+	if (!computing_move && !planner_pending() && run_file_finishing && running_fragment == SENT_FRAGMENT) {
+		send_host(CMD_FILE_DONE);
+		abort_run_file();
+	}
+	return 0;
+} // }}}
+
+void arch_addpos(int s, int m, double diff) { // {{{
+	(void)&s;
+	(void)&m;
+	(void)&diff;
+} // }}}
+
+void arch_stop(bool fake) { // {{{
+	(void)&fake;
+	null_running = false;
+	abort_move(0);
+	current_fragment_pos = 0;
+} // }}}
+
+void arch_home() { // {{{
+	send_host(CMD_HOMED);
+} // }}}
+
+bool arch_running() { // {{{
+	return null_running || running_fragment != SENT_FRAGMENT;
+} // }}}
+
+void arch_start_move(int extra) { // {{{
+	(void)&extra;
+	if (running_fragment != SENT_FRAGMENT)
+		null_running = true;
+} // }}}
+
+bool arch_send_fragment() { // {{{
+	if (stopping)
+		return false;
+	null_fragments += 1;
+	null_samples += current_fragment_pos;
+	null_time += int64_t(current_fragment_pos) * settings.sample_time;
+	null_stored_samples[current_fragment] = current_fragment_pos;
+	null_stored_time[current_fragment] = settings.sample_time;
+	null_fragment_steps[(current_fragment + 1) % FRAGMENTS_PER_BUFFER] = 0;
+	return true;
+} // }}}
+
+#ifdef PLANNER_THREAD
+void arch_store_fragment() { // {{{
+	null_stored_samples[current_fragment] = current_fragment_pos;
+	null_stored_time[current_fragment] = settings.sample_time;
+	null_fragment_steps[(current_fragment + 1) % FRAGMENTS_PER_BUFFER] = 0;
+} // }}}
+
+bool arch_send_stored_fragment(int fragment) { // {{{
+	if (stopping)
+		return false;
+	null_fragments += 1;
+	null_samples += null_stored_samples[fragment];
+	null_time += int64_t(null_stored_samples[fragment]) * null_stored_time[fragment];
+	return true;
+} // }}}
+#endif
+
+int arch_sample_time(int wanted) { // {{{
+	return wanted;
+} // }}}
+
+int arch_max_steps(int sample_time) { // {{{
+	// Use the limits of the avr firmware: 0x7e steps per ISR call, at most 128 calls of 75 μs per sample.
+	int phase = 1;
+	while (phase < 128 && sample_time / 75 >= phase * 2)
+		phase *= 2;
+	return 0x7e * phase;
+} // }}}
+
+int arch_fds() { // {{{
+	return ARCH_MAX_FDS;
+} // }}}
+
+void arch_discard() { // {{{
+	// Drop the fragments that were not retired yet, except the next one, like the beaglebone backend.
+	planner_stop();
+	int fragments = (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
+	if (fragments <= 2)
+		return;
+	int sent = (SENT_FRAGMENT - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
+	// The dropped fragments are computed again; don't count them twice.
+	for (int i = 2; i <= fragments; ++i) {
+		int f = (running_fragment + i) % FRAGMENTS_PER_BUFFER;
+		if (i < sent) {
+			null_fragments -= 1;
+			null_samples -= null_stored_samples[f];
+			null_time -= int64_t(null_stored_samples[f]) * null_stored_time[f];
+		}
+		null_steps -= null_fragment_steps[f];
+		null_fragment_steps[f] = 0;
+	}
+	current_fragment = (running_fragment + 2) % FRAGMENTS_PER_BUFFER;
+	restore_settings();
+	planner_drop();
+} // }}}
+
+void arch_send_spi(int bits, uint8_t *data) { // {{{
+	(void)&bits;
+	(void)&data;
+} // }}}
+
+off_t arch_send_audio(uint8_t *data, off_t sample, off_t num_records, int motor) { // {{{
+	(void)&data;
+	(void)&sample;
+	(void)&motor;
+	return num_records;
+} // }}}
+
+void arch_stop_audio() { // {{{
+} // }}}
+
+double arch_round_pos(int space, int motor, double src) { // {{{
+	(void)&space;
+	(void)&motor;
+	return round(src);
+} // }}}
+// }}}
+#endif
+
+#endif
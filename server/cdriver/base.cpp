@@ -67,7 +67,7 @@ int main(int argc, char **argv) { // {{{
 	zero.it_value.tv_nsec = 0;
 	int delay = 0;
 	while (true) {
-		for (int i = 0; i < 2 + arch_fds(); ++i)
+		for (int i = 0; i < BASE_FDS + arch_fds(); ++i)
 			pollfds[i].revents = 0;
 		while (true) {
 			bool action = false;
@@ -78,8 +78,11 @@ int main(int argc, char **argv) { // {{{
 			if (!action)
 				break;
 		}
+		serialdev[0]->flush();
 		//debug("polling %d %d %d", host_block, arch_fds(), delay);
-		poll(host_block ? &pollfds[2] : pollfds, arch_fds() + (host_block ? 0 : 2), delay);
+		planner_continue();
+		// While the host is blocked, the planner thread must still be able to wake us.
+		poll(host_block ? &pollfds[BASE_FDS - 1] : pollfds, arch_fds() + (host_block ? 1 : BASE_FDS), delay);
 		//debug("return %d %d %d", pollfds[0].revents, pollfds[1].revents, pollfds[2].revents);
 		if (pollfds[0].revents) {
 			timerfd_settime(pollfds[0].fd, 0, &zero, NULL);
@@ -90,6 +93,12 @@ int main(int argc, char **argv) { // {{{
 		}
 		if (pollfds[1].revents)
 			serial(0);
+		if (pollfds[2].revents)
+			run_system_done();
+		if (pollfds[3].revents)
+			run_file_follow();
+		if (pollfds[4].revents)
+			planner_handle();
 		delay = arch_tick();
 	}
 } // }}}
@@ -63,7 +63,6 @@ skip1:
 	; wait for enough time to allow next tick.
 	wait_for_tick
 	qbne mainloop, r5, 0
-	mov r5, TICK_US - 5
 
 	; data is at buffer[fragment][sample][which] with sample array 256 elements, which array 2 elements and 2 bytes per element.
 	; So that's buffer_start + fragment * 256 * 2 * 2 + sample * 2 * 2 + which * 2; I want both which values.
@@ -98,6 +97,12 @@ skip1:
 	qbne skip2, r4.b1, r4.b2
 	mov r4.b3, 1
 skip2:
+	; The sample time is set per fragment; load the countdown for the next sample from ticks[fragment].
+	; ticks starts after the buffer: 8 + 8 * 256 * 2 * 2.
+	lsl r6, r4.b1, 1
+	mov r7, 8200
+	add r6, r6, r7
+	lbco r5.w0, CONST_OWN_DATA, r6, 2
 	sbco r4, CONST_OWN_DATA, 4, 4
 	; if state == 2: state = 0
 	qbne mainloop, r4.b3, 2
@@ -0,0 +1,348 @@
+/* bench.cpp - offline motion pipeline benchmark for Franklin
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This replaces base.cpp for franklin-cdriver-bench.  It is linked against
+// arch-null.h, sets up a machine from the command line and replays a run file
+// through next_move(), buffer_refill() and run_file_fill_queue() without any
+// hardware or host.  Motion time is simulated, so the result only depends on
+// the file, the settings and the speed of the cpu.  With -r, the buffered
+// fragments are discarded regularly and computed again; the run fails if a
+// gpio, temperature or system record is then not done exactly once.
+
+#define EXTERN	// This must be done in exactly one source file.
+#include "cdriver.h"
+#include <time.h>
+#include <getopt.h>
+
+// Time handling.  {{{
+static void get_current_times(int32_t *current_time, int32_t *longtime) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	if (current_time)
+		*current_time = tv.tv_sec * 1000000 + tv.tv_usec;
+	if (longtime)
+		*longtime = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int32_t utime() {
+	int32_t ret;
+	get_current_times(&ret, NULL);
+	return ret;
+}
+
+int32_t millis() {
+	int32_t ret;
+	get_current_times(NULL, &ret);
+	return ret;
+}
+
+static int64_t bench_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+// }}}
+
+// Timers. {{{
+static char const *bench_name[NUM_BENCH_TIMERS] = { "next_move", "move_axes", "do_steps" };
+static int64_t bench_total[NUM_BENCH_TIMERS];
+static int64_t bench_calls[NUM_BENCH_TIMERS];
+static int bench_depth[NUM_BENCH_TIMERS];
+// Every next_move latency is kept for the percentiles.
+static int64_t *bench_latency;
+static int64_t bench_num_latency, bench_max_latency;
+
+BenchTimer::BenchTimer(int which_) : which(which_), start(0) { // {{{
+	// Only the outermost call is timed; next_move() recurses for empty moves and do_steps() calls move_axes().
+	if (bench_depth[which]++ == 0)
+		start = bench_ns();
+} // }}}
+
+BenchTimer::~BenchTimer() { // {{{
+	if (--bench_depth[which] > 0)
+		return;
+	int64_t t = bench_ns() - start;
+	bench_total[which] += t;
+	bench_calls[which] += 1;
+	if (which != BENCH_NEXT_MOVE)
+		return;
+	if (bench_num_latency >= bench_max_latency) {
+		bench_max_latency = bench_max_latency ? bench_max_latency * 2 : 1024;
+		bench_latency = reinterpret_cast <int64_t *>(realloc(bench_latency, bench_max_latency * sizeof(int64_t)));
+		if (!bench_latency) {
+			debug("out of memory for latency samples");
+			abort();
+		}
+	}
+	bench_latency[bench_num_latency++] = t;
+} // }}}
+
+static int compare_latency(void const *a, void const *b) { // {{{
+	int64_t la = *reinterpret_cast <int64_t const *>(a);
+	int64_t lb = *reinterpret_cast <int64_t const *>(b);
+	return la < lb ? -1 : la > lb ? 1 : 0;
+} // }}}
+
+static double percentile(double p) { // {{{
+	if (bench_num_latency == 0)
+		return NAN;
+	int64_t i = int64_t(p / 100 * (bench_num_latency - 1) + .5);
+	return bench_latency[i] / 1e3;
+} // }}}
+// }}}
+
+// Machine setup. {{{
+// Settings are loaded through the same code that handles them from the host, so all derived state is set up correctly.
+static double delta_rodlength, delta_radius;
+static int shaper;
+static double shaper_freq, shaper_damping;
+static double advance, advance_smooth;
+
+static void load_space(int s, int type, int num, double steps_per_unit, double limit_v, double limit_a) { // {{{
+	int32_t addr = 0;
+	write_8(addr, type);
+	write_8(addr, s == 0 ? shaper : SHAPER_NONE);
+	for (int a = 0; a < SHAPER_AXES; ++a) {
+		write_float(addr, shaper_freq);
+		write_float(addr, shaper_damping);
+	}
+	if (type == DELTA_TYPE) {
+		for (int a = 0; a < 3; ++a) {
+			write_float(addr, -delta_rodlength);	// axis_min
+			write_float(addr, delta_rodlength);	// axis_max
+			write_float(addr, delta_rodlength);
+			write_float(addr, delta_radius);
+		}
+		write_float(addr, 0);	// angle
+	}
+	else
+		write_8(addr, num);
+	if (type == EXTRUDER_TYPE) {
+		for (int a = 0; a < num; ++a) {
+			for (int o = 0; o < 3; ++o)
+				write_float(addr, 0);
+			write_float(addr, advance);
+			write_float(addr, advance_smooth);
+		}
+	}
+	memcpy(command[0], datastore, addr);
+	addr = 0;
+	spaces[s].load_info(addr);
+	for (int m = 0; m < spaces[s].num_motors; ++m) {
+		addr = 0;
+		for (int p = 0; p < 5; ++p)
+			write_16(addr, 0);	// step, dir, enable, limit min, limit max pins.
+		write_float(addr, steps_per_unit);
+		write_float(addr, NAN);	// home_pos
+		write_float(addr, limit_v);
+		write_float(addr, limit_a);
+		write_8(addr, 0);	// home_order
+		memcpy(command[0], datastore, addr);
+		addr = 0;
+		spaces[s].load_motor(m, addr);
+	}
+	for (int a = 0; a < spaces[s].num_axes; ++a) {
+		spaces[s].axis[a]->settings.source = 0;
+		spaces[s].axis[a]->settings.current = 0;
+	}
+} // }}}
+
+static void bench_find_pos(FILE *report, int num) { // {{{
+	// Look up points near the toolpath, in 3-D and (every third query) in x and y only.
+	int64_t first = 0;
+	int64_t start = bench_ns();
+	for (int i = 0; i < num; ++i) {
+		Run_Record const &r = run_record((i * 7919LL + 13) % run_file_num_records);
+		double pos[3] = {r.X + .37, r.Y - .21, i % 3 == 2 ? NAN : r.Z + .1};
+		run_find_pos(pos);
+		if (i == 0)
+			first = bench_ns() - start;
+	}
+	int64_t total = bench_ns() - start;
+	fprintf(report, "find_pos:\t%d queries; first %.3f ms, then %.2f μs each\n", num, first / 1e6, num > 1 ? (total - first) / 1e3 / (num - 1) : 0.);
+} // }}}
+
+static void usage(char const *name) { // {{{
+	fprintf(stderr, "usage: %s [options] runfile\n", name);
+	fprintf(stderr, "\t-s steps\tsteps per mm for all motors (default 100)\n");
+	fprintf(stderr, "\t-v speed\tmotor speed limit in mm/s (default 200)\n");
+	fprintf(stderr, "\t-a accel\tmotor acceleration limit in mm/s² (default 2000)\n");
+	fprintf(stderr, "\t-V speed\tmaximum print speed in mm/s (default infinite)\n");
+	fprintf(stderr, "\t-d dev\t\tmaximum corner deviation in mm (default 0.05)\n");
+	fprintf(stderr, "\t-t step\t\tsample time in μs (default %d)\n", hwtime_step);
+	fprintf(stderr, "\t-x num\t\tnumber of extruders (default 1)\n");
+	fprintf(stderr, "\t-j\t\tuse S-curve velocity profiles\n");
+	fprintf(stderr, "\t-k adv[,smooth]\tpressure advance in s, optionally smoothed over a time in s\n");
+	fprintf(stderr, "\t-S type,freq,damping\tinput shaper for x, y and z; type is 1 (ZV), 2 (ZVD) or 3 (EI)\n");
+	fprintf(stderr, "\t-f num\t\ttime num toolpath position lookups before running\n");
+	fprintf(stderr, "\t-r num\t\tdiscard the buffered fragments every num ticks, like a settings change from the host\n");
+	fprintf(stderr, "\t-D rod,radius\tuse delta geometry with this rod length and tower radius in mm (default cartesian)\n");
+	exit(1);
+} // }}}
+// }}}
+
+int main(int argc, char **argv) { // {{{
+	// Host packets are discarded; the report goes to the original stdout.
+	int report_fd = dup(1);
+	int null_fd = open("/dev/null", O_WRONLY);
+	if (report_fd < 0 || null_fd < 0 || dup2(null_fd, 1) < 0) {
+		fprintf(stderr, "unable to redirect host output: %s\n", strerror(errno));
+		return 1;
+	}
+	close(null_fd);
+	FILE *report = fdopen(report_fd, "w");
+	setup();
+	double steps_per_unit = 100, limit_v = 200, limit_a = 2000;
+	int extruders = 1;
+	int find_queries = 0;
+	int discard_ticks = 0;
+	max_deviation = .05;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:v:a:V:d:t:x:D:S:jk:f:r:")) != -1) {
+		switch (opt) {
+		case 's':
+			steps_per_unit = atof(optarg);
+			break;
+		case 'v':
+			limit_v = atof(optarg);
+			break;
+		case 'a':
+			limit_a = atof(optarg);
+			break;
+		case 'V':
+			max_v = atof(optarg);
+			break;
+		case 'd':
+			max_deviation = atof(optarg);
+			break;
+		case 't':
+			hwtime_step = atoi(optarg);
+			break;
+		case 'x':
+			extruders = atoi(optarg);
+			break;
+		case 'j':
+			s_curve = true;
+			break;
+		case 'f':
+			find_queries = atoi(optarg);
+			break;
+		case 'r':
+			discard_ticks = atoi(optarg);
+			break;
+		case 'k':
+			if (sscanf(optarg, "%lf,%lf", &advance, &advance_smooth) < 1 || !(advance >= 0) || !(advance_smooth >= 0))
+				usage(argv[0]);
+			break;
+		case 'S':
+			if (sscanf(optarg, "%d,%lf,%lf", &shaper, &shaper_freq, &shaper_damping) != 3 || shaper <= SHAPER_NONE || shaper >= NUM_SHAPERS || !(shaper_freq > 0))
+				usage(argv[0]);
+			break;
+		case 'D':
+			if (sscanf(optarg, "%lf,%lf", &delta_rodlength, &delta_radius) != 2 || !(delta_radius > 0) || !(delta_rodlength > delta_radius))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || steps_per_unit <= 0 || limit_v <= 0 || limit_a <= 0 || hwtime_step <= 0 || extruders < 0 || discard_ticks < 0)
+		usage(argv[0]);
+	load_space(0, delta_radius > 0 ? DELTA_TYPE : DEFAULT_TYPE, 3, steps_per_unit, limit_v, limit_a);
+	load_space(1, EXTRUDER_TYPE, extruders, steps_per_unit, limit_v, limit_a);
+	motors_busy = true;
+	char const *name = argv[optind];
+	int64_t start = bench_ns();
+	run_file(strlen(name), name, 0, "", true, 0, 1, -1);
+	if (!run_file_map) {
+		fprintf(stderr, "unable to run %s\n", name);
+		return 1;
+	}
+	int64_t num_records = run_file_num_records;
+	// Every gpio, temperature and system record must be done exactly once, also when fragments are discarded.
+	int64_t num_events = 0;
+	for (int64_t i = 0; i < num_records; ++i) {
+		int t = run_record(i).type;
+		if (t == RUN_GPIO || t == RUN_SETTEMP || t == RUN_SYSTEM)
+			num_events += 1;
+	}
+	bool check_events = !run_file_growing;
+	if (find_queries > 0)
+		bench_find_pos(report, find_queries);
+	// Replay the file; waits for temperatures, timers and confirmations are skipped.
+	int stalled = 0;
+	int64_t ticks = 0, discards = 0;
+	while (run_file_map) {
+		int64_t old_samples = null_samples;
+		off_t old_current = settings.run_file_current;
+		run_file_wait = 0;
+		run_file_wait_temp = 0;
+		arch_tick();
+		planner_sync();
+		if (discard_ticks > 0 && ++ticks % discard_ticks == 0 && run_file_map) {
+			discarding = true;
+			arch_discard();
+			discarding = false;
+			buffer_refill();
+			planner_sync();
+			discards += 1;
+		}
+		serialdev[0]->flush();
+		num_records = run_file_num_records;
+		if (null_samples == old_samples && settings.run_file_current == old_current) {
+			if (run_file_growing) {
+				// A streamed file is still being written; wait for it.
+				poll(&pollfds[3], 1, 1000);
+				run_file_follow();
+				continue;
+			}
+			if (++stalled > 1000) {
+				fprintf(stderr, "no progress at record %ld of %ld; giving up\n", long(settings.run_file_current), long(num_records));
+				return 1;
+			}
+		}
+		else
+			stalled = 0;
+	}
+	double wall = (bench_ns() - start) / 1e9;
+	qsort(bench_latency, bench_num_latency, sizeof(int64_t), compare_latency);
+	fprintf(report, "file:\t\t%s (%ld records)\n", name, long(num_records));
+	fprintf(report, "wall time:\t%.3f s\n", wall);
+	fprintf(report, "motion time:\t%.3f s\n", null_time / 1e6);
+	fprintf(report, "fragments:\t%ld (%.0f/s)\n", long(null_fragments), null_fragments / wall);
+	fprintf(report, "samples:\t%ld (%.0f/s)\n", long(null_samples), null_samples / wall);
+	fprintf(report, "steps:\t\t%ld\n", long(null_steps));
+	fprintf(report, "limit fallback:\t%ld samples (%.2f%%)\n", long(bench_count[BENCH_LIMIT_FALLBACK]), bench_count[BENCH_LIMIT_FALLBACK] * 100. / null_samples);
+	if (discard_ticks > 0)
+		fprintf(report, "discards:\t%ld\n", long(discards));
+	if (check_events)
+		fprintf(report, "events:\t\t%ld of %ld\n", long(bench_count[BENCH_EVENTS]), long(num_events));
+	else
+		fprintf(report, "events:\t\t%ld\n", long(bench_count[BENCH_EVENTS]));
+	fprintf(report, "next_move:\t%ld calls; latency p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f μs\n", long(bench_num_latency), percentile(50), percentile(90), percentile(99), percentile(99.9), percentile(100));
+	for (int i = 0; i < NUM_BENCH_TIMERS; ++i)
+		fprintf(report, "%s:\t%.3f s in %ld calls (%.0f%% of wall time)\n", bench_name[i], bench_total[i] / 1e9, long(bench_calls[i]), bench_total[i] / 1e9 / wall * 100);
+	fclose(report);
+	if (check_events && bench_count[BENCH_EVENTS] != num_events) {
+		fprintf(stderr, "%ld run file events were done, but the file has %ld\n", long(bench_count[BENCH_EVENTS]), long(num_events));
+		return 1;
+	}
+	return 0;
+} // }}}
@@ -28,11 +28,14 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <signal.h>
 
 #define PROTOCOL_VERSION ((uint32_t)3)	// Required version response in BEGIN.
 #define ID_SIZE 8
 #define UUID_SIZE 16
-#define BASE_FDS 2
+#define BASE_FDS 5	// pollfds: run file timer, host, children of RUN_SYSTEM, growing run file, planner thread; arch fds follow.
 
 #define MAXLONG (int32_t((uint32_t(1) << 31) - 1))
 #define MAXINT MAXLONG
@@ -187,6 +190,7 @@ enum RunType {
 	RUN_WAIT,
 	RUN_CONFIRM,
 	RUN_PARK,
+	RUN_STREAM,	// Start (tool = 0) or end (tool = 1) of a streamed run file.
 };
 
 // All temperatures are stored in Kelvin, but communicated in °C.
@@ -237,14 +241,36 @@ struct Temp {
 
 struct History {
 	double t0, tp;
-	double f0, f1, f2, fp, fq, fmain;
+	double f0, fp, fq, fmain;
+	double ta, td;		// Time of the speed changes at the start and end of the main part [s].
+	double v0, vc, vp;	// Speed at the start, cruise speed and speed at the end of the main part [fraction of the segment/s].
+	double entry_v;		// Speed at which the connection leaves the next segment going [fraction of that segment/s].
+	double entry_mm;	// The same for space 0 [mm/s], for the lookahead.
+	bool computing_move;	// A move was being computed.
+	bool prepared;		// The next segment has been set up.
+	double done_factor;	// Fraction of the segment at which the move is done.
 	int32_t hwtime, start_time, last_time, last_current_time;
+	int32_t sample_time;	// Time per sample in this fragment [μs].
 	int cbs;
 	int queue_start, queue_end;
 	bool queue_full;
-	int run_file_current;
+	off_t run_file_current;
 	bool probing, single;
+	bool s_curve;	// Velocity follows a smoothstep instead of a linear ramp, so acceleration is continuous.
 	double run_time, run_dist;
+	int event_end;	// Run file events before this number are done when this fragment is.
+	int run_event_end;	// Value of run_event_end when this fragment was started.
+};
+
+// Input shaping works on the first SHAPER_AXES axes of a space.
+#define SHAPER_AXES 3
+#define SHAPER_MAX_IMPULSES 3
+enum ShaperType {
+	SHAPER_NONE,
+	SHAPER_ZV,	// Zero vibration: 2 impulses, delay 1/2 period.
+	SHAPER_ZVD,	// Zero vibration and derivative: 3 impulses, delay 1 period; less sensitive to frequency errors.
+	SHAPER_EI,	// Extra insensitive: 3 impulses, delay 1 period; allows 5% vibration for a wider frequency range.
+	NUM_SHAPERS
 };
 
 struct Space_History {
@@ -256,6 +282,9 @@ struct Space_History {
 	double e1[2][3];
 	double e2[2][3];
 	double normal[2][3];
+	int shaper_pos;		// Index of the current sample in shaper_target.
+	double shaper_target[SHAPER_SAMPLES][SHAPER_AXES];	// Unshaped targets of the last samples, for input shaping.
+	uint32_t shaper_time[SHAPER_SAMPLES];	// Time of those samples [μs]; only differences are used.
 };
 
 struct Motor_History {
@@ -263,6 +292,7 @@ struct Motor_History {
 	double target_v, target_dist;	// Internal values for moving.
 	double current_pos;	// Current position of motor (in steps), and (cast to int) what the hardware currently thinks.
 	double endpos;
+	double end_v;		// Planned speed at endpos, from the lookahead [mm/s].
 };
 
 struct Axis_History {
@@ -270,6 +300,8 @@ struct Axis_History {
 	double source, current;	// Source position of current movement of axis (in μm), or current position if there is no movement.
 	double target;
 	double endpos[2];
+	double advance_e;	// Position that the pressure advance speed is computed from.
+	double advance;		// Pressure advance that was applied to the motor.
 };
 
 struct Axis {
@@ -300,7 +332,8 @@ struct Motor {
 struct Space;
 
 struct SpaceType {
-	void (*xyz2motors)(Space *s, double *motors);
+	// Convert num positions; targets holds num_axes values per position, motors receives num_motors values per position.
+	void (*xyz2motors)(Space *s, int num, double const *targets, double *motors);
 	void (*reset_pos)(Space *s);
 	void (*check_position)(Space *s, double *data);
 	void (*load)(Space *s, uint8_t old_type, int32_t &addr);
@@ -323,6 +356,11 @@ struct Space {
 	int id;
 	int type;
 	int num_axes, num_motors;
+	uint8_t shaper;		// ShaperType.
+	double shaper_freq[SHAPER_AXES], shaper_damping[SHAPER_AXES];	// Resonance frequency [Hz] and damping ratio per axis.
+	int shaper_num;		// Number of impulses.
+	double shaper_a[SHAPER_AXES][SHAPER_MAX_IMPULSES];	// Impulse amplitudes; they add up to 1.
+	double shaper_t[SHAPER_AXES][SHAPER_MAX_IMPULSES];	// Impulse delays [μs].
 	void load_info(int32_t &addr);
 	void load_axis(int a, int32_t &addr);
 	void load_motor(int m, int32_t &addr);
@@ -330,12 +368,23 @@ struct Space {
 	void save_axis(int a, int32_t &addr);
 	void save_motor(int m, int32_t &addr);
 	void init(int space_id);
+	void setup_shaper();
+	void reset_filters();
 	bool setup_nums(int na, int nm);
 	void cancel_update();
 	ARCH_SPACE
 };
 
+// Build a SpaceType::xyz2motors from a function that converts one position.
+// The conversion is inlined into the loop, so the type is only dispatched once per batch.
+template <void (*convert)(Space *s, double const *target, double *motors)>
+void xyz2motors_batch(Space *s, int num, double const *targets, double *motors) { // {{{
+	for (int i = 0; i < num; ++i)
+		convert(s, &targets[i * s->num_axes], &motors[i * s->num_motors]);
+} // }}}
+
 #define DEFAULT_TYPE 0
+#define DELTA_TYPE 1
 #define EXTRUDER_TYPE 3
 #define FOLLOWER_TYPE 4
 void Cartesian_init(int num);
@@ -375,6 +424,7 @@ struct MoveCommand {
 	bool arc;
 	double center[3];
 	double normal[3];
+	int event_end;	// Run file events before this number are done after this move.
 };
 
 struct Serial_t {
@@ -385,9 +435,13 @@ struct Serial_t {
 	virtual int available() = 0;
 };
 
+#define HOST_OUT_SIZE 4096
 struct HostSerial : public Serial_t {
 	char buffer[256];
 	int start, end;
+	// Output is collected here and written by flush(), which is called once per main loop iteration.
+	char out_buffer[HOST_OUT_SIZE];
+	int out_start, out_used;
 	void begin();
 	void write(char c);
 	void refill();
@@ -397,18 +451,20 @@ struct HostSerial : public Serial_t {
 			*target++ = read();
 		return len;
 	}
-	void flush() {}
+	void flush();
 	int available();
 };
 EXTERN HostSerial host_serial;
 
 #define COMMAND_SIZE 256
 #define FULL_SERIAL_COMMAND_SIZE (COMMAND_SIZE + (COMMAND_SIZE + 2) / 3)
+#define LINK_WINDOW_MAX 32
 #define HOST_COMMAND_SIZE 0x4000
 static int const FULL_COMMAND_SIZE[2] = {HOST_COMMAND_SIZE, FULL_SERIAL_COMMAND_SIZE};
 
 // Globals
 EXTERN double max_deviation;
+EXTERN bool s_curve;	// Plan new moves with S-curve velocity profiles; acceleration builds up and falls back to zero in every speed change.
 EXTERN double max_v;
 EXTERN unsigned char uuid[UUID_SIZE];
 EXTERN uint8_t num_extruders;
@@ -437,12 +493,15 @@ EXTERN uint8_t which_autosleep;		// which autosleep message to send (0: none, 1:
 EXTERN uint8_t ping;			// bitmask of waiting ping replies.
 EXTERN bool initialized;
 EXTERN int cbs_after_current_move;
+EXTERN int event_after_current_move;
 EXTERN bool motors_busy;
 EXTERN int out_busy;
 EXTERN int32_t out_time;
-EXTERN char pending_packet[4][FULL_SERIAL_COMMAND_SIZE];
-EXTERN int pending_len[4];
-EXTERN void (*serial_cb[4])();
+EXTERN int link_window;		// Maximum for out_busy: 3, unless the firmware supports the sliding window.
+EXTERN int link_mask;		// Serials wrap at link_mask + 1: 3 for the flipflop protocol, 0xff for the sliding window.
+EXTERN char pending_packet[LINK_WINDOW_MAX][FULL_SERIAL_COMMAND_SIZE];
+EXTERN int pending_len[LINK_WINDOW_MAX];
+EXTERN void (*serial_cb[LINK_WINDOW_MAX])();
 EXTERN char datastore[HOST_COMMAND_SIZE];
 EXTERN int32_t last_active;
 EXTERN int32_t last_micros;
@@ -463,6 +522,7 @@ EXTERN bool refilling;
 EXTERN int current_fragment, running_fragment;
 EXTERN unsigned current_fragment_pos;
 EXTERN int num_active_motors;
+EXTERN bool followers_changed;	// Follower configuration changed; do_steps() must rebuild its table.
 EXTERN int hwtime_step, audio_hwtime_step;
 EXTERN struct pollfd pollfds[BASE_FDS + ARCH_MAX_FDS];
 EXTERN void (*wait_for_reply[4])();
@@ -479,6 +539,37 @@ void buffered_debug(char const *fmt, ...);
 #define buffered_debug_flush() do {} while(0)
 #endif
 
+#ifdef PLANNER_THREAD
+// planner.cpp
+EXTERN int sent_fragment;	// Fragments before this one were sent to the hardware; the ones up to current_fragment wait in the planner ring.
+#define SENT_FRAGMENT sent_fragment
+void planner_start();
+bool planner_self();
+void planner_wake();
+bool planner_stopping();
+void planner_stop();
+void planner_continue();
+void planner_call(void (*func)(void *), void *arg);
+void planner_publish();
+void planner_drop();
+void planner_send();
+bool planner_pending();
+void planner_handle();
+void planner_sync();
+#else
+#define SENT_FRAGMENT current_fragment
+#define planner_start() do {} while(0)
+#define planner_stopping() false
+#define planner_stop() do {} while(0)
+#define planner_continue() do {} while(0)
+#define planner_call(func, arg) func(arg)
+#define planner_drop() do {} while(0)
+#define planner_send() do {} while(0)
+#define planner_pending() false
+#define planner_handle() do {} while(0)
+#define planner_sync() do {} while(0)
+#endif
+
 // Force cpdebug if requested, to enable only specific lines without adding all the cp things in manually.
 #define fcpdebug(s, m, fmt, ...) do { if (s == 1 && m == 0) debug("CP curfragment %d curpos %f current %f " fmt, current_fragment, spaces[s].motor[m]->settings.current_pos, spaces[s].axis[m]->settings.current, ##__VA_ARGS__); } while (0)
 //#define fcpdebug(s, m, fmt, ...) do { debug("CP curfragment %d curpos %f current %f " fmt, current_fragment, spaces[s].motor[m]->settings.current_pos, spaces[s].axis[m]->settings.current, ##__VA_ARGS__); } while (0)
@@ -520,17 +611,22 @@ struct ProbeFile {
 void run_file(int name_len, char const *name, int probe_name_len, char const *probe_name, bool start, double sina, double cosa, int audio);
 void abort_run_file();
 void run_file_fill_queue();
+Run_Record const &run_record(off_t which);
 void run_adjust_probe(double x, double y, double z);
 double run_find_pos(double pos[3]);
+void run_events_attach(int end);
+void run_events_fire(int end);
+void run_system_done();
+void run_file_follow();
 EXTERN char probe_file_name[256];
 EXTERN off_t probe_file_size;
 EXTERN ProbeFile *probe_file_map;
 EXTERN char run_file_name[256];
 EXTERN off_t run_file_size;
 EXTERN Run_Record *run_file_map;
-EXTERN int run_file_num_strings;
+EXTERN off_t run_file_num_strings;
 EXTERN off_t run_file_first_string;
-EXTERN int run_file_num_records;
+EXTERN off_t run_file_num_records;
 EXTERN int run_file_wait_temp;
 EXTERN int run_file_wait;
 EXTERN struct itimerspec run_file_timer;
@@ -540,7 +636,13 @@ EXTERN double run_file_refz;
 EXTERN double run_file_sina;
 EXTERN double run_file_cosa;
 EXTERN bool run_file_finishing;
+EXTERN bool run_file_growing;	// The run file is a stream that is still being written.
 EXTERN int run_file_audio;
+// Events (gpio and temperature changes) from the run file which are waiting for the motion before them to finish.
+// The values are record numbers; run_event_end and run_event_done count events.  run_event_done only
+// increases; run_event_end moves back when a rewind drops events whose records will be read again.
+EXTERN off_t run_events[EVENT_QUEUE_LENGTH];
+EXTERN int run_event_end, run_event_done;
 
 // setup.cpp
 void setup();
@@ -562,6 +664,10 @@ void write_float(int32_t &address, double data);
 // temp.cpp
 void handle_temp(int id, int temp);
 
+// type-cartesian.cpp
+bool extruder_advance(Space *s, double const *target, double *motors);
+void extruder_advance_done(Space *s);
+
 // space.cpp
 void buffer_refill();
 void store_settings();
@@ -580,6 +686,34 @@ void disconnect(bool notify);
 int32_t utime();
 int32_t millis();
 
+// bench.cpp
+#ifdef BENCH
+// Timing hooks for franklin-cdriver-bench; they compile away in the real driver.
+enum BenchTimerType {
+	BENCH_NEXT_MOVE,
+	BENCH_MOVE_AXES,
+	BENCH_DO_STEPS,
+	NUM_BENCH_TIMERS
+};
+struct BenchTimer {
+	int which;
+	int64_t start;
+	BenchTimer(int which_);
+	~BenchTimer();
+};
+#define BENCH_TIMER(which) BenchTimer bench_timer(which)
+enum BenchCounterType {
+	BENCH_LIMIT_FALLBACK,	// Samples where check_distance() had to slow down the planned motion.
+	BENCH_EVENTS,	// Gpio, temperature and system records from the run file that were done.
+	NUM_BENCH_COUNTERS
+};
+EXTERN int64_t bench_count[NUM_BENCH_COUNTERS];
+#define BENCH_COUNT(which) do { bench_count[which] += 1; } while (0)
+#else
+#define BENCH_TIMER(which) do {} while (0)
+#define BENCH_COUNT(which) do {} while (0)
+#endif
+
 #include ARCH_INCLUDE
 
 // ===============
@@ -605,10 +739,16 @@ void arch_stop(bool fake = false);
 void arch_home();
 bool arch_running();
 double arch_round_pos(int s, int m, double pos);
+int arch_sample_time(int wanted);
+int arch_max_steps(int sample_time);
 void arch_stop_audio();
 //void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin = ~0, bool heater_invert = false, int heater_adctemp = 0, int heater_limit_l = ~0, int heater_limit_h = ~0, int fan_pin = ~0, bool fan_invert = false, int fan_adctemp = 0, int fan_limit_l = ~0, int fan_limit_h = ~0, double hold_time = 0);
 void arch_start_move(int extra);
 bool arch_send_fragment();
+#ifdef PLANNER_THREAD
+void arch_store_fragment();
+bool arch_send_stored_fragment(int fragment);
+#endif
 
 #ifdef SERIAL
 int hwpacketsize(int len, int *available);
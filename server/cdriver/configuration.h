@@ -32,6 +32,47 @@
 // start faster, but may cause buffer underruns.
 #define MIN_BUFFER_FILL 1
 
+// Number of queued moves that the planner looks at to find how fast a segment
+// can be left.  A run file keeps this many moves in the queue.  Must be smaller
+// than QUEUE_LENGTH.
+#define LOOKAHEAD_HORIZON 32
+
+// Number of gpio and temperature changes from a run file that can wait for the
+// motion before them, without stopping the machine.
+#define EVENT_QUEUE_LENGTH 16
+
+// Number of packets that may be sent to the firmware before the first is
+// acknowledged.  Firmware without the sliding window link extension allows
+// only 3; it may also limit the window further.  At most 32.
+#define LINK_WINDOW 16
+
+// Delta motor positions are computed exactly at some points and interpolated
+// linearly between them, as long as the error stays below this fraction of a
+// step.  Set to 0 to compute every position exactly.
+#define DELTA_INTERPOLATION .05
+
+// Number of samples that input shaping looks back.  The longest shaper delay
+// (one resonance period for ZVD and EI) must fit in it, so this limits the
+// lowest resonance frequency to 1 / (SHAPER_SAMPLES * sample time).  Must be
+// a power of 2.
+#define SHAPER_SAMPLES 128
+
+// Adaptive sample time.  Every fragment gets its own time per sample, chosen
+// when it is started from the speed of the fastest motor.  Slow fragments use
+// up to SAMPLE_TIME_RANGE times the configured sample time, so fewer samples
+// are sent for the same motion; fast ones use down to 1 / SAMPLE_TIME_RANGE of
+// it, so no sample needs more than SAMPLE_STEPS_MAX steps.  The hardware may
+// limit the range further.  Must be a power of 2; set to 1 to disable.
+#define SAMPLE_TIME_RANGE 4
+#define SAMPLE_STEPS_MAX 256
+
+// Access window for run files.  Pages up to RUN_FILE_AHEAD bytes after the
+// current record are read in advance; pages more than RUN_FILE_BEHIND bytes
+// before it are dropped from memory, so a large file doesn't push everything
+// else out of the page cache.
+#define RUN_FILE_AHEAD (4 << 20)
+#define RUN_FILE_BEHIND (1 << 20)
+
 // Watchdog.  If enabled, the device will automatically reset when it doesn't
 // work properly.  However, it may also trigger when too much time is spent
 // outputting debugging info.
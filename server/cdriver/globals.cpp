@@ -85,6 +85,7 @@ bool globals_load(int32_t &addr)
 		feedrate = 1;
 	max_deviation = read_float(addr);
 	max_v = read_float(addr);
+	s_curve = read_8(addr);
 	int ce = read_8(addr);
 	targetx = read_float(addr);
 	targety = read_float(addr);
@@ -93,6 +94,7 @@ bool globals_load(int32_t &addr)
 	if (motors_busy && (current_extruder != ce || zoffset != zo) && settings.queue_start == settings.queue_end && !settings.queue_full && !computing_move) {
 		queue[settings.queue_end].probe = false;
 		queue[settings.queue_end].cb = false;
+		queue[settings.queue_end].event_end = 0;
 		queue[settings.queue_end].f[0] = INFINITY;
 		queue[settings.queue_end].f[1] = INFINITY;
 		for (int i = 0; i < spaces[0].num_axes; ++i) {
@@ -147,6 +149,7 @@ void globals_save(int32_t &addr)
 	write_float(addr, feedrate);
 	write_float(addr, max_deviation);
 	write_float(addr, max_v);
+	write_8(addr, s_curve);
 	write_8(addr, current_extruder);
 	write_float(addr, targetx);
 	write_float(addr, targety);
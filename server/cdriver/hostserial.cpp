@@ -18,6 +18,7 @@
  */
 
 #include "cdriver.h"
+#include <sys/uio.h>
 
 void HostSerial::begin() {
 	pollfds[1].fd = 0;
@@ -25,20 +26,43 @@ void HostSerial::begin() {
 	pollfds[1].revents = 0;
 	start = 0;
 	end = 0;
+	out_start = 0;
+	out_used = 0;
 	fcntl(0, F_SETFL, O_NONBLOCK);
 }
 
 void HostSerial::write(char c) {
 	//debug("Firmware write byte: %x", c);
-	while (true) {
+	if (out_used == HOST_OUT_SIZE)
+		flush();
+	out_buffer[(out_start + out_used) % HOST_OUT_SIZE] = c;
+	out_used += 1;
+}
+
+void HostSerial::flush() {
+	while (out_used > 0) {
+		// The buffer is a ring, so the data is in at most two parts.
+		struct iovec iov[2];
+		int first = min(out_used, HOST_OUT_SIZE - out_start);
+		iov[0].iov_base = &out_buffer[out_start];
+		iov[0].iov_len = first;
+		iov[1].iov_base = out_buffer;
+		iov[1].iov_len = out_used - first;
 		errno = 0;
-		int ret = ::write(1, &c, 1);
-		if (ret == 1)
-			break;
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			debug("write to host failed: %d %s", ret, strerror(errno));
-			abort();
+		int ret = ::writev(1, iov, out_used > first ? 2 : 1);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				debug("write to host failed: %d %s", ret, strerror(errno));
+				abort();
+			}
+			struct pollfd pfd;
+			pfd.fd = 1;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+			continue;
 		}
+		out_start = (out_start + ret) % HOST_OUT_SIZE;
+		out_used -= ret;
 	}
 }
 
@@ -29,7 +29,8 @@
 // mtr->dist[0]		total distance of this segment (mm).
 // mtr->dist[1]		total distance of next segment (mm).
 // mtr->main_dist	distance of main part (mm).
-// v0, vp		start and end velocity for main part. (fraction/s)
+// ta, td		time to change speed at start and end of main part.
+// v0, vc, vp		start, cruise and end velocity for main part. (fraction/s)
 // vq			start velocity of connector part. (fraction/s)
 
 static void change0(int qpos) { // {{{
@@ -167,8 +168,142 @@ static void copy_next(int s) { // {{{
 	}
 } // }}}
 
-// Used from previous segment (if prepared): tp, vq.
+// Lookahead. {{{
+static_assert(LOOKAHEAD_HORIZON + 2 < QUEUE_LENGTH, "the lookahead horizon must fit in the queue");
+
+static double path_length(int i) { // {{{
+	// Length of segment i (0: current, 1: next) of the first space that moves, for converting mm/s to fractions of the segment per second.
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		if (spaces[s].settings.dist[i] > 0)
+			return spaces[s].settings.dist[i];
+	}
+	return 0;
+} // }}}
+
+static double junction_speed(double *u0, double *u1, double a) { // {{{
+	// Highest speed at which the corner between two unit vectors can be rounded within max_deviation at acceleration a.
+	double c = 0;
+	for (int i = 0; i < 3; ++i)
+		c += u0[i] * u1[i];
+	if (c > 1 - 1e-9)
+		return INFINITY;
+	if (max_deviation <= 0 || c <= -1)
+		return 0;
+	// sin_half is the sine of half the angle inside the corner; it is 0 when reversing.
+	double sin_half = sqrt((1 + c) / 2);
+	return sqrt(a * max_deviation * sin_half / (1 - sin_half));
+} // }}}
+
+static double lookahead(int n) { // {{{
+	// Compute the speed [mm/s] at which space 0 may leave the current segment.
+	// Backward pass: going back from the last queued segment (where the machine
+	// must be able to stop), every segment can be entered no faster than it can
+	// be left plus what acceleration allows over its length, and no faster than
+	// its corner with the previous segment allows.  Forward pass: the current
+	// segment can not be left faster than acceleration allows from its start.
+	// Arcs are handled as their chord for the direction of the corners.
+	Space &sp = spaces[0];
+	int na = min(3, sp.num_axes);
+	double a = INFINITY;
+	for (int m = 0; m < sp.num_motors; ++m) {
+		if (sp.motor[m]->limit_a > 0 && sp.motor[m]->limit_a < a)
+			a = sp.motor[m]->limit_a;
+	}
+	if (na == 0 || isinf(a) || !(sp.settings.dist[0] > 0))
+		return INFINITY;
+	// The peak acceleration of an S-curve is 1.5 times its average.
+	if (s_curve)
+		a /= 1.5;
+	double len[LOOKAHEAD_HORIZON + 2];
+	double vmax[LOOKAHEAD_HORIZON + 2];
+	double dir[LOOKAHEAD_HORIZON + 2][3];
+	double pos[3];
+	// Segment 0 is the current segment, segment 1 is queue[n]; both have been set up already.
+	for (int i = 0; i < 3; ++i) {
+		dir[0][i] = i < na && !isnan(sp.axis[i]->settings.dist[0]) ? sp.axis[i]->settings.dist[0] : 0;
+		dir[1][i] = i < na && !isnan(sp.axis[i]->settings.dist[1]) ? sp.axis[i]->settings.dist[1] : 0;
+		// Start from where queue[n] ends; its record may leave axes out, which are NaN.
+		pos[i] = i < na ? sp.axis[i]->settings.source + dir[0][i] + dir[1][i] : 0;
+	}
+	len[0] = sp.settings.dist[0];
+	len[1] = sp.settings.dist[1];
+	double f = queue[settings.queue_start].f[1] * feedrate;
+	vmax[0] = f < 0 ? -f : f * len[0];
+	int num = 1;
+	for (int q = n; q != settings.queue_end && num <= LOOKAHEAD_HORIZON; q = (q + 1) % QUEUE_LENGTH, ++num) {
+		if (num > 1) {
+			// This record has not been through change0 yet; do it on a copy.
+			double d = 0;
+			for (int i = 0; i < na; ++i) {
+				double v = queue[q].data[i];
+				for (int s = 0; s < NUM_SPACES; ++s)
+					v = space_types[spaces[s].type].change0(&spaces[s], i, v);
+				v += i == 2 ? zoffset : 0;
+				if (isnan(v))
+					v = pos[i];
+				// An axis without a known position doesn't contribute until it gets one.
+				dir[num][i] = isnan(pos[i]) ? 0 : v - pos[i];
+				d += dir[num][i] * dir[num][i];
+				pos[i] = v;
+			}
+			for (int i = na; i < 3; ++i)
+				dir[num][i] = 0;
+			len[num] = sqrt(d);
+		}
+		f = queue[q].f[0] * feedrate;
+		vmax[num] = f < 0 ? -f : f * len[num];
+	}
+	for (int k = 0; k < num; ++k) {
+		if (max_v > 0 && vmax[k] > max_v)
+			vmax[k] = max_v;
+		if (len[k] > 0) {
+			for (int i = 0; i < 3; ++i)
+				dir[k][i] /= len[k];
+		}
+	}
+	// The last segment must end at rest.
+	double v = 0;
+	for (int k = num - 1; k > 0; --k) {
+		v = sqrt(v * v + 2 * a * len[k]);
+		if (v > vmax[k])
+			v = vmax[k];
+		// Zero-length segments don't have a direction and are skipped by next_move anyway.
+		if (len[k] > 0 && len[k - 1] > 0) {
+			double j = junction_speed(dir[k - 1], dir[k], a);
+			if (v > j)
+				v = j;
+		}
+	}
+	if (v > vmax[0])
+		v = vmax[0];
+	double reachable = sqrt(settings.entry_mm * settings.entry_mm + 2 * a * len[0]);
+	if (v > reachable)
+		v = reachable;
+	return v;
+} // }}}
+// }}}
+
+#ifdef PLANNER_THREAD
+// Setting pins and aborting moves talk to the hardware; with the planner thread, that is done by the main thread.
+static void enable_motors(void *arg) { // {{{
+	(void)&arg;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		for (int m = 0; m < sp.num_motors; ++m)
+			SET(sp.motor[m]->enable_pin);
+	}
+	motors_busy = true;
+} // }}}
+
+static void abort_current_move(void *arg) { // {{{
+	(void)&arg;
+	abort_move(current_fragment_pos);
+} // }}}
+#endif
+
+// Used from previous segment (if prepared): fq, entry_v.
 int next_move() { // {{{
+	BENCH_TIMER(BENCH_NEXT_MOVE);
 	bool allow_arc = true;
 	settings.probing = false;
 	settings.single = false;
@@ -224,6 +359,8 @@ int next_move() { // {{{
 		debug("No move prepared.");
 #endif
 		settings.f0 = 0;
+		settings.entry_mm = 0;
+		settings.entry_v = 0;
 		a0 = 0;
 		change0(settings.queue_start);
 		for (int s = 0; s < NUM_SPACES; ++s) {
@@ -268,7 +405,11 @@ int next_move() { // {{{
 					send_host(CMD_CONTINUE, 0);
 				settings.queue_start = n;
 				settings.queue_full = false;
+#ifdef PLANNER_THREAD
+				planner_call(abort_current_move, NULL);
+#else
 				abort_move(current_fragment_pos);
+#endif
 				return num_cbs;
 			}
 		}
@@ -312,6 +453,9 @@ int next_move() { // {{{
 	}
 	// }}}
 
+	// Find how fast this segment may be left, while queue_start still points at it.
+	bool plan = n != settings.queue_end && !queue[settings.queue_start].probe && !queue[settings.queue_start].single;
+	double v_end = plan ? lookahead(n) : 0;
 	double v0 = queue[settings.queue_start].f[0] * feedrate;
 	double vp = queue[settings.queue_start].f[1] * feedrate;
 	settings.probing = queue[settings.queue_start].probe;
@@ -323,6 +467,8 @@ int next_move() { // {{{
 		cbs_after_current_move += 1;
 		//debug("cbs after current inc'd to %d", cbs_after_current_move);
 	}
+	if (queue[settings.queue_start].event_end > event_after_current_move)
+		event_after_current_move = queue[settings.queue_start].event_end;
 	//debug("add cb to current starting at %d", current_fragment);
 	if (settings.queue_end == settings.queue_start)
 		send_host(CMD_CONTINUE, 0);
@@ -336,6 +482,8 @@ int next_move() { // {{{
 		num_cbs += cbs_after_current_move;
 		//debug("cbs after current cleared for return from next move as %d+%d", num_cbs, cbs_after_current_move);
 		cbs_after_current_move = 0;
+		run_events_attach(event_after_current_move);
+		event_after_current_move = 0;
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			Space &sp = spaces[s];
 			sp.settings.dist[0] = 0;
@@ -343,6 +491,8 @@ int next_move() { // {{{
 				sp.axis[a]->settings.dist[0] = NAN;
 		}
 		settings.fq = 0;
+		settings.entry_v = 0;
+		settings.entry_mm = 0;
 		return num_cbs + next_move();
 	} // }}}
 
@@ -361,40 +511,91 @@ int next_move() { // {{{
 #endif
 
 	// Limit v0, vp, vq. {{{
+	// Negative speeds are in mm/s along the path; convert them to fractions of the segment per second.
+	double len0 = path_length(0);
+	double len1 = path_length(1);
 	double vq = v1;
+	if (v0 < 0)
+		v0 = -v0 / len0;
+	if (vp < 0)
+		vp = -vp / len0;
+	if (vq < 0)
+		vq = -vq / len1;
+	double max0 = INFINITY, max1 = INFINITY;	// Speed limits of both segments [fraction/s].
+	double limit_a = INFINITY;	// Acceleration limit of this segment [fraction/s²].
+	if (max_v > 0 || settings.probing) {
+		double max_mm = settings.probing ? space_types[spaces[0].type].probe_speed(&spaces[0]) : max_v;
+		if (spaces[0].settings.dist[0] > 0)
+			max0 = max_mm / spaces[0].settings.dist[0];
+		if (spaces[0].settings.dist[1] > 0)
+			max1 = max_mm / spaces[0].settings.dist[1];
+	}
+	// Motor speeds and accelerations are the path's times the motor distances of the segments.
+	int total_motors = 0;
+	for (int s = 0; s < NUM_SPACES; ++s)
+		total_motors += spaces[s].num_motors;
+	double motor_dist[2][total_motors];
+	double motor_a[total_motors];
+	int mi = 0;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
-		double limit;
-		if (s == 0)
-			limit = max_v;
-		else if (s == 1 && current_extruder < sp.num_motors)
-			limit = sp.motor[current_extruder]->limit_v;
-		else
-			continue;
-		if (isnan(limit) || isinf(limit) || limit <= 0)
+		if ((s == 2 && !settings.single) || sp.num_motors == 0) {
+			for (int m = 0; m < sp.num_motors; ++m, ++mi) {
+				motor_dist[0][mi] = 0;
+				motor_dist[1][mi] = 0;
+				motor_a[mi] = INFINITY;
+			}
 			continue;
-		// max_mm is the maximum speed in mm/s.
-		double max_mm = settings.probing ? space_types[sp.type].probe_speed(&sp) : limit;
-		double max = max_mm / sp.settings.dist[0];
-#ifdef DEBUG_MOVE
-		debug("limiting space %d, max_mm = %f, max = %f, limit = %f", s, max_mm, max, limit);
-#endif
-		if (v0 < 0)
-			v0 = -v0 / sp.settings.dist[0];
-		if (vp < 0)
-			vp = -vp / sp.settings.dist[0];
-		if (vq < 0)
-			vq = -vq / sp.settings.dist[1];
-		if (v0 > max)
-			v0 = max;
-		if (vp > max)
-			vp = max;
-		max = max_mm / sp.settings.dist[1];
-		if (vq > max)
-			vq = max;
+		}
+		double pos[3 * sp.num_axes];
+		double motors[3 * sp.num_motors];
+		for (int a = 0; a < sp.num_axes; ++a) {
+			double d0 = sp.axis[a]->settings.dist[0];
+			double d1 = sp.axis[a]->settings.dist[1];
+			pos[a] = sp.axis[a]->settings.source;
+			pos[sp.num_axes + a] = pos[a] + (isnan(d0) ? 0 : d0);
+			pos[2 * sp.num_axes + a] = pos[sp.num_axes + a] + (isnan(d1) ? 0 : d1);
+		}
+		space_types[sp.type].xyz2motors(&sp, 3, pos, motors);
+		for (int m = 0; m < sp.num_motors; ++m, ++mi) {
+			Motor &mtr = *sp.motor[m];
+			motor_dist[0][mi] = motors[sp.num_motors + m] - motors[m];
+			motor_dist[1][mi] = motors[2 * sp.num_motors + m] - motors[sp.num_motors + m];
+			motor_a[mi] = mtr.limit_a > 0 ? mtr.limit_a : INFINITY;
+			// Plan S-curves with their average acceleration, so the peak stays at limit_a.
+			if (s_curve)
+				motor_a[mi] /= 1.5;
+			double d0 = fabs(motor_dist[0][mi]);
+			double d1 = fabs(motor_dist[1][mi]);
+			if (mtr.limit_v > 0 && d0 > 0 && mtr.limit_v / d0 < max0)
+				max0 = mtr.limit_v / d0;
+			if (mtr.limit_v > 0 && d1 > 0 && mtr.limit_v / d1 < max1)
+				max1 = mtr.limit_v / d1;
+			if (d0 > 0 && motor_a[mi] / d0 < limit_a)
+				limit_a = motor_a[mi] / d0;
+		}
+	}
+	if (v0 > max0)
+		v0 = max0;
+	if (vp > max0)
+		vp = max0;
+	if (vq > max1)
+		vq = max1;
+	// The connection can not be faster than the lookahead allows.
+	if (plan && spaces[0].settings.dist[1] > 0 && vq * spaces[0].settings.dist[1] > v_end)
+		vq = v_end / spaces[0].settings.dist[1];
+	// The path keeps its speed through the connection.
+	if (vq > 0 && spaces[0].settings.dist[0] > 0 && spaces[0].settings.dist[1] > 0) {
+		double v = vp * spaces[0].settings.dist[0];
+		if (vq * spaces[0].settings.dist[1] < v)
+			v = vq * spaces[0].settings.dist[1];
+		vp = v / spaces[0].settings.dist[0];
+		vq = v / spaces[0].settings.dist[1];
 	}
+	if (vq == 0)
+		vp = 0;	// The segment ends at rest.
 #ifdef DEBUG_MOVE
-	debug("After limiting, v0 = %f /s, vp = %f /s and vq = %f /s", v0, vp, vq);
+	debug("After limiting, v0 = %f /s, vp = %f /s and vq = %f /s, lookahead %f mm/s, a %f /s²", v0, vp, vq, v_end, limit_a);
 #endif
 	// }}}
 	// Already set up: f0, v0, vp, vq, dist[0], dist[1], mtr->dist[0], mtr->dist[1].
@@ -438,6 +639,9 @@ int next_move() { // {{{
 			if (new_fp < settings.fp)
 				settings.fp = new_fp;
 		}
+		// Leave at least half of what the previous connection left for the main part, so there is room to accelerate.
+		if (settings.fp > (1 - settings.f0) / 2)
+			settings.fp = (1 - settings.f0) / 2;
 		if (isnan(done_factor))
 			settings.fq = 0;
 		else
@@ -447,10 +651,64 @@ int next_move() { // {{{
 		done_factor = 1;
 	// }}}
 
-	settings.t0 = (1 - settings.fp) / (fabs(v0 + vp) / 2);
-	settings.tp = settings.fp / (fabs(vp) / 2);
-	settings.f1 = .5 * fabs(v0) * settings.t0;
-	settings.f2 = 1 - settings.fp - settings.f1;
+	// Plan the speeds. {{{
+	// During the connection, this segment's speed goes linearly from vp to 0
+	// and the next one's from 0 to vq, so the motors accelerate at
+	// |vq * dist[1] - vp * dist[0]| / tp, with tp = 2 * fp / vp.  Lowering
+	// both speeds by k lowers that by k²; fp and fq only depend on their ratio.
+	// If the connection doesn't start the next segment, it starts from rest.
+	double next_v = settings.fp > 0 && settings.fq == 0 ? 0 : vq;
+	double k = 1;
+	if (settings.fp > 0) {
+		for (int i = 0; i < total_motors; ++i) {
+			double a = fabs(next_v * motor_dist[1][i] - vp * motor_dist[0][i]) * vp / (2 * settings.fp);
+			if (a * k * k > motor_a[i])
+				k = sqrt(motor_a[i] / a);
+		}
+	}
+	// The main part accelerates from where the previous connection left
+	// off, cruises, and slows down to vp before the connection.
+	double dist = 1 - settings.fp - settings.f0;
+	double v_in = settings.entry_v;
+	if (vp * k > sqrt(v_in * v_in + 2 * limit_a * dist))
+		k = sqrt(v_in * v_in + 2 * limit_a * dist) / vp;
+	vp *= k;
+	vq *= k;
+	next_v *= k;
+	double vc = v0 > vp ? v0 : vp;
+	double ta = 0, tc = 0, td = 0;
+	if (!(dist > 0) || !(vc > 0))
+		vc = v_in;
+	else if (isinf(limit_a))
+		tc = dist / vc;
+	else {
+		double peak = sqrt((2 * limit_a * dist + v_in * v_in + vp * vp) / 2);
+		if (vc > peak)
+			vc = peak;
+		ta = fabs(vc - v_in) / limit_a;
+		td = fabs(vc - vp) / limit_a;
+		tc = dist - (v_in + vc) / 2 * ta - (vc + vp) / 2 * td;
+		if (!(tc >= 0)) {
+			// The segment is too short to slow down; do it linearly and let check_distance enforce the limits.
+			vc = v_in;
+			ta = 0;
+			tc = 0;
+			td = dist > 0 ? 2 * dist / (v_in + vp) : 0;
+		}
+		else
+			tc = tc > 0 ? tc / vc : 0;
+	}
+	settings.t0 = ta + tc + td;
+	settings.ta = ta;
+	settings.td = td;
+	settings.v0 = v_in;
+	settings.vc = vc;
+	settings.vp = vp;
+	settings.tp = settings.fp > 0 ? settings.fp / (vp / 2) : 0;
+	settings.s_curve = s_curve;
+	settings.entry_v = next_v;
+	settings.entry_mm = next_v * spaces[0].settings.dist[1];
+	// }}}
 
 	// Set up endpos. {{{
 	for (int s = 0; s < NUM_SPACES; ++s) {
@@ -466,28 +724,56 @@ int next_move() { // {{{
 			debug("Axis %d %d dist %f main dist = %f, next dist = %f currentpos = %f current = %f", s, a, sp.axis[a]->settings.dist[0], sp.axis[a]->settings.main_dist, sp.axis[a]->settings.dist[1], sp.motor[a]->settings.current_pos, sp.axis[a]->settings.current);
 #endif
 		}
-		// Using NULL as target fills endpos.
-		space_types[sp.type].xyz2motors(&sp, NULL);
+		// Convert endpos and, for the lookahead, the end of the next segment in one call.
+		double path = spaces[0].settings.dist[1] * (1 - settings.fq);
+		bool lookahead = plan && path > 0 && settings.entry_mm > 0;
+		double targets[2 * sp.num_axes];
+		double motors[2 * sp.num_motors];
+		double *motors_next = &motors[sp.num_motors];
+		for (int a = 0; a < sp.num_axes; ++a) {
+			targets[a] = sp.axis[a]->settings.target;
+			targets[sp.num_axes + a] = sp.axis[a]->settings.source + (isnan(sp.axis[a]->settings.dist[0]) ? 0 : sp.axis[a]->settings.dist[0]) + (isnan(sp.axis[a]->settings.dist[1]) ? 0 : sp.axis[a]->settings.dist[1]);
+		}
+		space_types[sp.type].xyz2motors(&sp, lookahead ? 2 : 1, targets, motors);
+		for (int m = 0; m < sp.num_motors; ++m)
+			sp.motor[m]->settings.endpos = motors[m];
+		// Motor speeds at endpos, so check_distance only slows down as far as the lookahead requires. {{{
+		if (!lookahead) {
+			for (int m = 0; m < sp.num_motors; ++m)
+				sp.motor[m]->settings.end_v = 0;
+			continue;
+		}
+		for (int m = 0; m < sp.num_motors; ++m) {
+			// Where the motor reverses, the sign makes check_distance ignore this.
+			sp.motor[m]->settings.end_v = (motors_next[m] - sp.motor[m]->settings.endpos) / path * settings.entry_mm;
+			if (isnan(sp.motor[m]->settings.end_v))
+				sp.motor[m]->settings.end_v = 0;
+		}
+		// }}}
 	}
 	// }}}
 
 	// Enable motors if they weren't. {{{
 	if (!motors_busy) {
+#ifdef PLANNER_THREAD
+		planner_call(enable_motors, NULL);
+#else
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			Space &sp = spaces[s];
 			for (int m = 0; m < sp.num_motors; ++m)
 				SET(sp.motor[m]->enable_pin);
 		}
 		motors_busy = true;
+#endif
 	} // }}}
 #ifdef DEBUG_MOVE
-	debug("Segment has been set up: f0=%f fp=%f fq=%f v0=%f /s vp=%f /s vq=%f /s t0=%f s tp=%f s", settings.f0, settings.fp, settings.fq, v0, vp, vq, settings.t0, settings.tp);
+	debug("Segment has been set up: f0=%f fp=%f fq=%f v0=%f /s vc=%f /s vp=%f /s vq=%f /s t0=%f s ta=%f s td=%f s tp=%f s", settings.f0, settings.fp, settings.fq, settings.v0, settings.vc, settings.vp, vq, settings.t0, settings.ta, settings.td, settings.tp);
 #endif
 	// Reset time. {{{
 	settings.hwtime = 0;
 	settings.last_time = 0;
 	settings.last_current_time = 0;
-	settings.start_time = settings.last_time - int32_t(settings.f0 / fabs(vp) * 1e6);
+	settings.start_time = settings.last_time;
 	// }}}
 
 	if (!computing_move) {	// Set up source if this is a new move. {{{
@@ -499,7 +785,10 @@ int next_move() { // {{{
 			Space &sp = spaces[s];
 			for (int a = 0; a < sp.num_axes; ++a)
 				sp.axis[a]->settings.source = sp.axis[a]->settings.current;
+			sp.reset_filters();
 		}
+		// A rewind to this fragment must compute the move again.
+		computing_move = true;
 		store_settings();
 #ifdef DEBUG_PATH
 		fprintf(stderr, "\n");
@@ -512,6 +801,7 @@ int next_move() { // {{{
 } // }}}
 
 void abort_move(int pos) { // {{{
+	planner_stop();
 	aborting = true;
 	//debug("abort pos %d", pos);
 	//debug("abort; cf %d rf %d first %d computing_move %d fragments, regenerating %d ticks", current_fragment, running_fragment, first_fragment, computing_move, pos);
@@ -531,6 +821,7 @@ void abort_move(int pos) { // {{{
 		}
 	}
 	restore_settings();
+	planner_drop();
 #ifdef DEBUG_MOVE
 	debug("move no longer prepared");
 #endif
@@ -544,9 +835,9 @@ void abort_move(int pos) { // {{{
 	if (spaces[0].num_axes > 0)
 		cpdebug(0, 0, "ending hwpos %f", arch_round_pos(0, 0, spaces[0].motor[0]->settings.current_pos) + avr_pos_offset[0]);
 	// Copy settings back to previous fragment.
-	store_settings();
 	computing_move = false;
 	prepared = false;
+	store_settings();
 	current_fragment_pos = 0;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
@@ -151,6 +151,23 @@ void packet()
 	// command[0][2] is the command.
 	uint8_t which;
 	int32_t addr;
+#ifdef PLANNER_THREAD
+	// Stop the planner thread before touching its state; only a few commands leave it alone.
+	switch (command[0][2])
+	{
+	case CMD_GET_UUID:
+	case CMD_READTEMP:
+	case CMD_READPOWER:
+	case CMD_READ_TEMP:
+	case CMD_READ_GPIO:
+	case CMD_READPIN:
+	case CMD_TP_FINDPOS:
+		break;
+	default:
+		planner_stop();
+		break;
+	}
+#endif
 	switch (command[0][2])
 	{
 #ifdef SERIAL
@@ -234,6 +251,7 @@ void packet()
 			return;
 		}
 		queue[settings.queue_end].cb = true;
+		queue[settings.queue_end].event_end = 0;
 		queue[settings.queue_end].arc = false;
 		settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
 		if (settings.queue_end == settings.queue_start) {
@@ -770,14 +788,14 @@ void packet()
 		debug("CMD_TP_SETPOS");
 #endif
 		double pos = get_float(3);
-		int ipos = int(pos);
-		if (ipos > 0 && ipos < run_file_num_records && (run_file_map[ipos - 1].type == RUN_PRE_ARC || run_file_map[ipos - 1].type == RUN_PRE_LINE))
+		off_t ipos = off_t(pos);
+		if (ipos > 0 && ipos < run_file_num_records && (run_record(ipos - 1).type == RUN_PRE_ARC || run_record(ipos - 1).type == RUN_PRE_LINE))
 			ipos -= 1;
 		discarding = true;
 		arch_discard();
-		settings.run_file_current = int(pos);
+		settings.run_file_current = off_t(pos);
 		// Hack to force TP_GETPOS to return the same value; this is only called when paused, so it does no harm.
-		history[running_fragment].run_file_current = int(pos);
+		history[running_fragment].run_file_current = off_t(pos);
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			Space &sp = spaces[s];
 			for (int a = 0; a < sp.num_axes; ++a)
@@ -0,0 +1,236 @@
+/* planner.cpp - optional planning thread for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Copyright 2016 Bas Wijnen <wijnen@debian.org>
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cdriver.h"
+
+#ifdef PLANNER_THREAD
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <atomic>
+
+// With PLANNER_THREAD, buffer_refill() runs in its own thread.  {{{
+// The planner owns the planning state: settings, the queue from
+// queue_start, the space, axis and motor settings, current_fragment and
+// history[current_fragment].  It finishes fragments with
+// arch_store_fragment() and publishes them in a single producer, single
+// consumer ring: planner_finished is advanced by the planner, sent_fragment
+// by the main thread, which sends the fragments in between with
+// planner_send().  The ring is history[] and the fragment storage of the
+// backend, so it holds the same fragments as the hardware buffer.
+//
+// The main thread owns all i/o: host, firmware, timers and run file events.
+// When the planner needs any of that (host messages, run file events,
+// enabling motors, more moves from the run file), it calls planner_call()
+// and waits until the main thread has done it.
+//
+// Before the main thread uses planning state, it calls planner_stop().  The
+// planner stops at the next sample and waits until planner_continue(), which
+// the main loop calls before it polls.  While the planner is stopped, the
+// main thread can rewind with restore_settings(), like abort_move() and
+// discard do; planner_drop() then removes the dropped fragments from the
+// ring.
+// }}}
+
+static pthread_t planner_thread;
+static pthread_mutex_t planner_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t planner_cond = PTHREAD_COND_INITIALIZER;	// The planner waits for this.
+static pthread_cond_t planner_main_cond = PTHREAD_COND_INITIALIZER;	// The main thread waits for this.
+static bool planner_wanted = false;	// buffer_refill() was requested.
+static bool planner_running = false;	// buffer_refill() is running.
+static std::atomic <bool> planner_halt(false);	// The main thread wants the planner to stop.
+static void (*planner_func)(void *) = NULL;	// Call that the planner waits for.
+static void *planner_arg;
+static bool planner_serving = false;	// The main thread is running planner_func.
+static std::atomic <int> planner_finished(0);	// Fragments before this one were finished by the planner.
+static int planner_fd;	// Wakes the main thread; pollfds[4].
+
+static void planner_notify() { // {{{
+	uint64_t one = 1;
+	if (write(planner_fd, &one, sizeof(one)) != sizeof(one))
+		debug("unable to wake main thread: %s", strerror(errno));
+} // }}}
+
+static void *planner_run(void *arg) { // {{{
+	(void)&arg;
+	pthread_mutex_lock(&planner_mutex);
+	while (true) {
+		while (!planner_wanted || planner_halt)
+			pthread_cond_wait(&planner_cond, &planner_mutex);
+		planner_wanted = false;
+		planner_running = true;
+		pthread_mutex_unlock(&planner_mutex);
+		buffer_refill();
+		pthread_mutex_lock(&planner_mutex);
+		// If it was stopped, it continues where it was after planner_continue().
+		if (planner_halt)
+			planner_wanted = true;
+		planner_running = false;
+		pthread_cond_broadcast(&planner_main_cond);
+		if (!planner_halt)
+			planner_notify();	// The move may be started now.
+	}
+	return NULL;
+} // }}}
+
+static void planner_serve() { // {{{
+	// Run the call that the planner waits for.  planner_mutex is locked.
+	void (*func)(void *) = planner_func;
+	planner_serving = true;
+	pthread_mutex_unlock(&planner_mutex);
+	func(planner_arg);
+	pthread_mutex_lock(&planner_mutex);
+	planner_serving = false;
+	planner_func = NULL;
+	pthread_cond_broadcast(&planner_cond);
+} // }}}
+
+void planner_start() { // {{{
+	planner_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (planner_fd < 0) {
+		debug("unable to create planner event: %s", strerror(errno));
+		abort();
+	}
+	pollfds[4].fd = planner_fd;
+	sent_fragment = current_fragment;
+	planner_finished = current_fragment;
+	if (pthread_create(&planner_thread, NULL, planner_run, NULL) != 0) {
+		debug("unable to start planner thread");
+		abort();
+	}
+} // }}}
+
+bool planner_self() { // {{{
+	return pthread_equal(pthread_self(), planner_thread);
+} // }}}
+
+void planner_wake() { // {{{
+	pthread_mutex_lock(&planner_mutex);
+	planner_wanted = true;
+	pthread_cond_broadcast(&planner_cond);
+	pthread_mutex_unlock(&planner_mutex);
+} // }}}
+
+bool planner_stopping() { // {{{
+	// Checked by the planner after every sample.
+	return planner_halt.load(std::memory_order_relaxed);
+} // }}}
+
+void planner_stop() { // {{{
+	// Called by the main thread before it uses planning state.
+	if (planner_self() || planner_serving)
+		return;	// The planner waits for this thread, like a call from buffer_refill() without the thread.
+	pthread_mutex_lock(&planner_mutex);
+	planner_halt = true;
+	while (planner_running) {
+		if (planner_func)
+			planner_serve();
+		else
+			pthread_cond_wait(&planner_main_cond, &planner_mutex);
+	}
+	pthread_mutex_unlock(&planner_mutex);
+} // }}}
+
+void planner_continue() { // {{{
+	pthread_mutex_lock(&planner_mutex);
+	if (planner_halt) {
+		planner_halt = false;
+		pthread_cond_broadcast(&planner_cond);
+	}
+	pthread_mutex_unlock(&planner_mutex);
+} // }}}
+
+void planner_call(void (*func)(void *), void *arg) { // {{{
+	// Let the main thread run func(arg) and wait for it.
+	if (!planner_self()) {
+		func(arg);
+		return;
+	}
+	pthread_mutex_lock(&planner_mutex);
+	planner_func = func;
+	planner_arg = arg;
+	pthread_cond_broadcast(&planner_main_cond);
+	planner_notify();
+	while (planner_func)
+		pthread_cond_wait(&planner_cond, &planner_mutex);
+	pthread_mutex_unlock(&planner_mutex);
+} // }}}
+
+void planner_publish() { // {{{
+	// The planner finished the fragment before current_fragment.
+	planner_finished.store(current_fragment, std::memory_order_release);
+	planner_notify();
+} // }}}
+
+void planner_drop() { // {{{
+	// The main thread moved current_fragment back; fragments from there on are no longer in the ring.
+	if ((sent_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER)
+		sent_fragment = current_fragment;
+	planner_finished.store(current_fragment, std::memory_order_relaxed);
+} // }}}
+
+void planner_send() { // {{{
+	// Send finished fragments to the hardware, in order, as long as it takes them.
+	int finished = planner_finished.load(std::memory_order_acquire);
+	while (sent_fragment != finished) {
+		if (!arch_send_stored_fragment(sent_fragment))
+			return;
+		sent_fragment = (sent_fragment + 1) % FRAGMENTS_PER_BUFFER;
+		if ((sent_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER >= MIN_BUFFER_FILL && !stopping)
+			arch_start_move(0);
+	}
+	// Everything was sent; if the planner is done, the move can start even if the buffer isn't full.
+	pthread_mutex_lock(&planner_mutex);
+	bool idle = !planner_running && !planner_wanted;
+	pthread_mutex_unlock(&planner_mutex);
+	if (idle)
+		arch_start_move(0);
+} // }}}
+
+bool planner_pending() { // {{{
+	// There are finished fragments that were not sent yet.
+	return planner_finished.load(std::memory_order_acquire) != sent_fragment;
+} // }}}
+
+void planner_handle() { // {{{
+	// The planner woke the main thread: it finished a fragment or waits for a call.
+	uint64_t count;
+	while (read(planner_fd, &count, sizeof(count)) == sizeof(count)) {
+	}
+	pthread_mutex_lock(&planner_mutex);
+	if (planner_func)
+		planner_serve();
+	pthread_mutex_unlock(&planner_mutex);
+	planner_send();
+} // }}}
+
+void planner_sync() { // {{{
+	// Let the planner do all requested work, and send what it made.
+	pthread_mutex_lock(&planner_mutex);
+	planner_halt = false;
+	pthread_cond_broadcast(&planner_cond);
+	while (planner_running || planner_wanted) {
+		if (planner_func)
+			planner_serve();
+		else
+			pthread_cond_wait(&planner_main_cond, &planner_mutex);
+	}
+	pthread_mutex_unlock(&planner_mutex);
+	planner_send();
+} // }}}
+#endif
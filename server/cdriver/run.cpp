@@ -20,6 +20,7 @@
 #include "cdriver.h"
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 
 #if 0
 #define rundebug debug
@@ -27,12 +28,13 @@
 #define rundebug(...) do {} while(0)
 #endif
 
-static int read_num(off_t offset) {
-	int ret = 0;
+static int64_t read_num(off_t offset) {
+	// Read a little endian int32_t from the run file.
+	uint32_t ret = 0;
 	uint8_t const *map = reinterpret_cast<uint8_t const *>(run_file_map);
 	for (int i = 0; i < 4; ++i)
-		ret |= (map[offset + i]) << (8 * i);
-	return ret;
+		ret |= uint32_t(map[offset + i]) << (8 * i);
+	return int32_t(ret);
 }
 
 struct String {
@@ -41,11 +43,345 @@ struct String {
 };
 
 static String *strings;
+static off_t strings_size;	// Number of allocated entries in strings.
+
+// A streamed run file is followed while it is being written.
+static int run_file_fd = -1;	// Open while the file is used.
+static int run_file_watch = -1;	// Inotify watch on the growing file.
+static int run_strings_fd = -1;	// String file of a streamed run file.
+static off_t run_strings_pos;	// Size of the part of the string file that has been indexed.
+static bool run_file_caught_up;	// All records that were written have been run; run_file_wait is raised for it.
+
+static void run_strings_update() { // {{{
+	// Index the strings that were added to the string file.
+	struct stat stat;
+	if (fstat(run_strings_fd, &stat) < 0) {
+		debug("Failed to stat string file: %s", strerror(errno));
+		return;
+	}
+	int32_t len;
+	while (run_strings_pos + off_t(sizeof(len)) <= stat.st_size && pread(run_strings_fd, &len, sizeof(len), run_strings_pos) == sizeof(len)) {
+		if (len < 0 || run_strings_pos + off_t(sizeof(len)) + len > stat.st_size)
+			break;	// The string is not completely written yet.
+		if (run_file_num_strings >= strings_size) {
+			strings_size = strings_size > 0 ? strings_size * 2 : 16;
+			strings = reinterpret_cast<String *>(realloc(strings, strings_size * sizeof(String)));
+		}
+		strings[run_file_num_strings].len = len;
+		strings[run_file_num_strings].start = run_strings_pos + sizeof(len);
+		run_file_num_strings += 1;
+		run_strings_pos += sizeof(len) + len;
+	}
+} // }}}
+
+static int run_string(int which, char *dst, int size) { // {{{
+	// Copy at most size bytes of a string to dst; return its full length.
+	if (run_strings_fd >= 0 && which >= run_file_num_strings)
+		run_strings_update();
+	if (which < 0 || which >= run_file_num_strings) {
+		debug("Invalid string %d in %s", which, run_file_name);
+		return 0;
+	}
+	int len = min(strings[which].len, size);
+	if (run_strings_fd < 0)
+		memcpy(dst, &reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[which].start], len);
+	else if (pread(run_strings_fd, dst, len, strings[which].start) != len) {
+		debug("Failed to read string %d: %s", which, strerror(errno));
+		return 0;
+	}
+	return strings[which].len;
+} // }}}
+
+static void run_stream_stop() { // {{{
+	// Stop following the run file.
+	if (run_file_watch >= 0) {
+		inotify_rm_watch(pollfds[3].fd, run_file_watch);
+		run_file_watch = -1;
+	}
+	run_file_growing = false;
+} // }}}
+
+static void run_stream_update() { // {{{
+	// Map the records that were added to the growing run file.
+	struct stat stat;
+	if (fstat(run_file_fd, &stat) < 0) {
+		debug("Failed to stat run file '%s': %s", run_file_name, strerror(errno));
+		return;
+	}
+	if (stat.st_size > run_file_size) {
+		void *map = mremap(run_file_map, run_file_size, stat.st_size, MREMAP_MAYMOVE);
+		if (map == MAP_FAILED) {
+			debug("Failed to map new part of run file '%s': %s", run_file_name, strerror(errno));
+			return;
+		}
+		run_file_map = reinterpret_cast<Run_Record *>(map);
+		run_file_size = stat.st_size;
+	}
+	// A partly written record is not used yet.
+	off_t num = run_file_size / sizeof(Run_Record);
+	for (off_t i = run_file_num_records > 0 ? run_file_num_records : 1; i < num; ++i) {
+		if (run_file_map[i].type == RUN_STREAM && run_file_map[i].tool == 1) {
+			// The writer is done; anything after the end is ignored.
+			num = i + 1;
+			run_stream_stop();
+			break;
+		}
+	}
+	run_file_num_records = num;
+	if (run_file_caught_up && settings.run_file_current < run_file_num_records) {
+		run_file_caught_up = false;
+		if (run_file_wait)
+			run_file_wait -= 1;
+	}
+} // }}}
+
+static bool run_stream_start(int fd) { // {{{
+	// Streamed file format:
+	// Run_Record start: type RUN_STREAM, tool 0
+	// records
+	// Run_Record end: type RUN_STREAM, tool 1, X-F: bbox, time, dist: totals
+	// The file is run while records are appended; the end record marks
+	// that it is complete.  Strings are in a separate file which has the
+	// name of the run file with ".str" appended.  It contains int32_t
+	// length, followed by the bytes, for every string.  A string is
+	// written before the records that use it.
+	char name[sizeof(run_file_name) + 4];
+	snprintf(name, sizeof(name), "%s.str", run_file_name);
+	run_strings_fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (run_strings_fd < 0) {
+		debug("Failed to open string file '%s': %s", name, strerror(errno));
+		return false;
+	}
+	run_file_watch = inotify_add_watch(pollfds[3].fd, run_file_name, IN_MODIFY | IN_CLOSE_WRITE);
+	if (run_file_watch < 0) {
+		debug("Failed to watch run file '%s': %s", run_file_name, strerror(errno));
+		close(run_strings_fd);
+		run_strings_fd = -1;
+		return false;
+	}
+	run_file_fd = fd;
+	run_file_growing = true;
+	run_file_caught_up = false;
+	run_strings_pos = 0;
+	run_file_num_strings = 0;
+	run_file_first_string = 0;
+	run_file_num_records = 0;
+	run_stream_update();
+	return true;
+} // }}}
+
+// Compact file format:
+// Run_Compact_Header
+// uint64_t block[num_blocks + 1]: file offsets of the blocks, and of the end of the last block.
+// blocks
+// strings, lengths, number of strings and bbox as in other run files.
+// Every block holds block_records records, except the last one, which may
+// be shorter.  Each record is:
+// varint: type | tool changed << 4 | field changed << (5 + field)
+// if tool changed: zigzag varint tool difference
+// for every changed field (X, Y, Z, E, f, F, time, dist): varint v.
+// If v is 0, the raw double follows; otherwise the field is q * quantum,
+// where q is increased by zigzag(v - 1).  Fields that don't change keep
+// their value.  Every block starts with all values 0, so it can be
+// decoded on its own; that is what run_find_pos and resuming need.
+#define RUN_COMPACT_VERSION 2
+#define RUN_COMPACT_CACHE 2	// Number of decoded blocks that are kept.
+struct Run_Compact_Header {
+	uint8_t magic[4];	// 0xff 'F' 'R' 'C'; 0xff never starts a record or a UTF-8 string.
+	uint32_t version;
+	uint32_t block_records;
+	uint32_t reserved;	// 0.
+	int64_t num_records;
+	double quantum;
+};
+static_assert(sizeof(Run_Compact_Header) == 32, "the block index must be aligned");
+
+static Run_Compact_Header run_compact_header;
+static Run_Compact_Header const *run_compact;	// Header of a compact run file, or NULL.
+static uint64_t const *run_compact_index;
+static Run_Record *run_compact_cache[RUN_COMPACT_CACHE];
+static off_t run_compact_num_blocks;
+static off_t run_compact_block[RUN_COMPACT_CACHE];	// Block in each cache entry, or -1.
+static int run_compact_last;	// Cache entry that was used last.
+
+static bool run_compact_varint(uint8_t const *&p, uint8_t const *end, uint64_t &ret) { // {{{
+	ret = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (p >= end)
+			return false;
+		uint8_t b = *p++;
+		ret |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+} // }}}
+
+static int64_t run_compact_zigzag(uint64_t v) { // {{{
+	return int64_t(v >> 1) ^ -int64_t(v & 1);
+} // }}}
+
+static void run_compact_decode(off_t block, Run_Record *dst) { // {{{
+	uint8_t const *map = reinterpret_cast<uint8_t const *>(run_file_map);
+	uint8_t const *p = &map[run_compact_index[block]];
+	uint8_t const *end = &map[run_compact_index[block + 1]];
+	off_t first = block * run_compact->block_records;
+	int num = run_compact->num_records - first < run_compact->block_records ? run_compact->num_records - first : run_compact->block_records;
+	int32_t tool = 0;
+	double value[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	int64_t q[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	int i;
+	for (i = 0; i < num; ++i) {
+		uint64_t head, v;
+		if (!run_compact_varint(p, end, head))
+			break;
+		if (head & 0x10) {
+			if (!run_compact_varint(p, end, v))
+				break;
+			tool += run_compact_zigzag(v);
+		}
+		int f;
+		for (f = 0; f < 8; ++f) {
+			if (!(head & (0x20 << f)))
+				continue;
+			if (!run_compact_varint(p, end, v))
+				break;
+			if (v == 0) {
+				if (end - p < off_t(sizeof(double)))
+					break;
+				memcpy(&value[f], p, sizeof(double));
+				p += sizeof(double);
+			}
+			else {
+				q[f] += run_compact_zigzag(v - 1);
+				value[f] = q[f] * run_compact->quantum;
+			}
+		}
+		if (f < 8)
+			break;
+		dst[i].type = head & 0xf;
+		dst[i].tool = tool;
+		// X through dist are consecutive in the (packed) record.
+		memcpy(&dst[i].X, value, sizeof(value));
+	}
+	if (i < num) {
+		debug("Run file block %ld is corrupt at record %ld; skipping the rest of it", long(block), long(first + i));
+		// Stream markers don't do anything.
+		for (; i < num; ++i) {
+			memset(&dst[i], 0, sizeof(Run_Record));
+			dst[i].type = RUN_STREAM;
+		}
+	}
+} // }}}
+
+Run_Record const &run_record(off_t which) { // {{{
+	// Get a record from the run file.  For a compact file, the returned
+	// reference stays valid until RUN_COMPACT_CACHE other blocks are used.
+	if (!run_compact)
+		return run_file_map[which];
+	off_t block = which / run_compact->block_records;
+	int entry = run_compact_last;
+	if (run_compact_block[entry] != block) {
+		for (entry = 0; entry < RUN_COMPACT_CACHE; ++entry) {
+			if (run_compact_block[entry] == block)
+				break;
+		}
+		if (entry == RUN_COMPACT_CACHE) {
+			// Replace the entry after the last used one; with two entries, that is the least recently used.
+			entry = (run_compact_last + 1) % RUN_COMPACT_CACHE;
+			run_compact_decode(block, run_compact_cache[entry]);
+			run_compact_block[entry] = block;
+		}
+		run_compact_last = entry;
+	}
+	return run_compact_cache[entry][which % run_compact->block_records];
+} // }}}
+
+static bool run_compact_start() { // {{{
+	// run_file_map points to packed records; copy the header out of it.
+	memcpy(&run_compact_header, run_file_map, sizeof(Run_Compact_Header));
+	Run_Compact_Header const *header = &run_compact_header;
+	if (header->version != RUN_COMPACT_VERSION) {
+		debug("Unsupported compact run file version %d", header->version);
+		return false;
+	}
+	if (header->block_records == 0 || header->block_records > 1 << 20 || header->num_records < 0 || !(header->quantum > 0)) {
+		debug("Invalid compact run file header");
+		return false;
+	}
+	off_t num_blocks = (header->num_records + header->block_records - 1) / header->block_records;
+	off_t data = sizeof(Run_Compact_Header) + sizeof(uint64_t) * (num_blocks + 1);
+	if (data > run_file_first_string) {
+		debug("Compact run file is too short");
+		return false;
+	}
+	uint64_t const *index = reinterpret_cast<uint64_t const *>(&reinterpret_cast<uint8_t const *>(run_file_map)[sizeof(Run_Compact_Header)]);
+	if (index[0] != uint64_t(data) || index[num_blocks] != uint64_t(run_file_first_string)) {
+		debug("Invalid compact run file block index");
+		return false;
+	}
+	for (off_t b = 0; b < num_blocks; ++b) {
+		if (index[b + 1] < index[b]) {
+			debug("Invalid compact run file block index");
+			return false;
+		}
+	}
+	for (int e = 0; e < RUN_COMPACT_CACHE; ++e) {
+		run_compact_cache[e] = reinterpret_cast<Run_Record *>(malloc(header->block_records * sizeof(Run_Record)));
+		run_compact_block[e] = -1;
+	}
+	run_compact_last = 0;
+	run_compact_index = index;
+	run_compact_num_blocks = num_blocks;
+	run_compact = header;
+	run_file_num_records = header->num_records;
+	return true;
+} // }}}
+
+static off_t run_file_offset(off_t record) { // {{{
+	// Position of a record in the run file.
+	if (run_file_audio >= 0)
+		return sizeof(double) + record;
+	if (run_compact) {
+		off_t block = record / run_compact->block_records;
+		return run_compact_index[block < run_compact_num_blocks ? block : run_compact_num_blocks];
+	}
+	return record * sizeof(Run_Record);
+} // }}}
+
+static off_t run_file_advised;	// Start of the access window, or -1.
+
+static void run_file_advise() { // {{{
+	// Move the access window along with the current record.  It is only
+	// moved once the current record has moved half of RUN_FILE_AHEAD, or
+	// backwards.
+	off_t page = sysconf(_SC_PAGESIZE);
+	off_t pos = run_file_offset(settings.run_file_current) / page * page;
+	if (pos > run_file_size)
+		pos = run_file_size / page * page;
+	if (run_file_advised >= 0 && pos >= run_file_advised && pos < run_file_advised + RUN_FILE_AHEAD / 2)
+		return;
+	run_file_advised = pos;
+	char *map = reinterpret_cast<char *>(run_file_map);
+	off_t ahead = run_file_size - pos < RUN_FILE_AHEAD ? run_file_size - pos : RUN_FILE_AHEAD;
+	if (ahead > 0)
+		madvise(&map[pos], ahead, MADV_WILLNEED);
+	if (pos > RUN_FILE_BEHIND) {
+		// Unmap the pages, so they can be dropped from the page cache.
+		madvise(map, pos - RUN_FILE_BEHIND, MADV_DONTNEED);
+		posix_fadvise(run_file_fd, 0, pos - RUN_FILE_BEHIND, POSIX_FADV_DONTNEED);
+	}
+} // }}}
+
+struct Run_Index_Header;
+static Run_Index_Header *run_index;	// Index for run_find_pos, allocated together with its data; see below.
 
 static Run_Record run_preline;
 
 static double probe_adjust;
 
+static pid_t run_file_child = -1;	// System command that the run file is waiting for.
+
 void run_file(int name_len, char const *name, int probe_name_len, char const *probename, bool start, double sina, double cosa, int audio) {
 	rundebug("run file %d %f %f", start, sina, cosa);
 	abort_run_file();
@@ -94,45 +430,104 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 		return;
 	}
 	run_file_size = stat.st_size;
-	run_file_map = reinterpret_cast<Run_Record *>(mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0));
-	close(fd);
+	// Every run file, also a stream that was just started, holds at least one record's worth of data.
+	if (run_file_size < (audio < 0 ? off_t(sizeof(Run_Record)) : off_t(sizeof(double)))) {
+		debug("Run file '%s' is too short", run_file_name);
+		close(fd);
+		if (probe_name_len > 0)
+			close(probe_fd);
+		return;
+	}
+	void *map = mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		debug("Failed to map run file '%s': %s", run_file_name, strerror(errno));
+		close(fd);
+		if (probe_name_len > 0)
+			close(probe_fd);
+		return;
+	}
+	run_file_map = reinterpret_cast<Run_Record *>(map);
 	if (probe_name_len > 0) {
-		probe_file_map = reinterpret_cast<ProbeFile *>(mmap(NULL, probe_file_size, PROT_READ, MAP_SHARED, probe_fd, 0));
+		map = mmap(NULL, probe_file_size, PROT_READ, MAP_SHARED, probe_fd, 0);
 		close(probe_fd);
+		if (map == MAP_FAILED) {
+			debug("Failed to map probe file '%s': %s", probe_file_name, strerror(errno));
+			munmap(run_file_map, run_file_size);
+			run_file_map = NULL;
+			close(fd);
+			return;
+		}
+		probe_file_map = reinterpret_cast<ProbeFile *>(map);
 		if (((probe_file_map->nx + 1) * (probe_file_map->ny + 1)) * sizeof(double) + sizeof(ProbeFile) != unsigned(probe_file_size)) {
-			debug("Invalid probe file size %ld != %ld", probe_file_size, ((probe_file_map->nx + 1) * (probe_file_map->ny + 1)) * sizeof(double) + sizeof(ProbeFile));
+			debug("Invalid probe file size %ld != %ld", long(probe_file_size), long(((probe_file_map->nx + 1) * (probe_file_map->ny + 1)) * sizeof(double) + sizeof(ProbeFile)));
 			munmap(probe_file_map, probe_file_size);
 			munmap(run_file_map, run_file_size);
 			probe_file_map = NULL;
 			run_file_map = NULL;
+			close(fd);
 			return;
 		}
 	}
 	else
 		probe_file_map = NULL;
-	if (audio < 0) {
+	if (audio < 0 && run_file_size >= off_t(sizeof(Run_Record)) && run_file_map[0].type == RUN_STREAM) {
+		if (!run_stream_start(fd)) {
+			abort_run_file();
+			close(fd);
+			return;
+		}
+	}
+	else if (audio < 0) {
 		// File format:
-		// records
+		// records, or compact header and blocks (see above)
 		// strings
 		// int32_t stringlengths[]
 		// int32_t numstrings
 		// double bbox[8]
 		run_file_num_strings = read_num(run_file_size - sizeof(double) * 8 - sizeof(int32_t));
+		off_t pos = run_file_size - off_t(sizeof(double) * 8 + sizeof(int32_t)) - off_t(sizeof(int32_t)) * run_file_num_strings;
+		if (run_file_num_strings < 0 || pos < 0) {
+			debug("Invalid string table in run file '%s'", run_file_name);
+			run_file_num_strings = 0;
+			abort_run_file();
+			close(fd);
+			return;
+		}
 		strings = reinterpret_cast<String *>(malloc(run_file_num_strings * sizeof(String)));
-		off_t pos = run_file_size - sizeof(double) * 8 - sizeof(int32_t) - sizeof(int32_t) * run_file_num_strings;
 		off_t current = 0;
-		for (int i = 0; i < run_file_num_strings; ++i) {
+		off_t i;
+		for (i = 0; i < run_file_num_strings; ++i) {
 			strings[i].start = current;
 			strings[i].len = read_num(pos + sizeof(int32_t) * i);
+			if (strings[i].len < 0)
+				break;
 			current += strings[i].len;
 		}
 		run_file_first_string = pos - current;
-		run_file_num_records = run_file_first_string / sizeof(Run_Record);
+		if (i < run_file_num_strings || run_file_first_string < 0) {
+			debug("Invalid string table in run file '%s'", run_file_name);
+			abort_run_file();
+			close(fd);
+			return;
+		}
+		uint8_t const *magic = reinterpret_cast<uint8_t const *>(run_file_map);
+		if (run_file_first_string >= off_t(sizeof(Run_Compact_Header)) && magic[0] == 0xff && magic[1] == 'F' && magic[2] == 'R' && magic[3] == 'C') {
+			if (!run_compact_start()) {
+				abort_run_file();
+				close(fd);
+				return;
+			}
+		}
+		else
+			run_file_num_records = run_file_first_string / sizeof(Run_Record);
 	}
 	else {
 		audio_hwtime_step = 1000000. / *reinterpret_cast <double *>(run_file_map);
 		run_file_num_records = run_file_size - sizeof(double);
 	}
+	run_file_fd = fd;
+	run_file_advised = -1;
+	madvise(run_file_map, run_file_size, MADV_SEQUENTIAL);
 	run_file_wait_temp = 0;
 	run_file_wait = start ? 0 : 1;
 	run_file_timer.it_interval.tv_sec = 0;
@@ -148,13 +543,27 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 	run_preline.Y = NAN;
 	run_preline.Z = NAN;
 	run_preline.E = NAN;
+	// Drop events which were left behind by an aborted file.
+	run_event_done = run_event_end;
+	event_after_current_move = 0;
 	run_file_fill_queue();
 }
 
 void abort_run_file() {
 	run_file_finishing = false;
+	// A system command that is still running is no longer waited for.
+	run_file_child = -1;
 	if (!run_file_map)
 		return;
+	run_stream_stop();
+	if (run_file_fd >= 0) {
+		close(run_file_fd);
+		run_file_fd = -1;
+	}
+	if (run_strings_fd >= 0) {
+		close(run_strings_fd);
+		run_strings_fd = -1;
+	}
 	munmap(run_file_map, run_file_size);
 	run_file_map = NULL;
 	if (probe_file_map) {
@@ -163,6 +572,16 @@ void abort_run_file() {
 	}
 	free(strings);
 	strings = NULL;
+	strings_size = 0;
+	free(run_index);
+	run_index = NULL;
+	if (run_compact) {
+		for (int e = 0; e < RUN_COMPACT_CACHE; ++e) {
+			free(run_compact_cache[e]);
+			run_compact_cache[e] = NULL;
+		}
+		run_compact = NULL;
+	}
 	arch_stop_audio();
 }
 
@@ -212,12 +631,174 @@ static double handle_probe(double ox, double oy, double z) {
 	return z + l * (1 - fx) + r * fx + probe_adjust;
 }
 
+static void run_system(Run_Record const &r) { // {{{
+	// The command runs in the background; if X is 0, the run file waits until it is done.
+	int len = run_string(r.tool, NULL, 0);
+	char *cmd = reinterpret_cast<char *>(alloca(len + 1));
+	len = run_string(r.tool, cmd, len);
+	cmd[len] = '\0';
+	debug("Running system command: %d %s", r.tool, cmd);
+	pid_t pid = fork();
+	if (pid < 0) {
+		debug("Failed to run system command: %s", strerror(errno));
+		return;
+	}
+	if (!pid) {
+		// Child.  Standard output is the connection to the host, so send output to standard error instead.
+		dup2(2, 1);
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		execl("/bin/sh", "sh", "-c", cmd, static_cast <char *>(NULL));
+		_exit(127);
+	}
+	if (!r.X) {
+		run_file_child = pid;
+		run_file_wait += 1;
+	}
+} // }}}
+
+void run_system_done() { // {{{
+	// SIGCHLD was received; reap all children that are done.
+	struct signalfd_siginfo info;
+	while (read(pollfds[2].fd, &info, sizeof(info)) == sizeof(info)) {
+	}
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		debug("Done running system command, return = %d", status);
+		if (pid != run_file_child)
+			continue;
+		run_file_child = -1;
+		if (run_file_wait)
+			run_file_wait -= 1;
+		run_file_fill_queue();
+	}
+} // }}}
+
+void run_file_follow() { // {{{
+	// The growing run file was written to.
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (read(pollfds[3].fd, buffer, sizeof(buffer)) > 0) {
+	}
+	if (!run_file_map || !run_file_growing)
+		return;
+	planner_stop();
+	run_stream_update();
+	run_file_fill_queue();
+} // }}}
+
+static void run_event(Run_Record const &r) { // {{{
+	BENCH_COUNT(BENCH_EVENTS);
+	switch (r.type) {
+		case RUN_SYSTEM:
+			run_system(r);
+			break;
+		case RUN_GPIO:
+		{
+			int tool = r.tool;
+			if (tool == -2)
+				tool = fan_id != 255 ? fan_id : -1;
+			else if (tool == -3)
+				tool = spindle_id != 255 ? spindle_id : -1;
+			if (tool < 0 || tool >= num_gpios) {
+				if (tool != -1)
+					debug("cannot set invalid gpio %d", tool);
+				break;
+			}
+			if (r.X) {
+				gpios[tool].state = 1;
+				SET(gpios[tool].pin);
+			}
+			else {
+				gpios[tool].state = 0;
+				RESET(gpios[tool].pin);
+			}
+			send_host(CMD_UPDATE_PIN, tool, gpios[tool].state);
+			break;
+		}
+		case RUN_SETTEMP:
+		{
+			int tool = r.tool;
+			if (tool == -1)
+				tool = bed_id != 255 ? bed_id : -1;
+			rundebug("settemp %d %f", tool, r.X);
+			settemp(tool, r.X);
+			send_host(CMD_UPDATE_TEMP, tool, 0, r.X);
+			break;
+		}
+	}
+} // }}}
+
+void run_events_attach(int end) { // {{{
+	// Make events before end happen when the fragment that holds the end of the current motion is done.
+	if (end <= run_event_done)
+		return;
+	int f;
+	if (current_fragment_pos > 0)
+		f = current_fragment;
+	else if (running_fragment != current_fragment)
+		f = (current_fragment + FRAGMENTS_PER_BUFFER - 1) % FRAGMENTS_PER_BUFFER;
+	else {
+		// Nothing is moving anymore.
+		run_events_fire(end);
+		return;
+	}
+	if (history[f].event_end < end)
+		history[f].event_end = end;
+} // }}}
+
+#ifdef PLANNER_THREAD
+static void run_events_fire_call(void *arg) { // {{{
+	run_events_fire(*reinterpret_cast <int *>(arg));
+} // }}}
+#endif
+
+void run_events_fire(int end) { // {{{
+#ifdef PLANNER_THREAD
+	if (planner_self()) {
+		// Events do i/o, so they happen in the main thread.
+		planner_call(run_events_fire_call, &end);
+		return;
+	}
+#endif
+	while (run_event_done < end) {
+		off_t record = run_events[run_event_done % EVENT_QUEUE_LENGTH];
+		run_event_done += 1;
+		// If the file was aborted, the events are dropped.
+		if (run_file_map)
+			run_event(run_record(record));
+	}
+} // }}}
+
+#ifdef PLANNER_THREAD
+// The planner thread asks for moves when the lookahead runs low; fill the queue further, so it doesn't need to ask for every move.
+#define RUN_QUEUE_MOVES (2 * LOOKAHEAD_HORIZON + 2)
+
+static void run_file_fill_queue_call(void *arg) { // {{{
+	(void)&arg;
+	run_file_fill_queue();
+} // }}}
+#else
+#define RUN_QUEUE_MOVES (LOOKAHEAD_HORIZON + 2)
+#endif
+static_assert(RUN_QUEUE_MOVES < QUEUE_LENGTH, "moves from the run file must fit in the queue");
+
 void run_file_fill_queue() {
+#ifdef PLANNER_THREAD
+	if (planner_self()) {
+		// The run file belongs to the main thread.
+		if (run_file_map && (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH < LOOKAHEAD_HORIZON + 2 && !settings.queue_full)
+			planner_call(run_file_fill_queue_call, NULL);
+		return;
+	}
+	planner_stop();
+#endif
 	static bool lock = false;
 	if (lock)
 		return;
 	lock = true;
-	rundebug("run queue, current = %d wait = %d tempwait = %d q = %d %d %d finish = %d", settings.run_file_current, run_file_wait, run_file_wait_temp, settings.queue_end, settings.queue_start, settings.queue_full, run_file_finishing);
+	rundebug("run queue, current = %ld wait = %d tempwait = %d q = %d %d %d finish = %d", long(settings.run_file_current), run_file_wait, run_file_wait_temp, settings.queue_end, settings.queue_start, settings.queue_full, run_file_finishing);
 	if (run_file_audio >= 0) {
 		while (true) {
 			if (!run_file_map || run_file_wait || run_file_finishing)
@@ -233,10 +814,16 @@ void run_file_fill_queue() {
 			settings.run_file_current = arch_send_audio(&reinterpret_cast <uint8_t *>(run_file_map)[sizeof(double)], settings.run_file_current, run_file_num_records, run_file_audio);
 			current_fragment = next;
 			//debug("current_fragment = next; %d", current_fragment);
+#ifdef PLANNER_THREAD
+			sent_fragment = current_fragment;	// arch_send_audio() sent it.
+#endif
+			planner_drop();
 			store_settings();
 			if ((current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER >= MIN_BUFFER_FILL && !stopping)
 				arch_start_move(0);
 		}
+		if (run_file_map)
+			run_file_advise();
 		lock = false;
 		return;
 	}
@@ -245,26 +832,42 @@ void run_file_fill_queue() {
 	while (must_move) {
 		must_move = false;
 		while (run_file_map	// There is a file to run.
-				&& (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH < 4	// There is space in the queue.
+				&& (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH < RUN_QUEUE_MOVES	// There is space in the queue; keep enough moves for the lookahead.
 				&& !settings.queue_full	// Really, there is space in the queue.
 				&& settings.run_file_current < run_file_num_records	// There are records to send.
 				&& !run_file_wait_temp	// We are not waiting for a temp alarm.
 				&& !run_file_wait	// We are not waiting for something else (pause or confirm).
 				&& !run_file_finishing) {	// We are not waiting for underflow (should be impossible anyway, if there are commands in the queue).
-			int t = run_file_map[settings.run_file_current].type;
-			if (t != RUN_LINE && t != RUN_PRE_LINE && t != RUN_PRE_ARC && t != RUN_ARC && (arch_running() || settings.queue_end != settings.queue_start || computing_move || sending_fragment || transmitting_fragment))
-				break;
-			Run_Record &r = run_file_map[settings.run_file_current];
-			rundebug("running %d: %d %d", settings.run_file_current, r.type, r.tool);
+			int t = run_record(settings.run_file_current).type;
+			if (t == RUN_STREAM) {
+				// Start and end markers of a streamed file don't do anything.
+				settings.run_file_current += 1;
+				continue;
+			}
+			if (t != RUN_LINE && t != RUN_PRE_LINE && t != RUN_PRE_ARC && t != RUN_ARC && (arch_running() || settings.queue_end != settings.queue_start || computing_move || sending_fragment || transmitting_fragment || planner_pending())) {
+				// Gpio and temperature changes don't need to stop the machine; they happen when the motion before them is done.
+				// So do system commands that are not waited for.
+				if ((t != RUN_GPIO && t != RUN_SETTEMP && (t != RUN_SYSTEM || !run_record(settings.run_file_current).X)) || run_event_end - run_event_done >= EVENT_QUEUE_LENGTH)
+					break;
+				run_events[run_event_end % EVENT_QUEUE_LENGTH] = settings.run_file_current;
+				run_event_end += 1;
+				if (settings.queue_end != settings.queue_start || settings.queue_full)
+					queue[(settings.queue_end + QUEUE_LENGTH - 1) % QUEUE_LENGTH].event_end = run_event_end;
+				else if (computing_move)
+					event_after_current_move = run_event_end;
+				else
+					run_events_attach(run_event_end);
+				settings.run_file_current += 1;
+				continue;
+			}
+			Run_Record const &r = run_record(settings.run_file_current);
+			rundebug("running %ld: %d %d", long(settings.run_file_current), r.type, r.tool);
 			switch (r.type) {
 				case RUN_SYSTEM:
-				{
-					char const *cmd = strndupa(&reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], strings[r.tool].len);
-					debug("Running system command: %ld %d %s", strings[r.tool].start, strings[r.tool].len, cmd);
-					int ret = system(cmd);
-					debug("Done running system command, return = %d", ret);
+				case RUN_GPIO:
+				case RUN_SETTEMP:
+					run_event(r);
 					break;
-				}
 				case RUN_PRE_ARC:
 				{
 					double x = r.X * run_file_cosa - r.Y * run_file_sina + run_file_refx;
@@ -338,42 +941,10 @@ void run_file_fill_queue() {
 					queue[settings.queue_end].time = r.time;
 					queue[settings.queue_end].dist = r.dist;
 					queue[settings.queue_end].cb = false;
+					queue[settings.queue_end].event_end = 0;
 					settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
 					break;
 				}
-				case RUN_GPIO:
-				{
-					int tool = r.tool;
-					if (tool == -2)
-						tool = fan_id != 255 ? fan_id : -1;
-					else if (tool == -3)
-						tool = spindle_id != 255 ? spindle_id : -1;
-					if (tool < 0 || tool >= num_gpios) {
-						if (tool != -1)
-							debug("cannot set invalid gpio %d", tool);
-						break;
-					}
-					if (r.X) {
-						gpios[tool].state = 1;
-						SET(gpios[tool].pin);
-					}
-					else {
-						gpios[tool].state = 0;
-						RESET(gpios[tool].pin);
-					}
-					send_host(CMD_UPDATE_PIN, tool, gpios[tool].state);
-					break;
-				}
-				case RUN_SETTEMP:
-				{
-					int tool = r.tool;
-					if (tool == -1)
-						tool = bed_id != 255 ? bed_id : -1;
-					rundebug("settemp %d %f", tool, r.X);
-					settemp(tool, r.X);
-					send_host(CMD_UPDATE_TEMP, tool, 0, r.X);
-					break;
-				}
 				case RUN_WAITTEMP:
 				{
 					int tool = r.tool;
@@ -421,8 +992,7 @@ void run_file_fill_queue() {
 					break;
 				case RUN_CONFIRM:
 				{
-					int len = min(strings[r.tool].len, 250);
-					memcpy(datastore, &reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], len);
+					int len = min(run_string(r.tool, datastore, 250), 250);
 					run_file_wait += 1;
 					send_host(CMD_CONFIRM, r.X ? 1 : 0, 0, 0, 0, len);
 					break;
@@ -444,20 +1014,27 @@ void run_file_fill_queue() {
 				cbs += next_move();
 		}
 	}
+	if (run_file_map && run_file_growing && settings.run_file_current >= run_file_num_records && !run_file_caught_up) {
+		// Everything that was written has been run; wait for the writer.
+		run_file_caught_up = true;
+		run_file_wait += 1;
+	}
 	if (cbs > 0)
 		send_host(CMD_MOVECB, cbs);
 	buffer_refill();
 	rundebug("run queue done");
-	if (run_file_map && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_finishing) {
+	if (run_file_map && !run_file_growing && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_finishing) {
 		// Done.
 		//debug("done running file");
-		if (!computing_move && !sending_fragment && !arch_running()) {
+		if (!computing_move && !sending_fragment && !planner_pending() && !arch_running()) {
 			send_host(CMD_FILE_DONE);
 			abort_run_file();
 		}
 		else
 			run_file_finishing = true;
 	}
+	if (run_file_map)
+		run_file_advise();
 	lock = false;
 	return;
 }
@@ -468,20 +1045,175 @@ void run_adjust_probe(double x, double y, double z) {
 	probe_adjust = z - probe_z;
 }
 
-double run_find_pos(double pos[3]) {
-	// Find position in toolpath that is closest to requested position.
-	if (!run_file_map)
-		return NAN;
-	double dist = INFINITY;
-	double current[3] = {NAN, NAN, NAN};
-	double center[3];
-	double normal[3];
-	double record;
-	// These are not used yet.
-	(void)&center;
-	(void)&normal;
-	for (int i = 0; i < run_file_num_records; ++i) {
-		switch (run_file_map[i].type) {
+// Geometry of an arc from the run file, computed like set_from_queue() does for the motion.
+struct Run_Arc {
+	double center[3];	// Center, moved to the plane of the source.
+	double e1[3], e2[3], normal[3];
+	double radius[2];	// At source and target.
+	double angle, helix;
+};
+
+static bool run_arc_setup(Run_Arc &arc, double const source[3], double const center[3], double const normal[3], double const target[3]) { // {{{
+	double n = 0;
+	for (int i = 0; i < 3; ++i) {
+		if (isnan(source[i]) || isnan(center[i]) || isnan(normal[i]) || isnan(target[i]))
+			return false;
+		n += normal[i] * normal[i];
+	}
+	n = sqrt(n);
+	if (!(n > 0))
+		return false;
+	double sn = 0, cn = 0, tn = 0;
+	for (int i = 0; i < 3; ++i) {
+		arc.normal[i] = normal[i] / n;
+		sn += source[i] * arc.normal[i];
+		cn += center[i] * arc.normal[i];
+		tn += target[i] * arc.normal[i];
+	}
+	arc.helix = tn - sn;
+	double t[3];
+	double src = 0, dst = 0;
+	for (int i = 0; i < 3; ++i) {
+		arc.center[i] = center[i] - arc.normal[i] * (cn - sn);
+		t[i] = target[i] - arc.normal[i] * arc.helix;
+		arc.e1[i] = source[i] - arc.center[i];
+		src += arc.e1[i] * arc.e1[i];
+		dst += (t[i] - arc.center[i]) * (t[i] - arc.center[i]);
+	}
+	src = sqrt(src);
+	dst = sqrt(dst);
+	if (!(src > 0) || !(dst > 0))
+		return false;
+	for (int i = 0; i < 3; ++i)
+		arc.e1[i] /= src;
+	double cosa = 0, sina = 0;
+	for (int i = 0; i < 3; ++i) {
+		int c1 = (i + 1) % 3;
+		int c2 = (i + 2) % 3;
+		arc.e2[i] = arc.normal[c1] * arc.e1[c2] - arc.normal[c2] * arc.e1[c1];
+		cosa += arc.e1[i] * (t[i] - arc.center[i]) / dst;
+		sina += arc.e2[i] * (t[i] - arc.center[i]) / dst;
+	}
+	arc.angle = atan2(sina, cosa);
+	if (arc.angle <= 0)
+		arc.angle += 2 * M_PI;
+	arc.radius[0] = src;
+	arc.radius[1] = dst;
+	return true;
+} // }}}
+
+static double run_arc_dist(Run_Arc const &arc, double const pos[3], double u) { // {{{
+	// Squared distance from pos to the point at angle fraction u, using only the coordinates of pos that are not NaN.
+	double angle = arc.angle * u;
+	double radius = arc.radius[0] + (arc.radius[1] - arc.radius[0]) * u;
+	double cosa = cos(angle);
+	double sina = sin(angle);
+	double ret = 0;
+	for (int i = 0; i < 3; ++i) {
+		if (isnan(pos[i]))
+			continue;
+		double d = pos[i] - (arc.center[i] + radius * (cosa * arc.e1[i] + sina * arc.e2[i]) + arc.helix * u * arc.normal[i]);
+		ret += d * d;
+	}
+	return ret;
+} // }}}
+
+static void run_arc_box(Run_Arc const &arc, double lo[3], double hi[3]) { // {{{
+	// Compute a box around the arc: the full circle at the largest radius, stretched along the helix.
+	double radius = fmax(arc.radius[0], arc.radius[1]);
+	for (int k = 0; k < 3; ++k) {
+		double w = radius * sqrt(arc.e1[k] * arc.e1[k] + arc.e2[k] * arc.e2[k]);
+		double h = arc.helix * arc.normal[k];
+		lo[k] = arc.center[k] - w + fmin(h, 0);
+		hi[k] = arc.center[k] + w + fmax(h, 0);
+	}
+} // }}}
+
+static double run_arc_find(Run_Arc const &arc, double const pos[3], double limit, double &fraction) { // {{{
+	// Find the point on the arc that is closest to pos; return its squared distance.
+	// If the arc is certainly farther away than limit, return INFINITY and set fraction to 0.
+	double box_lo[3], box_hi[3];
+	run_arc_box(arc, box_lo, box_hi);
+	double bound = 0;
+	for (int k = 0; k < 3; ++k) {
+		if (isnan(pos[k]))
+			continue;
+		double d = pos[k] < box_lo[k] ? box_lo[k] - pos[k] : pos[k] > box_hi[k] ? pos[k] - box_hi[k] : 0;
+		bound += d * d;
+	}
+	if (bound * (1 - 1e-9) > limit) {
+		fraction = 0;
+		return INFINITY;
+	}
+	// Samples at most 22.5° apart find the closest point to within one sample;
+	// a golden section search between its neighbours finds it exactly.
+	int num = int(arc.angle / (M_PI / 8)) + 2;
+	int best = 0;
+	double best_d = INFINITY;
+	for (int j = 0; j < num; ++j) {
+		double d = run_arc_dist(arc, pos, double(j) / (num - 1));
+		if (d < best_d) {
+			best_d = d;
+			best = j;
+		}
+	}
+	double best_u = double(best) / (num - 1);
+	double lo = double(max(best - 1, 0)) / (num - 1);
+	double hi = double(min(best + 1, num - 1)) / (num - 1);
+	double g = (sqrt(5.) - 1) / 2;
+	double a = hi - g * (hi - lo);
+	double b = lo + g * (hi - lo);
+	double da = run_arc_dist(arc, pos, a);
+	double db = run_arc_dist(arc, pos, b);
+	for (int i = 0; i < 50; ++i) {
+		if (da < db) {
+			hi = b;
+			b = a;
+			db = da;
+			a = hi - g * (hi - lo);
+			da = run_arc_dist(arc, pos, a);
+		}
+		else {
+			lo = a;
+			a = b;
+			da = db;
+			b = lo + g * (hi - lo);
+			db = run_arc_dist(arc, pos, b);
+		}
+	}
+	if (da < best_d) {
+		best_d = da;
+		best_u = a;
+	}
+	if (db < best_d) {
+		best_d = db;
+		best_u = b;
+	}
+	// Convert angle fraction into time fraction; this is the inverse of what move.cpp does.
+	fraction = best_u * (arc.radius[0] + arc.radius[1]) / (2 * arc.radius[0] + best_u * (arc.radius[1] - arc.radius[0]));
+	return best_d;
+} // }}}
+
+static void run_find_scan(double const pos[3], off_t first, off_t end, double current[3], double &dist, double &record) { // {{{
+	// Find the closest point to pos in records [first, end) and update dist and record if it is closer than dist.
+	// current is the position at the start of first.
+	double center[3] = {NAN, NAN, NAN};
+	double normal[3] = {NAN, NAN, NAN};
+	if (first > 0 && first < end) {
+		// An arc at the start needs the record before it.
+		Run_Record const &pre = run_record(first - 1);
+		if (pre.type == RUN_PRE_ARC) {
+			center[0] = pre.X;
+			center[1] = pre.Y;
+			center[2] = pre.Z;
+			normal[0] = pre.E;
+			normal[1] = pre.f;
+			normal[2] = pre.F;
+		}
+	}
+	for (off_t i = first; i < end; ++i) {
+		Run_Record const &r = run_record(i);
+		switch (r.type) {
 			case RUN_SYSTEM:
 			case RUN_PRE_LINE:
 			case RUN_GPIO:
@@ -491,19 +1223,19 @@ double run_find_pos(double pos[3]) {
 			case RUN_WAIT:
 			case RUN_CONFIRM:
 			case RUN_PARK:
+			case RUN_STREAM:
 				continue;
 			case RUN_PRE_ARC:
-				center[0] = run_file_map[i].X;
-				center[1] = run_file_map[i].Y;
-				center[2] = run_file_map[i].Z;
-				normal[0] = run_file_map[i].E;
-				normal[1] = run_file_map[i].f;
-				normal[2] = run_file_map[i].F;
+				center[0] = r.X;
+				center[1] = r.Y;
+				center[2] = r.Z;
+				normal[0] = r.E;
+				normal[1] = r.f;
+				normal[2] = r.F;
 				continue;
 			case RUN_ARC:
-				// TODO: handle arc; workaround: fall through, handle as line.
 			case RUN_LINE:
-				double target[3] = {run_file_map[i].X, run_file_map[i].Y, run_file_map[i].Z};
+				double target[3] = {r.X, r.Y, r.Z};
 				int k;
 				double pt = 0, tt = 0;
 				for (k = 0; k < 3; ++k) {
@@ -523,19 +1255,30 @@ double run_find_pos(double pos[3]) {
 					// Target position was NaN, pos was not.
 					continue;
 				}
-				double fraction = pt / tt;
-				if (fraction < 0)
-					fraction = 0;
-				if (fraction > 1)
-					fraction = 1;
-				double d = 0;
-				for (k = 0; k < 3; ++k) {
-					if (isnan(pos[k]))
-						continue;
-					double dd = pos[k] - ((target[k] - current[k]) * fraction + current[k]);
-					d += dd * dd;
+				double fraction, d;
+				Run_Arc arc;
+				double full[3];
+				for (k = 0; k < 3; ++k)
+					full[k] = isnan(target[k]) ? current[k] : target[k];
+				if (r.type == RUN_ARC && run_arc_setup(arc, current, center, normal, full))
+					d = run_arc_find(arc, pos, dist, fraction);
+				else {
+					// Without a complete arc, it is handled as a line.
+					fraction = pt / tt;
+					if (fraction < 0)
+						fraction = 0;
+					if (fraction > 1)
+						fraction = 1;
+					d = 0;
+					for (k = 0; k < 3; ++k) {
+						if (isnan(pos[k]))
+							continue;
+						double dd = pos[k] - ((target[k] - current[k]) * fraction + current[k]);
+						d += dd * dd;
+					}
 				}
-				if (d < dist) {
+				// On equal distance, the earliest record wins, like it would in a linear scan.
+				if (d < dist || (d == dist && i + fraction < record)) {
 					dist = d;
 					record = i + fraction;
 				}
@@ -545,5 +1288,353 @@ double run_find_pos(double pos[3]) {
 				}
 		}
 	}
+} // }}}
+
+// Index for run_find_pos, built when it is first needed and stored next to
+// the run file, with ".idx" appended to its name.  While the position at
+// the start of the file is unknown, which coordinates are used depends on
+// the request; those records (the prefix) are always scanned.  The rest is
+// split in chunks of RUN_INDEX_CHUNK records.  The index has the position
+// at the start of each chunk and a tree of bounding boxes: the boxes of
+// the chunks, then per level the boxes of RUN_INDEX_FANOUT nodes from the
+// level below, up to the root.  A search only scans the chunks which may
+// contain something closer than the best match so far.
+// File format:
+// Run_Index_Header
+// double start[num_chunks][3]
+// Run_Index_Box nodes[num_nodes]: all levels, starting with the chunks
+#define RUN_INDEX_VERSION 3
+#define RUN_INDEX_CHUNK 64
+#define RUN_INDEX_FANOUT 8
+#define RUN_INDEX_MAX_LEVELS 32
+struct Run_Index_Header {
+	uint8_t magic[4];	// 'F' 'R' 'I' 0
+	uint32_t version;
+	int64_t file_size;	// Size and modification time of the run file, in ns; the index is rebuilt if they change.
+	int64_t file_mtime;
+	int64_t num_records;
+	int64_t prefix;
+	int32_t num_chunks;
+	int32_t num_nodes;
+} __attribute__((__packed__));
+// The header is a multiple of 8 bytes long, so the doubles after it are aligned.
+static_assert(sizeof(Run_Index_Header) % sizeof(double) == 0, "index data must be aligned");
+struct Run_Index_Box {
+	double min[3], max[3];
+};
+static_assert(sizeof(Run_Index_Box) == 6 * sizeof(double), "index boxes must not have padding");
+
+static double (*run_index_start)[3];
+static Run_Index_Box *run_index_nodes;
+static int run_index_levels;
+static int run_index_level_start[RUN_INDEX_MAX_LEVELS];
+static int run_index_level_size[RUN_INDEX_MAX_LEVELS];
+
+static int run_index_setup_levels(int num_chunks) { // {{{
+	// Compute the layout of the tree; return the total number of nodes.
+	int total = 0;
+	int size = num_chunks;
+	run_index_levels = 0;
+	while (size > 0 && run_index_levels < RUN_INDEX_MAX_LEVELS) {
+		run_index_level_start[run_index_levels] = total;
+		run_index_level_size[run_index_levels] = size;
+		run_index_levels += 1;
+		total += size;
+		if (size == 1)
+			break;
+		size = (size + RUN_INDEX_FANOUT - 1) / RUN_INDEX_FANOUT;
+	}
+	return total;
+} // }}}
+
+static void run_index_use(Run_Index_Header *index) { // {{{
+	run_index = index;
+	run_index_start = reinterpret_cast<double (*)[3]>(&index[1]);
+	run_index_nodes = reinterpret_cast<Run_Index_Box *>(&run_index_start[index->num_chunks]);
+} // }}}
+
+static void run_index_add(Run_Index_Box &box, double const p[3]) { // {{{
+	for (int k = 0; k < 3; ++k) {
+		box.min[k] = fmin(box.min[k], p[k]);
+		box.max[k] = fmax(box.max[k], p[k]);
+	}
+} // }}}
+
+static bool run_index_build(struct stat const &stat) { // {{{
+	// Find the end of the prefix: the first record after which the
+	// position is the same for every combination of requested coordinates.
+	double state[8][3];
+	for (int s = 1; s < 8; ++s) {
+		for (int k = 0; k < 3; ++k)
+			state[s][k] = NAN;
+	}
+	off_t prefix = run_file_num_records;
+	for (off_t i = 0; i < run_file_num_records; ++i) {
+		Run_Record const &r = run_record(i);
+		if (r.type != RUN_LINE && r.type != RUN_ARC)
+			continue;
+		double target[3] = {r.X, r.Y, r.Z};
+		bool same = true;
+		for (int s = 1; s < 8; ++s) {
+			int k;
+			// run_find_scan skips a record if a requested coordinate is unknown.
+			for (k = 0; k < 3; ++k) {
+				if ((s & (1 << k)) && isnan(target[k]) && isnan(state[s][k]))
+					break;
+			}
+			if (k == 3) {
+				for (k = 0; k < 3; ++k) {
+					if (!isnan(target[k]))
+						state[s][k] = target[k];
+				}
+			}
+			for (k = 0; k < 3; ++k) {
+				if (isnan(state[s][k]) || state[s][k] != state[1][k])
+					same = false;
+			}
+		}
+		if (same) {
+			prefix = i + 1;
+			break;
+		}
+	}
+	int num_chunks = (run_file_num_records - prefix + RUN_INDEX_CHUNK - 1) / RUN_INDEX_CHUNK;
+	int num_nodes = run_index_setup_levels(num_chunks);
+	Run_Index_Header *index = reinterpret_cast<Run_Index_Header *>(malloc(sizeof(Run_Index_Header) + num_chunks * sizeof(double[3]) + num_nodes * sizeof(Run_Index_Box)));
+	if (!index) {
+		debug("Unable to allocate run file index");
+		return false;
+	}
+	index->magic[0] = 'F';
+	index->magic[1] = 'R';
+	index->magic[2] = 'I';
+	index->magic[3] = 0;
+	index->version = RUN_INDEX_VERSION;
+	index->file_size = stat.st_size;
+	index->file_mtime = int64_t(stat.st_mtim.tv_sec) * 1000000000 + stat.st_mtim.tv_nsec;
+	index->num_records = run_file_num_records;
+	index->prefix = prefix;
+	index->num_chunks = num_chunks;
+	index->num_nodes = num_nodes;
+	run_index_use(index);
+	double current[3] = {state[1][0], state[1][1], state[1][2]};
+	for (int c = 0; c < num_chunks; ++c) {
+		Run_Index_Box &box = run_index_nodes[c];
+		for (int k = 0; k < 3; ++k) {
+			run_index_start[c][k] = current[k];
+			box.min[k] = INFINITY;
+			box.max[k] = -INFINITY;
+		}
+		off_t first = prefix + off_t(c) * RUN_INDEX_CHUNK;
+		off_t end = first + RUN_INDEX_CHUNK < run_file_num_records ? first + RUN_INDEX_CHUNK : run_file_num_records;
+		double center[3] = {NAN, NAN, NAN};
+		double normal[3] = {NAN, NAN, NAN};
+		for (off_t i = first > 0 ? first - 1 : 0; i < end; ++i) {
+			Run_Record const &r = run_record(i);
+			if (r.type == RUN_PRE_ARC) {
+				center[0] = r.X;
+				center[1] = r.Y;
+				center[2] = r.Z;
+				normal[0] = r.E;
+				normal[1] = r.f;
+				normal[2] = r.F;
+				continue;
+			}
+			// The record before the chunk is only used for the center and normal.
+			if (i < first || (r.type != RUN_LINE && r.type != RUN_ARC))
+				continue;
+			double source[3] = {current[0], current[1], current[2]};
+			run_index_add(box, current);
+			if (!isnan(r.X))
+				current[0] = r.X;
+			if (!isnan(r.Y))
+				current[1] = r.Y;
+			if (!isnan(r.Z))
+				current[2] = r.Z;
+			run_index_add(box, current);
+			Run_Arc arc;
+			if (r.type == RUN_ARC && run_arc_setup(arc, source, center, normal, current)) {
+				double lo[3], hi[3];
+				run_arc_box(arc, lo, hi);
+				run_index_add(box, lo);
+				run_index_add(box, hi);
+			}
+		}
+	}
+	for (int l = 1; l < run_index_levels; ++l) {
+		for (int n = 0; n < run_index_level_size[l]; ++n) {
+			Run_Index_Box &box = run_index_nodes[run_index_level_start[l] + n];
+			for (int k = 0; k < 3; ++k) {
+				box.min[k] = INFINITY;
+				box.max[k] = -INFINITY;
+			}
+			int end = min((n + 1) * RUN_INDEX_FANOUT, run_index_level_size[l - 1]);
+			for (int child = n * RUN_INDEX_FANOUT; child < end; ++child) {
+				Run_Index_Box const &c = run_index_nodes[run_index_level_start[l - 1] + child];
+				run_index_add(box, c.min);
+				run_index_add(box, c.max);
+			}
+		}
+	}
+	return true;
+} // }}}
+
+static bool run_index_read(char const *name, struct stat const &stat) { // {{{
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat index_stat;
+	Run_Index_Header header;
+	if (fstat(fd, &index_stat) < 0 || read(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return false;
+	}
+	if (header.magic[0] != 'F' || header.magic[1] != 'R' || header.magic[2] != 'I' || header.magic[3] != 0 || header.version != RUN_INDEX_VERSION || header.file_size != stat.st_size || header.file_mtime != int64_t(stat.st_mtim.tv_sec) * 1000000000 + stat.st_mtim.tv_nsec || header.num_records != run_file_num_records || header.prefix < 0 || header.prefix > run_file_num_records || header.num_chunks != (run_file_num_records - header.prefix + RUN_INDEX_CHUNK - 1) / RUN_INDEX_CHUNK || header.num_nodes != run_index_setup_levels(header.num_chunks)) {
+		debug("Run file index %s is out of date", name);
+		close(fd);
+		return false;
+	}
+	off_t size = sizeof(Run_Index_Header) + header.num_chunks * sizeof(double[3]) + header.num_nodes * sizeof(Run_Index_Box);
+	if (index_stat.st_size != size) {
+		debug("Run file index %s has an invalid size", name);
+		close(fd);
+		return false;
+	}
+	Run_Index_Header *index = reinterpret_cast<Run_Index_Header *>(malloc(size));
+	if (!index) {
+		close(fd);
+		return false;
+	}
+	*index = header;
+	char *data = reinterpret_cast<char *>(&index[1]);
+	off_t todo = size - sizeof(header);
+	while (todo > 0) {
+		ssize_t ret = read(fd, data, todo);
+		if (ret <= 0) {
+			debug("Failed to read run file index %s", name);
+			free(index);
+			close(fd);
+			return false;
+		}
+		data += ret;
+		todo -= ret;
+	}
+	close(fd);
+	run_index_use(index);
+	return true;
+} // }}}
+
+static void run_index_write(char const *name) { // {{{
+	// Failing to store the index is not a problem; it is built again next time.
+	char tmpname[sizeof(run_file_name) + 8];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+	int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		debug("Failed to store run file index %s: %s", name, strerror(errno));
+		return;
+	}
+	char const *data = reinterpret_cast<char const *>(run_index);
+	off_t todo = sizeof(Run_Index_Header) + run_index->num_chunks * sizeof(double[3]) + run_index->num_nodes * sizeof(Run_Index_Box);
+	while (todo > 0) {
+		ssize_t ret = write(fd, data, todo);
+		if (ret <= 0) {
+			debug("Failed to store run file index %s: %s", name, strerror(errno));
+			close(fd);
+			unlink(tmpname);
+			return;
+		}
+		data += ret;
+		todo -= ret;
+	}
+	close(fd);
+	if (rename(tmpname, name) < 0) {
+		debug("Failed to store run file index %s: %s", name, strerror(errno));
+		unlink(tmpname);
+	}
+} // }}}
+
+static bool run_index_load() { // {{{
+	if (run_index)
+		return true;
+	if (run_file_audio >= 0 || run_file_growing)
+		return false;
+	struct stat stat;
+	if (::stat(run_file_name, &stat) < 0)
+		return false;
+	char name[sizeof(run_file_name) + 4];
+	snprintf(name, sizeof(name), "%s.idx", run_file_name);
+	if (run_index_read(name, stat))
+		return true;
+	if (!run_index_build(stat))
+		return false;
+	run_index_write(name);
+	return true;
+} // }}}
+
+static double run_index_bound(Run_Index_Box const &box, double const pos[3]) { // {{{
+	// Lower bound for the squared distance of pos to anything in box.
+	double ret = 0;
+	for (int k = 0; k < 3; ++k) {
+		if (isnan(pos[k]))
+			continue;
+		if (box.min[k] > box.max[k])
+			return INFINITY;	// Empty box.
+		double d;
+		if (pos[k] < box.min[k])
+			d = box.min[k] - pos[k];
+		else if (pos[k] > box.max[k])
+			d = pos[k] - box.max[k];
+		else
+			continue;
+		ret += d * d;
+	}
+	return ret;
+} // }}}
+
+static void run_index_search(int level, int node, double const pos[3], double &dist, double &record) { // {{{
+	if (level == 0) {
+		double current[3] = {run_index_start[node][0], run_index_start[node][1], run_index_start[node][2]};
+		off_t first = run_index->prefix + off_t(node) * RUN_INDEX_CHUNK;
+		run_find_scan(pos, first, first + RUN_INDEX_CHUNK < run_file_num_records ? first + RUN_INDEX_CHUNK : run_file_num_records, current, dist, record);
+		return;
+	}
+	// Visit the children nearest first, so more of them can be skipped.
+	int child[RUN_INDEX_FANOUT];
+	double bound[RUN_INDEX_FANOUT];
+	int num = 0;
+	int end = min((node + 1) * RUN_INDEX_FANOUT, run_index_level_size[level - 1]);
+	for (int c = node * RUN_INDEX_FANOUT; c < end; ++c) {
+		double b = run_index_bound(run_index_nodes[run_index_level_start[level - 1] + c], pos);
+		int i;
+		for (i = num; i > 0 && bound[i - 1] > b; --i) {
+			child[i] = child[i - 1];
+			bound[i] = bound[i - 1];
+		}
+		child[i] = c;
+		bound[i] = b;
+		num += 1;
+	}
+	for (int i = 0; i < num; ++i) {
+		// Allow for rounding in the distance computation.
+		if (bound[i] * (1 - 1e-9) > dist)
+			break;
+		run_index_search(level - 1, child[i], pos, dist, record);
+	}
+} // }}}
+
+double run_find_pos(double pos[3]) {
+	// Find position in toolpath that is closest to requested position.
+	if (!run_file_map)
+		return NAN;
+	double dist = INFINITY;
+	double current[3] = {NAN, NAN, NAN};
+	double record = NAN;
+	if (!run_index_load()) {
+		run_find_scan(pos, 0, run_file_num_records, current, dist, record);
+		return record;
+	}
+	run_find_scan(pos, 0, run_index->prefix, current, dist, record);
+	if (run_index_levels > 0)
+		run_index_search(run_index_levels - 1, 0, pos, dist, record);
 	return record;
 }
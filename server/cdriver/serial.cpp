@@ -41,18 +41,26 @@
 // These are defined in cdriver.h.
 // }}}
 
+// Messages for the host wait in a queue until the previous one is acknowledged.
+// The records come from a pool which grows in blocks and is never freed.
+#define HOSTQUEUE_BLOCK 32
+#define HOSTQUEUE_DATA 32	// Messages with more data than this allocate it separately.
+
 struct Queuerecord { // {{{
 	Queuerecord *next;
 	unsigned len;
 	char cmd;
 	int32_t s, m, e;
 	double f;
+	char *data;	// Points at inline_data, unless len is larger than HOSTQUEUE_DATA.
+	char inline_data[HOSTQUEUE_DATA];
 }; // }}}
 
 // Globals. {{{
 static bool sending_to_host = false;
 static Queuerecord *hostqueue_head = NULL;
 static Queuerecord *hostqueue_tail = NULL;
+static Queuerecord *hostqueue_free = NULL;
 #ifdef SERIAL
 static bool had_data = false;
 static bool doing_debug = false;
@@ -75,6 +83,39 @@ const SingleByteCommands cmd_nack[4] = { CMD_NACK0, CMD_NACK1, CMD_NACK2, CMD_NA
 const SingleByteCommands cmd_stall[4] = { CMD_STALL0, CMD_STALL1, CMD_STALL2, CMD_STALL3 };
 // }}}
 
+static Queuerecord *new_record(unsigned len) { // {{{
+	if (!hostqueue_free) {
+		Queuerecord *block = reinterpret_cast <Queuerecord *>(malloc(HOSTQUEUE_BLOCK * sizeof(Queuerecord)));
+		if (!block) {
+			debug("out of memory for host queue");
+			abort();
+		}
+		for (int i = 0; i < HOSTQUEUE_BLOCK; ++i) {
+			block[i].next = hostqueue_free;
+			hostqueue_free = &block[i];
+		}
+	}
+	Queuerecord *record = hostqueue_free;
+	hostqueue_free = record->next;
+	if (len > HOSTQUEUE_DATA) {
+		record->data = reinterpret_cast <char *>(malloc(len));
+		if (!record->data) {
+			debug("out of memory for host message");
+			abort();
+		}
+	}
+	else
+		record->data = record->inline_data;
+	return record;
+} // }}}
+
+static void free_record(Queuerecord *record) { // {{{
+	if (record->data != record->inline_data)
+		free(record->data);
+	record->next = hostqueue_free;
+	hostqueue_free = record;
+} // }}}
+
 static void send_to_host() { // {{{
 	sending_to_host = true;
 	//debug("sending");
@@ -89,7 +130,7 @@ static void send_to_host() { // {{{
 	{
 		debug("**** host send cmd %02x s %08x m %08x e %08x f %f data len %d", r->cmd, r->s, r->m, r->e, r->f, r->len);
 		for (uint8_t i = 0; i < r->len; ++i)
-			fprintf(stderr, " %02x", reinterpret_cast <unsigned char *>(r)[sizeof(Queuerecord) + i]);
+			fprintf(stderr, " %02x", uint8_t(r->data[i]));
 		fprintf(stderr, "\n");
 	}
 #endif
@@ -104,10 +145,12 @@ static void send_to_host() { // {{{
 	for (unsigned i = 0; i < sizeof(double); ++i)
 		serialdev[0]->write(reinterpret_cast <char *>(&r->f)[i]);
 	for (unsigned i = 0; i < r->len; ++i)
-		serialdev[0]->write(reinterpret_cast <char *>(r)[sizeof(Queuerecord) + i]);
-	if (r->cmd == CMD_LIMIT)
+		serialdev[0]->write(r->data[i]);
+	if (r->cmd == CMD_LIMIT) {
+		planner_stop();
 		stopping = 1;
-	free(r);
+	}
+	free_record(r);
 } // }}}
 
 #ifdef SERIAL
@@ -127,14 +170,86 @@ static void resend(int amount) { // {{{
 	// Unless the last packet was already received; in that case ignore the NACK.
 	//debug("nack%d ff %d busy %d", which, ff_out, out_busy);
 	if (out_busy >= amount) {
-		ff_out = (ff_out - amount) & 3;
+		ff_out = (ff_out - amount) & link_mask;
 		out_busy -= amount;
 		while (amount--) {
-			ff_out = (ff_out + 1) & 3;
+			ff_out = (ff_out + 1) & link_mask;
 			send_packet();
 		}
 	}
 } // }}}
+
+static void acked(int amount) { // {{{
+	// The oldest amount packets have been accepted by the firmware.
+	while (amount-- > 0) {
+		out_busy -= 1;
+		void (*cb)() = serial_cb[0];
+		for (int i = 0; i < out_busy; ++i)
+			serial_cb[i] = serial_cb[i + 1];
+		serial_cb[out_busy] = NULL;
+		if (cb)
+			cb();
+	}
+} // }}}
+
+static void had_ack() { // {{{
+	// There may be room for new packets; send what is waiting.
+	if (out_busy < link_window && change_pending)
+		arch_motors_change();
+	if (out_busy < link_window && start_pending) {
+		arch_start_move(0);
+	}
+	if (out_busy < link_window && stop_pending) {
+		//debug("do pending stop");
+		arch_stop();
+	}
+	if (out_busy < link_window && discard_pending)
+		arch_do_discard();
+	if (!sending_fragment && !stopping && arch_running()) {
+		run_file_fill_queue();
+		buffer_refill();
+	}
+	if (!preparing)
+		arch_had_ack();
+} // }}}
+
+static void link_packet() { // {{{
+	// Sliding window status from the firmware.  Serials are 8 bit; the
+	// oldest packet in flight has serial ff_out - out_busy.
+	uint8_t which = command[1][1];
+	switch (command[1][2]) {
+	case LINK_STALL:
+		debug("received stall!");
+		ff_out = which;
+		out_busy = 0;
+		serialdev[1]->write(CMD_STALLACK);
+		serialdev[1]->flush();
+		break;
+	case LINK_ACK:
+	{
+		// Cumulative: everything up to and including which was accepted.
+		int amount = uint8_t(which - (ff_out - out_busy)) + 1;
+		if (amount <= out_busy)
+			acked(amount);
+		break;
+	}
+	case LINK_NACK:
+	{
+		// Everything before which was accepted; resend only what follows.
+		int amount = uint8_t(ff_out - which);
+		if (amount <= out_busy) {
+			int done = out_busy - amount;
+			resend(amount);
+			acked(done);
+		}
+		break;
+	}
+	default:
+		debug("invalid link packet type %d", command[1][2]);
+		return;
+	}
+	had_ack();
+} // }}}
 #endif
 
 // There may be serial data available.
@@ -225,6 +340,7 @@ bool serial(uint8_t channel) { // {{{
 					ff_out = which;
 					out_busy = 0;
 					serialdev[1]->write(CMD_STALLACK);
+					serialdev[1]->flush();
 					which += 1;
 					// Fall through.
 				case CMD_ACK3:
@@ -237,32 +353,9 @@ bool serial(uint8_t channel) { // {{{
 					//debug("ack%d ff %d busy %d", which, ff_out, out_busy);
 					which &= 3;
 					// Ack: flip the flipflop.
-					if (out_busy > 0 && ((ff_out - out_busy) & 3) == which) { // Only if we expected it and it is the right type.
-						out_busy -= 1;
-						void (*cb)() = serial_cb[0];
-						for (int i = 0; i < out_busy; ++i)
-							serial_cb[i] = serial_cb[i + 1];
-						serial_cb[out_busy] = NULL;
-						if (cb)
-							cb();
-					}
-					if (out_busy < 3 && change_pending)
-						arch_motors_change();
-					if (out_busy < 3 && start_pending) {
-						arch_start_move(0);
-					}
-					if (out_busy < 3 && stop_pending) {
-						//debug("do pending stop");
-						arch_stop();
-					}
-					if (out_busy < 3 && discard_pending)
-						arch_do_discard();
-					if (!sending_fragment && !stopping && arch_running()) {
-						run_file_fill_queue();
-						buffer_refill();
-					}
-					if (!preparing)
-						arch_had_ack();
+					if (out_busy > 0 && ((ff_out - out_busy) & 3) == which) // Only if we expected it and it is the right type.
+						acked(1);
+					had_ack();
 					continue;
 				case CMD_NACK3:
 					which += 1;
@@ -312,6 +405,7 @@ bool serial(uint8_t channel) { // {{{
 						//debug("received OK; sending next to host (if any)");
 						if (stopping == 1) {
 							//debug("done stopping");
+							planner_stop();
 							stopping = 0;
 							sending_fragment = 0;
 						}
@@ -482,6 +576,12 @@ bool serial(uint8_t channel) { // {{{
 			}
 			// Packet is good.
 			//debug("%d good", channel);
+			if ((command[channel][0] & 0x1f) == HWC_LINK) {
+				// Sliding window status has no serial and is not acked.
+				command_end[channel] = 0;
+				link_packet();
+				continue;
+			}
 			// Flip-flop must have good state.
 			int which = (command[channel][0] >> 5) & 3;
 			if (which != ff_in)
@@ -502,6 +602,8 @@ bool serial(uint8_t channel) { // {{{
 			// Clear flag for easier parsing.
 			command[channel][0] &= 0x1f;
 			command_end[channel] = 0;
+			// Firmware packets move running_fragment and may rewind the planner.
+			planner_stop();
 			if (hwpacket(cmd_len)) {
 				void (*cb)() = wait_for_reply[0];
 				expected_replies -= 1;
@@ -524,6 +626,9 @@ bool serial(uint8_t channel) { // {{{
 } // }}}
 
 #ifdef SERIAL
+// Slot in pending_packet for serial n.
+#define PENDING(n) ((n) & link_mask & (LINK_WINDOW_MAX - 1))
+
 // Command sending method:
 // When sending a command:
 // - fill appropriate command buffer
@@ -539,7 +644,9 @@ bool serial(uint8_t channel) { // {{{
 // Set checksum bytes.
 bool prepare_packet(char *the_packet, int size) { // {{{
 	//debug("prepare %d %d %d", size, ff_out, out_busy);
-	if (size >= COMMAND_SIZE)
+	// With the sliding window, the full serial is sent as an extra last byte.
+	int serial_size = link_mask == 3 ? 0 : 1;
+	if (size + serial_size >= COMMAND_SIZE)
 	{
 		debug("packet is too large: %d > %d", size, COMMAND_SIZE);
 		return false;
@@ -550,8 +657,8 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 	}
 	// Wait for room in the queue.  This is required to avoid a stall being received in between prepare and send.
 	preparing = true;
-	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+	while (out_busy >= link_window) {
+		poll(&pollfds[BASE_FDS], 1, -1);
 		serial(1);
 	}
 	preparing = false;	// Not yet, but there are no further interruptions.
@@ -559,7 +666,9 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 		return false;
 	// Set flipflop bit.
 	the_packet[0] &= 0x1f;
-	the_packet[0] |= ff_out << 5;
+	the_packet[0] |= (ff_out & 3) << 5;
+	if (serial_size)
+		the_packet[size++] = ff_out;
 #ifdef DEBUG_FF
 	debug("use ff_out: %d", ff_out);
 #endif
@@ -595,34 +704,36 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 		}
 		the_packet[size + t] = sum;
 	}
-	pending_len[ff_out] = size + (size + 2) / 3;
+	int which = PENDING(ff_out);
+	pending_len[which] = size + (size + 2) / 3;
 #ifdef DEBUG_SERIAL
 	fprintf(stderr, "prepare %p:", the_packet);
 #endif
-	for (uint8_t i = 0; i < pending_len[ff_out]; ++i) {
-		pending_packet[ff_out][i] = the_packet[i];
+	for (int i = 0; i < pending_len[which]; ++i) {
+		pending_packet[which][i] = the_packet[i];
 #ifdef DEBUG_SERIAL
-		fprintf(stderr, " %02x", int(uint8_t(pending_packet[ff_out][i])));
+		fprintf(stderr, " %02x", int(uint8_t(pending_packet[which][i])));
 #endif
 	}
 #ifdef DEBUG_SERIAL
 	fprintf(stderr, "\n");
 #endif
-	ff_out = (ff_out + 1) & 3;
+	ff_out = (ff_out + 1) & link_mask;
 	return true;
 } // }}}
 
 // Send packet to firmware.
 void send_packet() { // {{{
-	int which = (ff_out - 1) & 3;
+	int which = PENDING(ff_out - 1);
 #ifdef DEBUG_DATA
 	fprintf(stderr, "send (%d): ", out_busy);
-	for (uint8_t i = 0; i < pending_len[which]; ++i)
+	for (int i = 0; i < pending_len[which]; ++i)
 		fprintf(stderr, " %02x", int(uint8_t(pending_packet[which][i])));
 	fprintf(stderr, "\n");
 #endif
-	for (uint8_t t = 0; t < pending_len[which]; ++t)
+	for (int t = 0; t < pending_len[which]; ++t)
 		serialdev[1]->write(pending_packet[which][t]);
+	serialdev[1]->flush();
 	out_busy += 1;
 	out_time = utime();
 } // }}}
@@ -632,6 +743,7 @@ void write_ack() { // {{{
 	//debug("wack %d", ff_in);
 //#endif
 	serialdev[1]->write(cmd_ack[ff_in]);
+	serialdev[1]->flush();
 	ff_in = (ff_in + 1) & 3;
 } // }}}
 
@@ -640,13 +752,39 @@ void write_nack() { // {{{
 	//debug("wnack %d", ff_in);
 //#endif
 	serialdev[1]->write(cmd_nack[ff_in]);
+	serialdev[1]->flush();
+} // }}}
+#endif
+
+#ifdef PLANNER_THREAD
+struct Host_Message {
+	char cmd;
+	int s, m;
+	double f;
+	int e;
+};
+
+static void send_host_call(void *arg) { // {{{
+	Host_Message *msg = reinterpret_cast <Host_Message *>(arg);
+	send_host(msg->cmd, msg->s, msg->m, msg->f, msg->e);
 } // }}}
 #endif
 
 void send_host(char cmd, int s, int m, double f, int e, unsigned len) { // {{{
+#ifdef PLANNER_THREAD
+	if (planner_self()) {
+		// The host queue belongs to the main thread, and so does datastore.
+		if (len > 0) {
+			debug("planner thread cannot send data to host");
+			abort();
+		}
+		Host_Message msg = {cmd, s, m, f, e};
+		planner_call(send_host_call, &msg);
+		return;
+	}
+#endif
 	//debug("queueing for host cmd %x", cmd);
-	// Use malloc, not mem_alloc, because there are multiple pointers to the same memory and mem_alloc cannot handle that.
-	Queuerecord *record = reinterpret_cast <Queuerecord *>(malloc(sizeof(Queuerecord) + len));
+	Queuerecord *record = new_record(len);
 	if (hostqueue_head)
 		hostqueue_tail->next = record;
 	else
@@ -659,8 +797,7 @@ void send_host(char cmd, int s, int m, double f, int e, unsigned len) { // {{{
 	record->cmd = cmd;
 	record->len = len;
 	record->next = NULL;
-	for (unsigned i = 0; i < len; ++i)
-		reinterpret_cast <char *>(record)[sizeof(Queuerecord) + i] = datastore[i];
+	memcpy(record->data, datastore, len);
 	if (!sending_to_host) {
 		//debug("immediately sending");
 		send_to_host();
@@ -50,17 +50,36 @@ void setup()
 	pollfds[0].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 	pollfds[0].events = POLLIN | POLLPRI;
 	pollfds[0].revents = 0;
+	// Children from RUN_SYSTEM are noticed through SIGCHLD.
+	sigset_t sigchld;
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld, NULL);
+	pollfds[2].fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+	pollfds[2].events = POLLIN;
+	pollfds[2].revents = 0;
+	// A streamed run file is followed while it is written.
+	pollfds[3].fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	pollfds[3].events = POLLIN;
+	pollfds[3].revents = 0;
+	// The planner thread wakes the main thread; set by planner_start().
+	pollfds[4].fd = -1;
+	pollfds[4].events = POLLIN;
+	pollfds[4].revents = 0;
 	command_end[0] = 0;
 	motors_busy = false;
 	current_extruder = 0;
 	continue_cb = 0;
 	ping = 0;
-	for (int i = 0; i < 4; ++i) {
-		pending_len[i] = 0;
+	for (int i = 0; i < 4; ++i)
 		wait_for_reply[i] = NULL;
+	for (int i = 0; i < LINK_WINDOW_MAX; ++i) {
+		pending_len[i] = 0;
 		serial_cb[i] = NULL;
 	}
 	out_busy = 0;
+	link_window = 3;
+	link_mask = 3;
 	led_pin.init();
 	stop_pin.init();
 	probe_pin.init();
@@ -74,10 +93,12 @@ void setup()
 	//debug("current_fragment = running_fragment; %d %p", current_fragment, &current_fragment);
 	current_fragment_pos = 0;
 	num_active_motors = 0;
-	hwtime_step = 10000; // Note: When changing this, also change max in cdriver/space.cpp
+	followers_changed = true;
+	hwtime_step = 10000;
 	audio_hwtime_step = 1;	// This is set by audio file.
 	feedrate = 1;
 	max_deviation = 0;
+	s_curve = false;
 	max_v = INFINITY;
 	targetx = 0;
 	targety = 0;
@@ -95,6 +116,9 @@ void setup()
 	change_pending = false;
 	discarding = false;
 	cbs_after_current_move = 0;
+	event_after_current_move = 0;
+	run_event_end = 0;
+	run_event_done = 0;
 	which_autosleep = 0;
 	timeout = 0;
 	bed_id = 255;
@@ -102,6 +126,7 @@ void setup()
 	spindle_id = 255;
 	run_file_map = NULL;
 	run_file_finishing = false;
+	run_file_growing = false;
 	expected_replies = 0;
 	num_temps = 0;
 	temps = NULL;
@@ -110,6 +135,7 @@ void setup()
 	for (int s = 0; s < NUM_SPACES; ++s)
 		spaces[s].init(s);
 	arch_setup_end();
+	planner_start();
 }
 
 void connect_end() {
@@ -128,20 +154,33 @@ void connect_end() {
 		history[f].t0 = 0;
 		history[f].f0 = 0;
 		history[f].hwtime = 0;
+		history[f].sample_time = hwtime_step;
 		history[f].last_current_time = 0;
 		history[f].cbs = 0;
+		history[f].event_end = 0;
+		history[f].run_event_end = 0;
 		history[f].tp = 0;
-		history[f].f1 = 1;
-		history[f].f2 = 0;
+		history[f].ta = 0;
+		history[f].td = 0;
+		history[f].v0 = 0;
+		history[f].vc = 0;
+		history[f].vp = 0;
+		history[f].entry_v = 0;
+		history[f].entry_mm = 0;
+		history[f].computing_move = false;
+		history[f].prepared = false;
+		history[f].done_factor = 1;
 		history[f].fp = 0;
 		history[f].fq = 0;
 		history[f].fmain = 1;
+		history[f].s_curve = false;
 		history[f].start_time = 0;
 		history[f].last_time = 0;
 		history[f].queue_start = 0;
 		history[f].queue_end = 0;
 		history[f].queue_full = false;
 	}
+	settings.sample_time = hwtime_step;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
 		sp.history = new Space_History[FRAGMENTS_PER_BUFFER];
@@ -177,6 +216,8 @@ Axis_History *setup_axis_history() {
 		ret[f].target = NAN;
 		ret[f].source = NAN;
 		ret[f].current = NAN;
+		ret[f].advance_e = NAN;
+		ret[f].advance = 0;
 	}
 	return ret;
 }
@@ -190,6 +231,7 @@ Motor_History *setup_motor_history() {
 		ret[f].target_v = NAN;
 		ret[f].target_dist = NAN;
 		ret[f].endpos = NAN;
+		ret[f].end_v = 0;
 	}
 	return ret;
 }
@@ -34,6 +34,19 @@
 #define movedebug(...) do {} while (0)
 #endif
 
+#ifdef PLANNER_THREAD
+// The planner thread doesn't use the link to the hardware: finished fragments
+// wait in the ring until the main thread sends them and starts the move (see
+// planner.cpp).
+#define PREPARING false
+#define SENDING_FRAGMENT 0
+#define start_move() do {} while (0)
+#else
+#define PREPARING preparing
+#define SENDING_FRAGMENT sending_fragment
+#define start_move() arch_start_move(0)
+#endif
+
 // Setup. {{{
 bool Space::setup_nums(int na, int nm) { // {{{
 	if (na == num_axes && nm == num_motors)
@@ -96,6 +109,7 @@ bool Space::setup_nums(int na, int nm) { // {{{
 			new_motors[m]->settings.target_v = NAN;
 			new_motors[m]->settings.target_dist = NAN;
 			new_motors[m]->settings.endpos = NAN;
+			new_motors[m]->settings.end_v = 0;
 			new_motors[m]->history = setup_motor_history();
 			ARCH_NEW_MOTOR(id, m, new_motors);
 		}
@@ -106,6 +120,7 @@ bool Space::setup_nums(int na, int nm) { // {{{
 		}
 		delete[] motor;
 		motor = new_motors;
+		followers_changed = true;
 		arch_motors_change();
 	}
 	return true;
@@ -125,6 +140,8 @@ void move_to_current() { // {{{
 	settings.fq = 0;
 	settings.t0 = 0;
 	settings.tp = 0;
+	settings.ta = 0;
+	settings.td = 0;
 	//debug("clearing %d cbs after current move for move to current", cbs_after_current_move);
 	cbs_after_current_move = 0;
 	current_fragment_pos = 0;
@@ -147,6 +164,7 @@ void move_to_current() { // {{{
 			sp.axis[a]->settings.dist[1] = 0;
 			sp.axis[a]->settings.main_dist = 0;
 		}
+		sp.reset_filters();
 		for (int m = 0; m < sp.num_motors; ++m)
 			sp.motor[m]->settings.last_v = 0;
 	}
@@ -159,6 +177,12 @@ void Space::load_info(int32_t &addr) { // {{{
 	if (t >= NUM_SPACE_TYPES)
 		t = DEFAULT_TYPE;
 	type = read_8(addr);
+	shaper = read_8(addr);
+	for (int a = 0; a < SHAPER_AXES; ++a) {
+		shaper_freq[a] = read_float(addr);
+		shaper_damping[a] = read_float(addr);
+	}
+	setup_shaper();
 	if (type >= NUM_SPACE_TYPES || (id == 1 && type != EXTRUDER_TYPE) || (id == 2 && type != FOLLOWER_TYPE)) {
 		debug("request for type %d ignored", type);
 		type = t;
@@ -268,6 +292,11 @@ void Space::load_motor(int m, int32_t &addr) { // {{{
 
 void Space::save_info(int32_t &addr) { // {{{
 	write_8(addr, type);
+	write_8(addr, shaper);
+	for (int a = 0; a < SHAPER_AXES; ++a) {
+		write_float(addr, shaper_freq[a]);
+		write_float(addr, shaper_damping[a]);
+	}
 	space_types[type].save(this, addr);
 } // }}}
 
@@ -300,9 +329,77 @@ void Space::init(int space_id) { // {{{
 	motor = NULL;
 	axis = NULL;
 	history = NULL;
+	shaper = SHAPER_NONE;
+	for (int a = 0; a < SHAPER_AXES; ++a) {
+		shaper_freq[a] = 0;
+		shaper_damping[a] = 0;
+	}
+	setup_shaper();
 	space_types[type].init(this);
 } // }}}
 
+void Space::setup_shaper() { // {{{
+	if (shaper >= NUM_SHAPERS) {
+		debug("request for shaper %d ignored", shaper);
+		shaper = SHAPER_NONE;
+	}
+	shaper_num = shaper == SHAPER_NONE ? 0 : shaper == SHAPER_ZV ? 2 : 3;
+	for (int a = 0; a < SHAPER_AXES; ++a) {
+		for (int i = 0; i < SHAPER_MAX_IMPULSES; ++i) {
+			shaper_a[a][i] = i == 0 ? 1 : 0;
+			shaper_t[a][i] = 0;
+		}
+		double zeta = shaper_damping[a];
+		if (shaper == SHAPER_NONE || !(shaper_freq[a] > 0) || !(zeta >= 0 && zeta < 1))
+			continue;
+		double df = sqrt(1 - zeta * zeta);
+		double k = exp(-zeta * M_PI / df);
+		double period = 1e6 / (shaper_freq[a] * df);	// Damped period [μs].
+		double v = .05;	// Allowed vibration for EI.
+		switch (shaper) {
+		case SHAPER_ZV:
+			shaper_a[a][1] = k;
+			break;
+		case SHAPER_ZVD:
+			shaper_a[a][1] = 2 * k;
+			shaper_a[a][2] = k * k;
+			break;
+		case SHAPER_EI:
+			shaper_a[a][0] = (1 + v) / 4;
+			shaper_a[a][1] = (1 - v) / 2 * k;
+			shaper_a[a][2] = (1 + v) / 4 * k * k;
+			break;
+		}
+		double total = 0;
+		for (int i = 0; i < shaper_num; ++i) {
+			shaper_t[a][i] = period / 2 * i;
+			total += shaper_a[a][i];
+		}
+		for (int i = 0; i < shaper_num; ++i)
+			shaper_a[a][i] /= total;
+		if (shaper_t[a][shaper_num - 1] > (SHAPER_SAMPLES - 2) * hwtime_step / SAMPLE_TIME_RANGE)
+			debug("shaper delay for axis %d %d is longer than the lookback; raise SHAPER_SAMPLES", id, a);
+	}
+	reset_filters();
+} // }}}
+
+void Space::reset_filters() { // {{{
+	// Start shaping and pressure advance from rest at the current position.
+	for (int a = 0; a < num_axes; ++a) {
+		axis[a]->settings.advance = 0;
+		axis[a]->settings.advance_e = axis[a]->settings.current;
+	}
+	if (shaper == SHAPER_NONE)
+		return;
+	settings.shaper_pos = 0;
+	for (int i = 0; i < SHAPER_SAMPLES; ++i)
+		settings.shaper_time[i] = -((SHAPER_SAMPLES - i) & (SHAPER_SAMPLES - 1)) * hwtime_step;
+	for (int a = 0; a < min(SHAPER_AXES, num_axes); ++a) {
+		for (int i = 0; i < SHAPER_SAMPLES; ++i)
+			settings.shaper_target[i][a] = axis[a]->settings.current;
+	}
+} // }}}
+
 void Space::cancel_update() { // {{{
 	// setup_nums failed; restore system to a usable state.
 	type = DEFAULT_TYPE;
@@ -360,30 +457,34 @@ static void check_distance(int sp, int mt, Motor *mtr, double distance, double d
 	// v = at
 	// v² = 2a²x/a = 2ax
 	// x = v²/2a
-	double limit_dist = v * v / 2 / mtr->limit_a;
+	// The lookahead may allow arriving at endpos with end_v instead of stopping there.
+	double end_v = mtr->settings.end_v * s;
+	if (!(end_v > 0))
+		end_v = 0;
+	double limit_dist = (v * v - end_v * end_v) / 2 / mtr->limit_a;
 	//debug("max %f limit %f v %f a %f", max_dist, limit_dist, v, mtr->limit_a);
 	if (max_dist > 0 && limit_dist > max_dist) {
 		//debug("a- endpos %f limit a %f limit dist %f max dist %f v %f distance %f current pos %f s %d dt %f", mtr->settings.endpos, mtr->limit_a, limit_dist, max_dist, v, distance, mtr->settings.current_pos, s, dt);
-		v = sqrt(max_dist * 2 * mtr->limit_a);
+		v = sqrt(max_dist * 2 * mtr->limit_a + end_v * end_v);
 		distance = s * v * dt;
 	}
 	//debug("cd4 %f %f", distance, dt); */
-	int steps = arch_round_pos(sp, mt, mtr->settings.current_pos + distance * mtr->steps_per_unit) - round(mtr->settings.current_pos);
+	double hw_pos = arch_round_pos(sp, mt, mtr->settings.current_pos);
+	int steps = arch_round_pos(sp, mt, mtr->settings.current_pos + distance * mtr->steps_per_unit) - hw_pos;
 	int targetsteps = steps;
 	//cpdebug(s, m, "cf %d value %d", current_fragment, value);
 	if (settings.probing && steps)
 		steps = s;
 	else {
-		// Maximum depends on number of subfragments.  Be conservative and use 0x7e per subfragment; assume 128 subfragments (largest power of 2 smaller than 10000/75)
-		// TODO: 10000 and 75 should follow the actual values for step_time in cdriver and TIME_PER_ISR in firmware.
-		int max = 0x7e << 7;
+		// Maximum depends on the hardware and the length of the sample.
+		int max = arch_max_steps(settings.sample_time);
 		if (abs(steps) > max) {
 			debug("overflow %d from cp %f dist %f steps/mm %f dt %f s %d max %d", steps, mtr->settings.current_pos, distance, mtr->steps_per_unit, dt, s, max);
 			steps = max * s;
 		}
 	}
 	if (abs(steps) < abs(targetsteps)) {
-		distance = (arch_round_pos(sp, mt, mtr->settings.current_pos) + steps + s * .5 - mtr->settings.current_pos) / mtr->steps_per_unit;
+		distance = (hw_pos + steps + s * .5 - mtr->settings.current_pos) / mtr->steps_per_unit;
 		v = fabs(distance / dt);
 	}
 	//debug("=============");
@@ -393,16 +494,66 @@ static void check_distance(int sp, int mt, Motor *mtr, double distance, double d
 		factor = f;
 } // }}}
 
+static bool settling;	// Input shaping or pressure advance still moves a motor whose axis has stopped.
+
+static void shape(Space *s, double *target) { // {{{
+	// Convolve the path with the impulses of the shaper.  The unshaped target
+	// of this sample is stored in the lookback; the delayed ones are
+	// interpolated between the stored samples.  Samples don't all have the
+	// same length, so the lookback stores their times as well.
+	int pos = s->settings.shaper_pos;
+	uint32_t *time = s->settings.shaper_time;
+	time[pos] = time[(pos - 1) & (SHAPER_SAMPLES - 1)] + settings.sample_time;
+	for (int a = 0; a < min(SHAPER_AXES, s->num_axes); ++a) {
+		double raw = isnan(target[a]) ? s->axis[a]->settings.source : target[a];
+		s->settings.shaper_target[pos][a] = raw;
+		double shaped = 0;
+		int d = 0;
+		for (int i = 0; i < s->shaper_num; ++i) {
+			// Find the stored samples around the delay; delays are increasing.
+			double delay = s->shaper_t[a][i];
+			while (d < SHAPER_SAMPLES - 2 && time[pos] - time[(pos - d - 1) & (SHAPER_SAMPLES - 1)] <= delay)
+				d += 1;
+			double frac = 0;
+			if (d < SHAPER_SAMPLES - 2) {
+				double t0 = time[pos] - time[(pos - d) & (SHAPER_SAMPLES - 1)];
+				double t1 = time[pos] - time[(pos - d - 1) & (SHAPER_SAMPLES - 1)];
+				frac = (delay - t0) / (t1 - t0);
+			}
+			double p0 = s->settings.shaper_target[(pos - d) & (SHAPER_SAMPLES - 1)][a];
+			double p1 = s->settings.shaper_target[(pos - d - 1) & (SHAPER_SAMPLES - 1)][a];
+			shaped += s->shaper_a[a][i] * (p0 + (p1 - p0) * frac);
+		}
+		// Axes that don't move keep NaN as target, unless the shaper is still moving them.
+		if (fabs(shaped - raw) > 1e-6) {
+			settling = true;
+			target[a] = shaped;
+		}
+		else if (!isnan(target[a]))
+			target[a] = shaped;
+	}
+} // }}}
+
+static void next_sample() { // {{{
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		if (spaces[s].shaper != SHAPER_NONE)
+			spaces[s].settings.shaper_pos = (spaces[s].settings.shaper_pos + 1) & (SHAPER_SAMPLES - 1);
+		if (spaces[s].type == EXTRUDER_TYPE)
+			extruder_advance_done(&spaces[s]);
+	}
+} // }}}
+
 static void move_axes(Space *s, int32_t current_time, double &factor) { // {{{
+	BENCH_TIMER(BENCH_MOVE_AXES);
+	double target[s->num_axes];
 	double motors_target[s->num_motors];
-	bool ok = true;
-	space_types[s->type].xyz2motors(s, motors_target);
-	// Try again if it didn't work; it should have moved target to a better location.
-	if (!ok) {
-		space_types[s->type].xyz2motors(s, motors_target);
-		movedebug("retried move");
-	}
-	//movedebug("ok %d", ok);
+	for (int a = 0; a < s->num_axes; ++a)
+		target[a] = s->axis[a]->settings.target;
+	if (s->shaper != SHAPER_NONE)
+		shape(s, target);
+	space_types[s->type].xyz2motors(s, 1, target, motors_target);
+	if (s->type == EXTRUDER_TYPE && extruder_advance(s, target, motors_target))
+		settling = true;
 	for (int m = 0; m < s->num_motors; ++m) {
 		//if (s->id == 0 && m == 0)
 			//debug("check move %d %d target %f current %f", s->id, m, motors_target[m], s->motor[m]->settings.current_pos / s->motor[m]->steps_per_unit);
@@ -411,7 +562,38 @@ static void move_axes(Space *s, int32_t current_time, double &factor) { // {{{
 	}
 } // }}}
 
+// Follower motors and the motors they follow, so do_steps() doesn't need to ask the space type every sample.
+struct Follower {
+	Motor *leader;
+	Motor *motor;
+};
+static Follower *followers;
+static int num_followers;
+
+static void update_followers() { // {{{
+	delete[] followers;
+	followers = new Follower[spaces[2].num_motors];
+	num_followers = 0;
+	for (int mm = 0; mm < spaces[2].num_motors; ++mm) {
+		int fm = space_types[spaces[2].type].follow(&spaces[2], mm);
+		if (fm < 0)
+			continue;
+		int fs = fm >> 8;
+		fm &= 0x7f;
+		// A follower can only follow followers that are handled before it.
+		if (fs == 2 && fm >= mm)
+			continue;
+		followers[num_followers].leader = spaces[fs].motor[fm];
+		followers[num_followers].motor = spaces[2].motor[mm];
+		num_followers += 1;
+	}
+	followers_changed = false;
+} // }}}
+
 static bool do_steps(double &factor, int32_t current_time) { // {{{
+	BENCH_TIMER(BENCH_DO_STEPS);
+	if (followers_changed)
+		update_followers();
 	//debug("steps");
 	if (factor <= 0) {
 		movedebug("end move");
@@ -423,28 +605,10 @@ static bool do_steps(double &factor, int32_t current_time) { // {{{
 			for (int m = 0; m < sp.num_motors; ++m)
 				DATA_SET(s, m, 0);
 		}
+		next_sample();
 		current_fragment_pos += 1;
 		return false;
 	}
-	// Check if more steps should be done, to detect end of move.
-	bool have_steps = false;
-	for (int s = 0; !have_steps && s < NUM_SPACES; ++s) {
-		if (!settings.single && s == 2)
-			continue;
-		Space &sp = spaces[s];
-		for (int m = 0; m < sp.num_motors; ++m) {
-			Motor &mtr = *sp.motor[m];
-			// Check if there are steps to be done; ignore factor.
-			double num = (mtr.settings.current_pos / mtr.steps_per_unit + mtr.settings.target_dist);
-			//debug("num: %f ; current: %f", num, mtr.settings.current_pos);
-			if (arch_round_pos(s, m, mtr.settings.current_pos) != arch_round_pos(s, m, num * mtr.steps_per_unit)) {
-				//debug("have steps %f %f %f", mtr.settings.current_pos, mtr.settings.target_dist, factor);
-				have_steps = true;
-				break;
-			}
-			//debug("no steps yet %d %d %f %f %f", s, m, mtr.settings.current_pos, mtr.settings.target_dist, factor);
-		}
-	}
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		if (!settings.single && s == 2)
 			continue;
@@ -457,6 +621,7 @@ static bool do_steps(double &factor, int32_t current_time) { // {{{
 		}
 	}
 	if (factor < 1) {
+		BENCH_COUNT(BENCH_LIMIT_FALLBACK);
 		// Recalculate steps; ignore resulting factor.
 		double dummy_factor = 1;
 		//debug("redo steps %d", current_fragment);
@@ -494,7 +659,7 @@ static bool do_steps(double &factor, int32_t current_time) { // {{{
 #endif
 	// Move the motors.
 	//debug("start move");
-	have_steps = false;
+	bool have_steps = false;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		if (!settings.single && s == 2)
 			continue;
@@ -510,28 +675,24 @@ static bool do_steps(double &factor, int32_t current_time) { // {{{
 			double target = mtr.settings.current_pos / mtr.steps_per_unit + mtr.settings.target_dist * factor;
 			cpdebug(s, m, "ccp3 stopping %d target %f lastv %f spm %f tdist %f factor %f frag %d", stopping, target, mtr.settings.last_v, mtr.steps_per_unit, mtr.settings.target_dist, factor, current_fragment);
 			double new_cp = target * mtr.steps_per_unit;
-			if (arch_round_pos(s, m, mtr.settings.current_pos) != arch_round_pos(s, m, new_cp)) {
+			// Hardware positions are whole steps; only the difference is sent.
+			int diff = arch_round_pos(s, m, new_cp) - arch_round_pos(s, m, mtr.settings.current_pos);
+			if (diff != 0) {
 				have_steps = true;
 				if (!mtr.active) {
 					mtr.active = true;
 					num_active_motors += 1;
 				}
-				int diff = arch_round_pos(s, m, new_cp) - arch_round_pos(s, m, mtr.settings.current_pos);
 				movedebug("sending %d %d steps %d", s, m, diff);
 				DATA_SET(s, m, diff);
 			}
 			//debug("new cp: %d %d %f %d", s, m, new_cp, current_fragment_pos);
 			if (!settings.single) {
-				for (int mm = 0; mm < spaces[2].num_motors; ++mm) {
-					int fm = space_types[spaces[2].type].follow(&spaces[2], mm);
-					if (fm < 0)
-						continue;
-					int fs = fm >> 8;
-					fm &= 0x7f;
-					if (fs != s || fm != m || (fs == 2 && fm >= mm))
+				for (int f = 0; f < num_followers; ++f) {
+					if (followers[f].leader != &mtr)
 						continue;
-					//debug("follow %d %d %d %d %d %f %f", s, m, fs, fm, mm, new_cp, mtr.settings.current_pos);
-					spaces[2].motor[mm]->settings.current_pos += new_cp - mtr.settings.current_pos;
+					//debug("follow %d %d %f %f", s, m, new_cp, mtr.settings.current_pos);
+					followers[f].motor->settings.current_pos += new_cp - mtr.settings.current_pos;
 				}
 			}
 			mtr.settings.current_pos = new_cp;
@@ -539,6 +700,7 @@ static bool do_steps(double &factor, int32_t current_time) { // {{{
 			mtr.settings.last_v = mtr.settings.target_v * factor;
 		}
 	}
+	next_sample();
 	current_fragment_pos += 1;
 	//debug("have steps: %d", have_steps);
 	return have_steps;
@@ -566,6 +728,16 @@ void make_target(Space &sp, double f, bool next) { // {{{
 	}
 } // }}}
 
+static double ramp(double v0, double v1, double T, double t) { // {{{
+	// Distance [fraction of the segment] covered t into a speed change from v0 to v1 that takes T.
+	double x = t / T;
+	if (settings.s_curve) {
+		// Speed follows a smoothstep (3x²-2x³); this is its integral.
+		return v0 * t + (v1 - v0) * T * x * x * x * (1 - x / 2);
+	}
+	return v0 * t + (v1 - v0) * T * x * x / 2;
+} // }}}
+
 static void handle_motors(unsigned long long current_time) { // {{{
 	// Check for move.
 	if (!computing_move) {
@@ -574,9 +746,14 @@ static void handle_motors(unsigned long long current_time) { // {{{
 	}
 	movedebug("handling %d %d", computing_move, cbs_after_current_move);
 	double factor = 1;
+	settling = false;
 	double t = (current_time - settings.start_time) / 1e6;
 	if (t >= settings.t0 + settings.tp) {	// Finish this move and prepare next. {{{
 		movedebug("finishing %f %f %f %ld %ld", t, settings.t0, settings.tp, long(current_time), long(settings.start_time));
+		// If the connection already started the next segment, this sample is computed in that segment, so the motors don't stop at the connection.
+		bool next = prepared && (settings.queue_start != settings.queue_end || settings.queue_full);
+		int32_t over = int32_t(current_time - settings.start_time) - int32_t((settings.t0 + settings.tp) * 1e6);
+		int32_t since = int32_t(current_time - settings.last_time);
 		//debug("finish steps");
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			if (!settings.single && s == 2)
@@ -592,21 +769,25 @@ static void handle_motors(unsigned long long current_time) { // {{{
 				}
 				sp.settings.dist[0] = NAN;
 			}
+			if (next)
+				continue;
 			for (int a = 0; a < sp.num_axes; ++a)
 				sp.axis[a]->settings.target = sp.axis[a]->settings.source;
 			move_axes(&sp, current_time, factor);
 			//debug("f %f", factor);
 		}
 		//debug("f2 %f %ld %ld", factor, settings.last_time, current_time);
-		bool did_steps = do_steps(factor, current_time);
+		bool did_steps = next ? false : do_steps(factor, current_time);
 		//debug("f3 %f", factor);
 		// Start time may have changed; recalculate t.
 		t = (current_time - settings.start_time) / 1e6;
-		if (t / (settings.t0 + settings.tp) >= done_factor) {
+		if (next || t / (settings.t0 + settings.tp) >= done_factor) {
 			movedebug("Done with this move");
 			int had_cbs = cbs_after_current_move;
 			//debug("clearing %d cbs after current move for later inserting into history", cbs_after_current_move);
 			cbs_after_current_move = 0;
+			run_events_attach(event_after_current_move);
+			event_after_current_move = 0;
 			run_file_fill_queue();
 			if (settings.queue_start != settings.queue_end || settings.queue_full) {
 				movedebug("queue is not empty");
@@ -620,6 +801,13 @@ static void handle_motors(unsigned long long current_time) { // {{{
 					//debug("adding %d cbs to fragment %d", had_cbs, fragment);
 					history[fragment].cbs += had_cbs;
 				}
+				if (next && computing_move && !aborting) {
+					// next_move() reset the time to this sample.
+					settings.start_time = -over;
+					settings.last_time = -since;
+					settings.last_current_time = -since;
+					handle_motors(settings.hwtime);
+				}
 				return;
 			}
 			else
@@ -628,7 +816,8 @@ static void handle_motors(unsigned long long current_time) { // {{{
 			//debug("adding %d to cbs after current move making it %d", had_cbs, cbs_after_current_move);
 			if (factor == 1) {
 				//debug("queue done");
-				if (!did_steps) {
+				// With input shaping or pressure advance, the motors keep moving for a while after the path has ended.
+				if (!did_steps && !settling) {
 					movedebug("really done move");
 					computing_move = false;
 					// Cut off final sample, which was no steps anyway.
@@ -666,9 +855,16 @@ static void handle_motors(unsigned long long current_time) { // {{{
 		return;
 	} // }}}
 	if (t < settings.t0) {	// Main part. {{{
-		double t_fraction = t / settings.t0;
-		double current_f = (settings.f1 * (2 - t_fraction) + settings.f2 * t_fraction) * t_fraction;
-		movedebug("main t %f t0 %f tp %f tfrac %f f1 %f f2 %f cf %f", t, settings.t0, settings.tp, t_fraction, settings.f1, settings.f2, current_f);
+		// Speed goes from v0 to vc in ta, stays at vc and goes to vp in td.
+		double tc = settings.t0 - settings.ta - settings.td;
+		double current_f = settings.f0;
+		if (t < settings.ta)
+			current_f += ramp(settings.v0, settings.vc, settings.ta, t);
+		else if (t < settings.ta + tc)
+			current_f += (settings.v0 + settings.vc) / 2 * settings.ta + settings.vc * (t - settings.ta);
+		else
+			current_f += (settings.v0 + settings.vc) / 2 * settings.ta + settings.vc * tc + ramp(settings.vc, settings.vp, settings.td, t - settings.ta - tc);
+		movedebug("main t %f t0 %f tp %f ta %f td %f cf %f", t, settings.t0, settings.tp, settings.ta, settings.td, current_f);
 		//debug("main steps");
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			if (!settings.single && s == 2)
@@ -689,8 +885,17 @@ static void handle_motors(unsigned long long current_time) { // {{{
 		movedebug("connector %f %f %f", t, settings.t0, settings.tp);
 		double tc = t - settings.t0;
 		double t_fraction = tc / settings.tp;
-		double current_f2 = settings.fp * (2 - t_fraction) * t_fraction;
-		double current_f3 = settings.fq * t_fraction * t_fraction;
+		double current_f2, current_f3;
+		if (settings.s_curve) {
+			// Same speeds at the ends as below, with zero acceleration there.
+			double smooth = t_fraction * t_fraction * t_fraction * (2 - t_fraction);
+			current_f2 = settings.fp * (2 * t_fraction - smooth);
+			current_f3 = settings.fq * smooth;
+		}
+		else {
+			current_f2 = settings.fp * (2 - t_fraction) * t_fraction;
+			current_f3 = settings.fq * t_fraction * t_fraction;
+		}
 		//debug("connect steps");
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			if (!settings.single && s == 2)
@@ -711,21 +916,91 @@ static void handle_motors(unsigned long long current_time) { // {{{
 	do_steps(factor, current_time);
 } // }}}
 
+static void copy_space_history(Space_History &dst, Space_History const &src, bool shaper) { // {{{
+	dst.dist[0] = src.dist[0];
+	dst.dist[1] = src.dist[1];
+	for (int i = 0; i < 2; ++i) {
+		dst.arc[i] = src.arc[i];
+		// The arc geometry is only used for arcs; don't copy it for straight segments.
+		if (!src.arc[i])
+			continue;
+		dst.angle[i] = src.angle[i];
+		dst.helix[i] = src.helix[i];
+		for (int t = 0; t < 2; ++t)
+			dst.radius[i][t] = src.radius[i][t];
+		for (int t = 0; t < 3; ++t) {
+			dst.offset[i][t] = src.offset[i][t];
+			dst.e1[i][t] = src.e1[i][t];
+			dst.e2[i][t] = src.e2[i][t];
+			dst.normal[i][t] = src.normal[i][t];
+		}
+	}
+	// The shaper lookback is only needed if the space uses it.
+	if (shaper) {
+		dst.shaper_pos = src.shaper_pos;
+		for (int i = 0; i < SHAPER_SAMPLES; ++i) {
+			dst.shaper_time[i] = src.shaper_time[i];
+			for (int a = 0; a < SHAPER_AXES; ++a)
+				dst.shaper_target[i][a] = src.shaper_target[i][a];
+		}
+	}
+} // }}}
+
+static int choose_sample_time() { // {{{
+	// Slow fragments use longer samples, so fewer of them are needed; fast
+	// ones use shorter samples, so the steps in one sample stay few.
+	double steps = 0;	// Steps per hwtime_step for the fastest motor.
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		for (int m = 0; m < sp.num_motors; ++m) {
+			double v = fabs(sp.motor[m]->settings.last_v * sp.motor[m]->steps_per_unit) * hwtime_step / 1e6;
+			if (v > steps)
+				steps = v;
+		}
+	}
+	// The next move starts at a sample boundary, so a long sample at the end
+	// of a move is partly wasted.  Only lengthen samples if the current move
+	// lasts at least the whole fragment.  Probing does a single step per
+	// sample; don't slow it down.
+	double remaining = settings.t0 + settings.tp - (settings.hwtime - settings.start_time) / 1e6;
+	int t = hwtime_step;
+	for (int r = 1; r < SAMPLE_TIME_RANGE && !settings.probing && steps * 2 <= .5 && t * 2 * SAMPLES_PER_FRAGMENT / 1e6 <= remaining; r *= 2) {
+		t *= 2;
+		steps *= 2;
+	}
+	for (int r = 1; r < SAMPLE_TIME_RANGE && steps > SAMPLE_STEPS_MAX; r *= 2) {
+		t /= 2;
+		steps /= 2;
+	}
+	return arch_sample_time(t);
+} // }}}
+
 void store_settings() { // {{{
 	current_fragment_pos = 0;
 	num_active_motors = 0;
 	if (FRAGMENTS_PER_BUFFER == 0)
 		return;
+	settings.sample_time = choose_sample_time();
 	history[current_fragment].t0 = settings.t0;
 	history[current_fragment].tp = settings.tp;
 	history[current_fragment].f0 = settings.f0;
-	history[current_fragment].f1 = settings.f1;
-	history[current_fragment].f2 = settings.f2;
+	history[current_fragment].ta = settings.ta;
+	history[current_fragment].td = settings.td;
+	history[current_fragment].v0 = settings.v0;
+	history[current_fragment].vc = settings.vc;
+	history[current_fragment].vp = settings.vp;
+	history[current_fragment].entry_v = settings.entry_v;
+	history[current_fragment].entry_mm = settings.entry_mm;
+	history[current_fragment].computing_move = computing_move;
+	history[current_fragment].prepared = prepared;
+	history[current_fragment].done_factor = done_factor;
 	history[current_fragment].fp = settings.fp;
 	history[current_fragment].fq = settings.fq;
 	history[current_fragment].fmain = settings.fmain;
+	history[current_fragment].s_curve = settings.s_curve;
 	history[current_fragment].cbs = 0;
 	history[current_fragment].hwtime = settings.hwtime;
+	history[current_fragment].sample_time = settings.sample_time;
 	history[current_fragment].start_time = settings.start_time;
 	history[current_fragment].last_time = settings.last_time;
 	history[current_fragment].last_current_time = settings.last_current_time;
@@ -735,43 +1010,19 @@ void store_settings() { // {{{
 	history[current_fragment].run_file_current = settings.run_file_current;
 	history[current_fragment].run_time = settings.run_time;
 	history[current_fragment].run_dist = settings.run_dist;
+	history[current_fragment].event_end = 0;
+	history[current_fragment].run_event_end = run_event_end;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
-		sp.history[current_fragment].dist[0] = sp.settings.dist[0];
-		sp.history[current_fragment].dist[1] = sp.settings.dist[1];
-		for (int i = 0; i < 2; ++i) {
-			sp.history[current_fragment].arc[i] = sp.settings.arc[i];
-			sp.history[current_fragment].angle[i] = sp.settings.angle[i];
-			sp.history[current_fragment].helix[i] = sp.settings.helix[i];
-			for (int t = 0; t < 2; ++t)
-				sp.history[current_fragment].radius[i][t] = sp.settings.radius[i][t];
-			for (int t = 0; t < 3; ++t) {
-				sp.history[current_fragment].offset[i][t] = sp.settings.offset[i][t];
-				sp.history[current_fragment].e1[i][t] = sp.settings.e1[i][t];
-				sp.history[current_fragment].e2[i][t] = sp.settings.e2[i][t];
-				sp.history[current_fragment].normal[i][t] = sp.settings.normal[i][t];
-			}
-		}
+		copy_space_history(sp.history[current_fragment], sp.settings, sp.shaper != SHAPER_NONE);
 		for (int m = 0; m < sp.num_motors; ++m) {
 			sp.motor[m]->active = false;
 			DATA_CLEAR(s, m);
-			sp.motor[m]->history[current_fragment].last_v = sp.motor[m]->settings.last_v;
-			sp.motor[m]->history[current_fragment].target_v = sp.motor[m]->settings.target_v;
-			sp.motor[m]->history[current_fragment].target_dist = sp.motor[m]->settings.target_dist;
-			sp.motor[m]->history[current_fragment].current_pos = sp.motor[m]->settings.current_pos;
-			sp.motor[m]->history[current_fragment].endpos = sp.motor[m]->settings.endpos;
+			sp.motor[m]->history[current_fragment] = sp.motor[m]->settings;
 			cpdebug(s, m, "store");
 		}
-		for (int a = 0; a < sp.num_axes; ++a) {
-			sp.axis[a]->history[current_fragment].dist[0] = sp.axis[a]->settings.dist[0];
-			sp.axis[a]->history[current_fragment].dist[1] = sp.axis[a]->settings.dist[1];
-			sp.axis[a]->history[current_fragment].main_dist = sp.axis[a]->settings.main_dist;
-			sp.axis[a]->history[current_fragment].target = sp.axis[a]->settings.target;
-			sp.axis[a]->history[current_fragment].source = sp.axis[a]->settings.source;
-			sp.axis[a]->history[current_fragment].current = sp.axis[a]->settings.current;
-			sp.axis[a]->history[current_fragment].endpos[0] = sp.axis[a]->settings.endpos[0];
-			sp.axis[a]->history[current_fragment].endpos[1] = sp.axis[a]->settings.endpos[1];
-		}
+		for (int a = 0; a < sp.num_axes; ++a)
+			sp.axis[a]->history[current_fragment] = sp.axis[a]->settings;
 	}
 } // }}}
 
@@ -783,13 +1034,23 @@ void restore_settings() { // {{{
 	settings.t0 = history[current_fragment].t0;
 	settings.tp = history[current_fragment].tp;
 	settings.f0 = history[current_fragment].f0;
-	settings.f1 = history[current_fragment].f1;
-	settings.f2 = history[current_fragment].f2;
+	settings.ta = history[current_fragment].ta;
+	settings.td = history[current_fragment].td;
+	settings.v0 = history[current_fragment].v0;
+	settings.vc = history[current_fragment].vc;
+	settings.vp = history[current_fragment].vp;
+	settings.entry_v = history[current_fragment].entry_v;
+	settings.entry_mm = history[current_fragment].entry_mm;
+	computing_move = history[current_fragment].computing_move;
+	prepared = history[current_fragment].prepared;
+	done_factor = history[current_fragment].done_factor;
 	settings.fp = history[current_fragment].fp;
 	settings.fq = history[current_fragment].fq;
 	settings.fmain = history[current_fragment].fmain;
+	settings.s_curve = history[current_fragment].s_curve;
 	history[current_fragment].cbs = 0;
 	settings.hwtime = history[current_fragment].hwtime;
+	settings.sample_time = history[current_fragment].sample_time;
 	settings.start_time = history[current_fragment].start_time;
 	settings.last_time = history[current_fragment].last_time;
 	settings.last_current_time = history[current_fragment].last_current_time;
@@ -799,59 +1060,47 @@ void restore_settings() { // {{{
 	settings.run_file_current = history[current_fragment].run_file_current;
 	settings.run_time = history[current_fragment].run_time;
 	settings.run_dist = history[current_fragment].run_dist;
+	history[current_fragment].event_end = 0;
+	// The run file records from run_file_current on are read again; drop the events they queued, so they don't happen twice.
+	if (run_event_end > history[current_fragment].run_event_end) {
+		run_event_end = max(history[current_fragment].run_event_end, run_event_done);
+		if (event_after_current_move > run_event_end)
+			event_after_current_move = run_event_end;
+	}
+	if (settings.run_file_current < run_file_num_records)
+		run_file_finishing = false;
 	for (int s = 0; s < NUM_SPACES; ++s) {
 		Space &sp = spaces[s];
-		sp.settings.dist[0] = sp.history[current_fragment].dist[0];
-		sp.settings.dist[1] = sp.history[current_fragment].dist[1];
-		for (int i = 0; i < 2; ++i) {
-			sp.settings.arc[i] = sp.history[current_fragment].arc[i];
-			sp.settings.angle[i] = sp.history[current_fragment].angle[i];
-			sp.settings.helix[i] = sp.history[current_fragment].helix[i];
-			for (int t = 0; t < 2; ++t)
-				sp.settings.radius[i][t] = sp.history[current_fragment].radius[i][t];
-			for (int t = 0; t < 3; ++t) {
-				sp.settings.offset[i][t] = sp.history[current_fragment].offset[i][t];
-				sp.settings.e1[i][t] = sp.history[current_fragment].e1[i][t];
-				sp.settings.e2[i][t] = sp.history[current_fragment].e2[i][t];
-				sp.settings.normal[i][t] = sp.history[current_fragment].normal[i][t];
-			}
-		}
+		copy_space_history(sp.settings, sp.history[current_fragment], sp.shaper != SHAPER_NONE);
 		for (int m = 0; m < sp.num_motors; ++m) {
 			sp.motor[m]->active = false;
 			DATA_CLEAR(s, m);
-			sp.motor[m]->settings.last_v = sp.motor[m]->history[current_fragment].last_v;
-			sp.motor[m]->settings.target_v = sp.motor[m]->history[current_fragment].target_v;
-			sp.motor[m]->settings.target_dist = sp.motor[m]->history[current_fragment].target_dist;
-			sp.motor[m]->settings.current_pos = sp.motor[m]->history[current_fragment].current_pos;
-			sp.motor[m]->settings.endpos = sp.motor[m]->history[current_fragment].endpos;
+			sp.motor[m]->settings = sp.motor[m]->history[current_fragment];
 			cpdebug(s, m, "restore");
 		}
-		for (int a = 0; a < sp.num_axes; ++a) {
-			sp.axis[a]->settings.dist[0] = sp.axis[a]->history[current_fragment].dist[0];
-			sp.axis[a]->settings.dist[1] = sp.axis[a]->history[current_fragment].dist[1];
-			sp.axis[a]->settings.main_dist = sp.axis[a]->history[current_fragment].main_dist;
-			sp.axis[a]->settings.target = sp.axis[a]->history[current_fragment].target;
-			sp.axis[a]->settings.source = sp.axis[a]->history[current_fragment].source;
-			sp.axis[a]->settings.current = sp.axis[a]->history[current_fragment].current;
-			sp.axis[a]->settings.endpos[0] = sp.axis[a]->history[current_fragment].endpos[0];
-			sp.axis[a]->settings.endpos[1] = sp.axis[a]->history[current_fragment].endpos[1];
-		}
+		for (int a = 0; a < sp.num_axes; ++a)
+			sp.axis[a]->settings = sp.axis[a]->history[current_fragment];
 	}
 } // }}}
 
 void send_fragment() { // {{{
+#ifndef PLANNER_THREAD
 	if (host_block) {
 		current_fragment_pos = 0;
 		return;
 	}
-	if (current_fragment_pos <= 0 || stopping || sending_fragment) {
-		debug("no send fragment %d %d %d", current_fragment_pos, stopping, sending_fragment);
+#endif
+	if (current_fragment_pos <= 0 || stopping || SENDING_FRAGMENT) {
+		debug("no send fragment %d %d %d", current_fragment_pos, stopping, SENDING_FRAGMENT);
 		return;
 	}
 	if (num_active_motors == 0) {
 		if (current_fragment_pos < 2) {
 			// TODO: find out why this is attempted and avoid it.
 			debug("not sending short fragment for 0 motors; %d %d", current_fragment, running_fragment);
+			// There is no motion in it, so events that wait for it can happen now.
+			run_events_fire(history[current_fragment].event_end);
+			history[current_fragment].event_end = 0;
 			if (history[current_fragment].cbs) {
 				if (settings.queue_start == settings.queue_end && !settings.queue_full) {
 					// Send cbs immediately.
@@ -869,6 +1118,12 @@ void send_fragment() { // {{{
 		//abort();
 	}
 	//debug("sending %d prevcbs %d", current_fragment, history[(current_fragment + FRAGMENTS_PER_BUFFER - 1) % FRAGMENTS_PER_BUFFER].cbs);
+#ifdef PLANNER_THREAD
+	arch_store_fragment();
+	current_fragment = (current_fragment + 1) % FRAGMENTS_PER_BUFFER;
+	store_settings();
+	planner_publish();
+#else
 	if (arch_send_fragment()) {
 		current_fragment = (current_fragment + 1) % FRAGMENTS_PER_BUFFER;
 		//debug("current_fragment = (current_fragment + 1) %% FRAGMENTS_PER_BUFFER; %d", current_fragment);
@@ -878,10 +1133,11 @@ void send_fragment() { // {{{
 			arch_start_move(0);
 		}
 	}
+#endif
 } // }}}
 
 void apply_tick() { // {{{
-	settings.hwtime += hwtime_step;
+	settings.hwtime += settings.sample_time;
 	if (current_fragment_pos < SAMPLES_PER_FRAGMENT)
 		handle_motors(settings.hwtime);
 	//if (spaces[0].num_axes >= 2)
@@ -890,28 +1146,41 @@ void apply_tick() { // {{{
 
 void buffer_refill() { // {{{
 	//debug("refill");
-	if (preparing || FRAGMENTS_PER_BUFFER == 0) {
+#ifdef PLANNER_THREAD
+	if (!planner_self()) {
+		planner_wake();
+		return;
+	}
+#endif
+	if (PREPARING || FRAGMENTS_PER_BUFFER == 0) {
 		//debug("no refill because prepare");
 		return;
 	}
 	if (moving_to_current == 2)
 		move_to_current();
+	if (!computing_move && current_fragment_pos > 0 && !SENDING_FRAGMENT && !refilling && !stopping && !discard_pending && !discarding) {
+		// The last fragment of the move had to wait until the one before it was sent.
+		send_fragment();
+		start_move();
+		return;
+	}
 	if (!computing_move || refilling || stopping || discard_pending || discarding) {
 		//debug("refill block %d %d %d %d %d", computing_move, refilling, stopping, discard_pending, discarding);
 		return;
 	}
 	refilling = true;
-	// send_fragment in the previous refill may have failed; try it again.
-	if (current_fragment_pos > 0)
+	// send_fragment in the previous refill may have failed, or waited for the previous fragment; try it again.
+	if (current_fragment_pos > 0 && !SENDING_FRAGMENT)
 		send_fragment();
-	//debug("refill start %d %d %d", running_fragment, current_fragment, sending_fragment);
+	//debug("refill start %d %d %d", running_fragment, current_fragment, SENDING_FRAGMENT);
 	// Keep one free fragment, because we want to be able to rewind and use the buffer before the one currently active.
-	while (computing_move && !stopping && !discard_pending && !discarding && (running_fragment - 1 - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > 4 && !sending_fragment) {
+	// The next fragment is computed while the previous one is being sent; it is sent when that is done.
+	while (computing_move && !planner_stopping() && !stopping && !discard_pending && !discarding && (running_fragment - 1 - current_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER > 4 && !(SENDING_FRAGMENT && current_fragment_pos >= SAMPLES_PER_FRAGMENT)) {
 		//debug("refill %d %d %f", current_fragment, current_fragment_pos, spaces[0].motor[0]->settings.current_pos);
 		// fill fragment until full.
 		apply_tick();
 		//debug("refill2 %d %f", current_fragment, spaces[0].motor[0]->settings.current_pos);
-		if (current_fragment_pos >= SAMPLES_PER_FRAGMENT) {
+		if (current_fragment_pos >= SAMPLES_PER_FRAGMENT && !SENDING_FRAGMENT) {
 			//debug("fragment full %d %d %d", computing_move, current_fragment_pos, BYTES_PER_FRAGMENT);
 			send_fragment();
 		}
@@ -923,11 +1192,11 @@ void buffer_refill() { // {{{
 		refilling = false;
 		return;
 	}
-	if (!computing_move && current_fragment_pos > 0) {
+	if (!computing_move && current_fragment_pos > 0 && !SENDING_FRAGMENT) {
 		//debug("finalize");
 		send_fragment();
 	}
 	refilling = false;
-	arch_start_move(0);
+	start_move();
 } // }}}
 // }}}
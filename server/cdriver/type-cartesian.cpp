@@ -20,13 +20,9 @@
 #include "cdriver.h"
 
 // Cartesian functions. {{{
-static void xyz2motors(Space *s, double *motors) { // {{{
-	for (uint8_t a = 0; a < s->num_axes; ++a) {
-		if (motors)
-			motors[a] = s->axis[a]->settings.target;
-		else
-			s->motor[a]->settings.endpos = s->axis[a]->settings.target;
-	}
+static inline void xyz2motors(Space *s, double const *target, double *motors) { // {{{
+	for (uint8_t a = 0; a < s->num_axes; ++a)
+		motors[a] = target[a];
 } // }}}
 
 static void reset_pos(Space *s) { // {{{
@@ -95,7 +91,7 @@ static int follow(Space *s, int axis) { // {{{
 } // }}}
 
 void Cartesian_init(int num) { // {{{
-	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors = xyz2motors_batch <xyz2motors>;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = load;
@@ -117,6 +113,9 @@ struct ExtruderData { // {{{
 
 struct ExtruderAxisData { // {{{
 	double offset[3];
+	double advance;		// Pressure advance: extra extruder motion per unit of extrusion speed [s].
+	double advance_smooth;	// Time over which the extrusion speed is averaged for the advance [s].
+	double e, next_advance;	// Values of the current sample, stored in the history when it is done.
 }; // }}}
 
 #define EDATA(s) (*reinterpret_cast <ExtruderData *>(s->type_data))
@@ -138,6 +137,10 @@ static void eload(Space *s, uint8_t old_type, int32_t &addr) { // {{{
 		for (int i = 0; i < 3; ++i) {
 			EADATA(s, a).offset[i] = 0;
 		}
+		EADATA(s, a).advance = 0;
+		EADATA(s, a).advance_smooth = 0;
+		EADATA(s, a).e = NAN;
+		EADATA(s, a).next_advance = 0;
 	}
 	EDATA(s).num_axes = s->num_axes;
 	bool move = false;
@@ -145,6 +148,7 @@ static void eload(Space *s, uint8_t old_type, int32_t &addr) { // {{{
 		move = true;
 		queue[settings.queue_end].probe = false;
 		queue[settings.queue_end].cb = false;
+		queue[settings.queue_end].event_end = 0;
 		queue[settings.queue_end].f[0] = INFINITY;
 		queue[settings.queue_end].f[1] = INFINITY;
 		for (int i = 0; i < spaces[0].num_axes; ++i) {
@@ -168,6 +172,12 @@ static void eload(Space *s, uint8_t old_type, int32_t &addr) { // {{{
 			EADATA(s, a).offset[o] = read_float(addr);
 			//debug("load offset %d %d %d = %f", s->id, a, o, EADATA(s, a).offset[o]);
 		}
+		EADATA(s, a).advance = read_float(addr);
+		EADATA(s, a).advance_smooth = read_float(addr);
+		if (!(EADATA(s, a).advance >= 0))
+			EADATA(s, a).advance = 0;
+		if (!(EADATA(s, a).advance_smooth >= 0))
+			EADATA(s, a).advance_smooth = 0;
 	}
 	if (move) {
 		next_move();
@@ -180,6 +190,8 @@ static void esave(Space *s, int32_t &addr) { // {{{
 	for (int a = 0; a < s->num_axes; ++a) {
 		for (int o = 0; o < 3; ++o)
 			write_float(addr, EADATA(s, a).offset[o]);
+		write_float(addr, EADATA(s, a).advance);
+		write_float(addr, EADATA(s, a).advance_smooth);
 	}
 } // }}}
 
@@ -209,8 +221,55 @@ static double eunchange0(Space *s, int axis, double value) { // {{{
 	return value - EADATA(s, current_extruder).offset[axis];
 } // }}}
 
+bool extruder_advance(Space *s, double const *target, double *motors) { // {{{
+	// Pressure advance: move the extruder motors ahead of the filament path
+	// by advance times the extrusion speed, so the pressure in the nozzle
+	// follows speed changes.  The extra motion is kept within the motor
+	// limits; check_distance() only has to handle the path itself.
+	// Returns true if an advance is still applied.
+	double dt = settings.sample_time / 1e6;
+	bool busy = false;
+	for (int a = 0; a < s->num_axes; ++a) {
+		ExtruderAxisData &ead = EADATA(s, a);
+		Axis_History &ah = s->axis[a]->settings;
+		Motor &mtr = *s->motor[a];
+		ead.e = isnan(target[a]) ? ah.source : target[a];
+		ead.next_advance = 0;
+		if (ead.advance == 0 && ah.advance == 0)
+			continue;
+		double wanted = 0;
+		if (ead.advance > 0) {
+			double v = isnan(ah.advance_e) ? 0 : (ead.e - ah.advance_e) / dt;
+			if (ead.advance_smooth > dt) {
+				double old_v = ah.advance / ead.advance;
+				v = old_v + (v - old_v) * (dt / ead.advance_smooth);
+			}
+			wanted = ead.advance * v;
+		}
+		// Limit the motor speed change that the advance adds.
+		double pos = mtr.settings.current_pos / mtr.steps_per_unit;
+		double v_path = (ead.e + ah.advance - pos) / dt;
+		double v_max = fmax(v_path, fmin(mtr.limit_v, mtr.settings.last_v + mtr.limit_a * dt));
+		double v_min = fmin(v_path, fmax(-mtr.limit_v, mtr.settings.last_v - mtr.limit_a * dt));
+		double v_motor = fmax(v_min, fmin(v_max, (ead.e + wanted - pos) / dt));
+		ead.next_advance = pos + v_motor * dt - ead.e;
+		motors[a] = ead.e + ead.next_advance;
+		if (fabs(ead.next_advance) * mtr.steps_per_unit >= .5)
+			busy = true;
+	}
+	return busy;
+} // }}}
+
+void extruder_advance_done(Space *s) { // {{{
+	// The sample is done; keep its values for computing the next one.
+	for (int a = 0; a < s->num_axes; ++a) {
+		s->axis[a]->settings.advance_e = EADATA(s, a).e;
+		s->axis[a]->settings.advance = EADATA(s, a).next_advance;
+	}
+} // }}}
+
 void Extruder_init(int num) { // {{{
-	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors = xyz2motors_batch <xyz2motors>;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = eload;
@@ -258,6 +317,7 @@ static void fload(Space *s, uint8_t old_type, int32_t &addr) { // {{{
 		FADATA(s, a).space = read_8(addr);
 		FADATA(s, a).motor = read_8(addr);
 	}
+	followers_changed = true;
 	arch_motors_change();
 } // }}}
 
@@ -296,7 +356,7 @@ static int ffollow(Space *s, int axis) { // {{{
 } // }}}
 
 void Follower_init(int num) { // {{{
-	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors = xyz2motors_batch <xyz2motors>;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = fload;
@@ -18,6 +18,14 @@
  */
 
 #include "cdriver.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// The three towers are computed together, one per lane; lane 3 is padding.
+typedef double Delta_vec __attribute__ ((vector_size (4 * sizeof(double))));
 
 struct Apex {
 	double axis_min, axis_max;	// Limits for the movement of this axis.
@@ -28,6 +36,11 @@ struct Apex {
 struct Delta_private {
 	Apex apex[3];
 	double angle;			// Adjust the front of the machine.
+	Delta_vec x, y, z, rodlength;	// Copy of the apex values, by lane.
+	// Last exactly computed position.  Within anchor_radius2 of it (in the xy plane), motor positions are interpolated linearly.
+	double anchor[3];
+	double anchor_radius2;
+	Delta_vec anchor_motor, anchor_gx, anchor_gy;
 };
 
 #define PRIVATE(s) (*reinterpret_cast <Delta_private *>(s->type_data))
@@ -62,31 +75,74 @@ static bool check_delta(Space *s, uint8_t a, double *target) {	// {{{
 	return true;
 }	// }}}
 
-static inline double delta_to_axis(Space *s, uint8_t a) {
-	double dx = s->axis[0]->settings.target - APEX(s, a).x;
-	double dy = s->axis[1]->settings.target - APEX(s, a).y;
-	double dz = s->axis[2]->settings.target - APEX(s, a).z;
-	double r2 = dx * dx + dy * dy;
-	double l2 = APEX(s, a).rodlength * APEX(s, a).rodlength;
-	double dest = sqrt(l2 - r2) + dz;
-	//debug("dta dx %f dy %f dz %f z %f, r %f target %f", dx, dy, dz, APEX(s, a).z, r, target);
-	return dest;
-}
+static inline void delta_sqrt(Delta_vec &v) { // {{{
+	// In place, because passing vectors by value changes the ABI depending on cpu flags.
+#if defined(__SSE2__)
+	__m128d part[2];
+	memcpy(part, &v, sizeof(v));
+	part[0] = _mm_sqrt_pd(part[0]);
+	part[1] = _mm_sqrt_pd(part[1]);
+	memcpy(&v, part, sizeof(v));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	float64x2_t part[2];
+	memcpy(part, &v, sizeof(v));
+	part[0] = vsqrtq_f64(part[0]);
+	part[1] = vsqrtq_f64(part[1]);
+	memcpy(&v, part, sizeof(v));
+#else
+	for (int i = 0; i < 4; ++i)
+		v[i] = sqrt(v[i]);
+#endif
+} // }}}
+
+static void delta_set_anchor(Space *s, double const *xyz) { // {{{
+	Delta_private &p = PRIVATE(s);
+	Delta_vec dx = xyz[0] - p.x;
+	Delta_vec dy = xyz[1] - p.y;
+	Delta_vec h = p.rodlength * p.rodlength - (dx * dx + dy * dy);
+	delta_sqrt(h);
+	for (int i = 0; i < 3; ++i)
+		p.anchor[i] = xyz[i];
+	p.anchor_motor = h + (xyz[2] - p.z);
+	p.anchor_gx = -dx / h;
+	p.anchor_gy = -dy / h;
+	p.anchor_radius2 = -1;
+	if (DELTA_INTERPOLATION <= 0)
+		return;
+	// At distance d from the anchor, the error of the linear interpolation
+	// is at most d^2 * rodlength^2 / (2 * hmin^3), where hmin is the
+	// smallest value of h on the way there.  d <= h^2 / (4 * rodlength)
+	// keeps hmin >= h / 2, which gives the bound below.
+	double r2 = INFINITY;
+	for (int a = 0; a < 3; ++a) {
+		if (!(h[a] > 0))
+			return;
+		double l = p.rodlength[a];
+		double dmax = h[a] * h[a] / (4 * l);
+		double emax = DELTA_INTERPOLATION / s->motor[a]->steps_per_unit * h[a] * h[a] * h[a] / (4 * l * l);
+		r2 = fmin(r2, fmin(dmax * dmax, emax));
+	}
+	p.anchor_radius2 = r2;
+} // }}}
 
-static void xyz2motors(Space *s, double *motors) {
-	if (isnan(s->axis[0]->settings.target) || isnan(s->axis[1]->settings.target) || isnan(s->axis[2]->settings.target)) {
+static inline void xyz2motors(Space *s, double const *target, double *motors) {
+	Delta_private &p = PRIVATE(s);
+	double xyz[3];
+	for (uint8_t aa = 0; aa < 3; ++aa) {
 		// Fill up missing targets.
-		for (uint8_t aa = 0; aa < 3; ++aa) {
-			if (isnan(s->axis[aa]->settings.target))
-				s->axis[aa]->settings.target = s->axis[aa]->settings.current;
-		}
+		xyz[aa] = isnan(target[aa]) ? s->axis[aa]->settings.current : target[aa];
 	}
-	for (uint8_t a = 0; a < 3; ++a) {
-		if (motors)
-			motors[a] = delta_to_axis(s, a);
-		else
-			s->motor[a]->settings.endpos = delta_to_axis(s, a);
+	double ex = xyz[0] - p.anchor[0];
+	double ey = xyz[1] - p.anchor[1];
+	Delta_vec m;
+	if (ex * ex + ey * ey <= p.anchor_radius2)
+		m = p.anchor_motor + p.anchor_gx * ex + p.anchor_gy * ey + (xyz[2] - p.anchor[2]);
+	else {
+		delta_set_anchor(s, xyz);
+		m = p.anchor_motor;
 	}
+	for (uint8_t a = 0; a < 3; ++a)
+		motors[a] = m[a];
 }
 
 static void reset_pos (Space *s) {
@@ -163,7 +219,16 @@ static void load(Space *s, uint8_t old_type, int32_t &addr) {
 		APEX(s, a).x = x[a] * cos(PRIVATE(s).angle) - y[a] * sin(PRIVATE(s).angle);
 		APEX(s, a).y = y[a] * cos(PRIVATE(s).angle) + x[a] * sin(PRIVATE(s).angle);
 		APEX(s, a).z = sqrt(APEX(s, a).rodlength * APEX(s, a).rodlength - APEX(s, a).radius * APEX(s, a).radius);
+		PRIVATE(s).x[a] = APEX(s, a).x;
+		PRIVATE(s).y[a] = APEX(s, a).y;
+		PRIVATE(s).z[a] = APEX(s, a).z;
+		PRIVATE(s).rodlength[a] = APEX(s, a).rodlength;
 	}
+	PRIVATE(s).x[3] = 0;
+	PRIVATE(s).y[3] = 0;
+	PRIVATE(s).z[3] = 0;
+	PRIVATE(s).rodlength[3] = 1;
+	PRIVATE(s).anchor_radius2 = -1;
 }
 
 static void save(Space *s, int32_t &addr) {
@@ -180,6 +245,7 @@ static bool init(Space *s) {
 	s->type_data = new Delta_private;
 	if (!s->type_data)
 		return false;
+	PRIVATE(s).anchor_radius2 = -1;
 	return true;
 }
 
@@ -219,7 +285,7 @@ static int follow(Space *s, int axis) {
 }
 
 void Delta_init(int num) {
-	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors = xyz2motors_batch <xyz2motors>;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = load;
@@ -25,33 +25,20 @@ struct Polar_private {
 
 #define PRIVATE(s) (*reinterpret_cast <Polar_private *>(s->type_data))
 
-static void xyz2motors(Space *s, double *motors) {
-	if (isnan(s->axis[0]->settings.target) || isnan(s->axis[1]->settings.target)) {
-		// Fill up missing targets.
-		for (uint8_t aa = 0; aa < 2; ++aa) {
-			if (isnan(s->axis[aa]->settings.target))
-				s->axis[aa]->settings.target = s->axis[aa]->settings.current;
-		}
-	}
-	double x = s->axis[0]->settings.target;
-	double y = s->axis[1]->settings.target;
-	double z = s->axis[2]->settings.target;
+static inline void xyz2motors(Space *s, double const *target, double *motors) {
+	// Fill up missing targets.
+	double x = isnan(target[0]) ? s->axis[0]->settings.current : target[0];
+	double y = isnan(target[1]) ? s->axis[1]->settings.current : target[1];
+	double z = target[2];
 	double r = sqrt(x * x + y * y);
 	double theta = atan2(y, x);
 	while (theta - s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit > 2 * M_PI)
 		theta -= 2 * M_PI;
 	while (theta - s->motor[1]->settings.current_pos / s->motor[1]->steps_per_unit < -2 * M_PI)
 		theta += 2 * M_PI;
-	if (motors) {
-		motors[0] = r;
-		motors[1] = theta;
-		motors[2] = z;
-	}
-	else {
-		s->motor[0]->settings.endpos = r;
-		s->motor[0]->settings.endpos = theta;
-		s->motor[0]->settings.endpos = z;
-	}
+	motors[0] = r;
+	motors[1] = theta;
+	motors[2] = z;
 }
 
 static void reset_pos (Space *s) {
@@ -124,7 +111,7 @@ static int follow(Space *s, int axis) {
 }
 
 void Polar_init(int num) {
-	space_types[num].xyz2motors = xyz2motors;
+	space_types[num].xyz2motors = xyz2motors_batch <xyz2motors>;
 	space_types[num].reset_pos = reset_pos;
 	space_types[num].check_position = check_position;
 	space_types[num].load = load;
@@ -31,7 +31,15 @@ TYPE_DELTA = 1
 TYPE_POLAR = 2
 TYPE_EXTRUDER = 3
 TYPE_FOLLOWER = 4
+# Input shapers
+SHAPER_NONE = 0
+SHAPER_ZV = 1
+SHAPER_ZVD = 2
+SHAPER_EI = 3
+SHAPER_KEYS = ('shaper_freq_x', 'shaper_freq_y', 'shaper_freq_z', 'shaper_damping_x', 'shaper_damping_y', 'shaper_damping_z')
 record_format = '=Bidddddddd' # type, tool, X, Y, Z, E, f, F, time, dist
+compact_format = '=4sLLLqd' # magic, version, block records, reserved, number of records, quantum
+compact_version = 2
 # }}}
 
 # Imports.  {{{
@@ -66,7 +74,8 @@ config = fhs.init(packagename = 'franklin', config = { # {{{
 	'allow-system': None,
 	'uuid': None,
 	'local': False,
-	'arc': True
+	'arc': True,
+	'compact': False
 	})
 # }}}
 
@@ -288,6 +297,7 @@ class Machine: # {{{
 		self.feedrate = 1
 		self.max_deviation = 0
 		self.max_v = float('inf')
+		self.s_curve = False
 		self.current_extruder = 0
 		self.targetx = 0.
 		self.targety = 0.
@@ -632,7 +642,12 @@ class Machine: # {{{
 		if cmd == 'SPACE':
 			info = self._read('SPACE_INFO', channel)
 			self.spaces[channel].type = struct.unpack('=B', info[:1])[0]
-			info = info[1:]
+			shaper = struct.unpack('=B' + 'dd' * 3, info[1:50])
+			self.spaces[channel].shaper = shaper[0]
+			for i, a in enumerate('xyz'):
+				setattr(self.spaces[channel], 'shaper_freq_' + a, shaper[1 + 2 * i])
+				setattr(self.spaces[channel], 'shaper_damping_' + a, shaper[2 + 2 * i])
+			info = info[50:]
 			if self.spaces[channel].type == TYPE_CARTESIAN:
 				num_axes = struct.unpack('=B', info)[0]
 				num_motors = num_axes
@@ -652,8 +667,8 @@ class Machine: # {{{
 				num_motors = num_axes
 				self.spaces[channel].extruder = []
 				for a in range(num_axes):
-					dx, dy, dz = struct.unpack('=ddd', info[1 + 24 * a:1 + 24 * (a + 1)])
-					self.spaces[channel].extruder.append({'dx': dx, 'dy': dy, 'dz': dz})
+					dx, dy, dz, advance, advance_smooth = struct.unpack('=ddddd', info[1 + 40 * a:1 + 40 * (a + 1)])
+					self.spaces[channel].extruder.append({'dx': dx, 'dy': dy, 'dz': dz, 'advance': advance, 'advance_smooth': advance_smooth})
 			elif self.spaces[channel].type == TYPE_FOLLOWER:
 				num_axes = struct.unpack('=B', info[:1])[0]
 				num_motors = num_axes
@@ -681,7 +696,7 @@ class Machine: # {{{
 		if data is None:
 			return False
 		self.queue_length, self.num_pins, num_temps, num_gpios = struct.unpack('=BBBB', data[:4])
-		self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.timeout, self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.targetangle, self.zoffset, self.store_adc = struct.unpack('=HHHHHhhhdddBdddd?', data[4:])
+		self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.timeout, self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.s_curve, self.current_extruder, self.targetx, self.targety, self.targetangle, self.zoffset, self.store_adc = struct.unpack('=HHHHHhhhddd?Bdddd?', data[4:])
 		while len(self.temps) < num_temps:
 			self.temps.append(self.Temp(len(self.temps)))
 			if update:
@@ -703,7 +718,7 @@ class Machine: # {{{
 			ng = len(self.gpios)
 		dt = nt - len(self.temps)
 		dg = ng - len(self.gpios)
-		data = struct.pack('=BBHHHHHhhhdddBdddd?', nt, ng, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, int(self.timeout), self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.targetangle, self.zoffset, self.store_adc)
+		data = struct.pack('=BBHHHHHhhhddd?Bdddd?', nt, ng, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, int(self.timeout), self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.s_curve, self.current_extruder, self.targetx, self.targety, self.targetangle, self.zoffset, self.store_adc)
 		self._send_packet(struct.pack('=B', protocol.command['WRITE_GLOBALS']) + data)
 		self._read_globals(update = True)
 		if update:
@@ -733,7 +748,7 @@ class Machine: # {{{
 	def _globals_update(self, target = None): # {{{
 		if not self.initialized:
 			return
-		self._broadcast(target, 'globals_update', [self.name, self.profile, len(self.temps), len(self.gpios), self.pin_names, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.probe_dist, self.probe_safe_dist, self.bed_id, self.fan_id, self.spindle_id, self.unit_name, self.timeout, self.feedrate, self.max_deviation, self.max_v, self.targetx, self.targety, self.targetangle, self.zoffset, self.store_adc, self.park_after_print, self.sleep_after_print, self.cool_after_print, self._mangle_spi(), self.temp_scale_min, self.temp_scale_max, self.connected, not self.paused and (None if self.gcode_map is None and not self.gcode_file else True)])
+		self._broadcast(target, 'globals_update', [self.name, self.profile, len(self.temps), len(self.gpios), self.pin_names, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.probe_dist, self.probe_safe_dist, self.bed_id, self.fan_id, self.spindle_id, self.unit_name, self.timeout, self.feedrate, self.max_deviation, self.max_v, self.s_curve, self.targetx, self.targety, self.targetangle, self.zoffset, self.store_adc, self.park_after_print, self.sleep_after_print, self.cool_after_print, self._mangle_spi(), self.temp_scale_min, self.temp_scale_max, self.connected, not self.paused and (None if self.gcode_map is None and not self.gcode_file else True)])
 	# }}}
 	def _space_update(self, which, target = None): # {{{
 		if not self.initialized:
@@ -891,6 +906,8 @@ class Machine: # {{{
 		if bbox is None:
 			return errors
 		self.jobqueue[os.path.splitext(name)[0]] = bbox
+		if config['compact']:
+			self._gcode_compact(os.path.splitext(name)[0])
 		self._broadcast(None, 'queue', [(q, self.jobqueue[q]) for q in self.jobqueue])
 		return errors
 	# }}}
@@ -1441,7 +1458,9 @@ class Machine: # {{{
 			cb()
 		self.gcode_id = None
 	# }}}
-	def _gcode_run(self, src, abort = True, paused = False): # {{{
+	def _gcode_run(self, src, abort = True, paused = False, stream = False): # {{{
+		'''Run a job from the queue.
+		If stream is True, src is a file with g-code instead, which is run while it is parsed.'''
 		if self.parking:
 			return
 		self.gcode_angle = math.sin(self.targetangle), math.cos(self.targetangle)
@@ -1462,16 +1481,53 @@ class Machine: # {{{
 		if len(self.spaces) > 1:
 			for e in range(len(self.spaces[1].axis)):
 				self.set_axis_pos(1, e, 0)
+		if stream:
+			self.total_time = [float('nan'), float('nan')]
+			def start(filename):
+				self._gcode_start(filename, 'gcode_run', paused)
+			bbox, errors = self._gcode_parse(src, 'gcode_run', start)
+			for e in errors:
+				log(e)
+			if bbox is not None:
+				self.total_time = bbox[-2:]
+			self._gcode_open(fhs.read_spool(os.path.join(self.uuid, 'stream', 'gcode_run' + os.extsep + 'bin'), text = False, opened = False), True)
+			return
 		filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', src + os.extsep + 'bin'), text = False, opened = False)
 		self.total_time = self.jobqueue[src][-2:]
+		self._gcode_open(filename)
+		if config['compact']:
+			# cdriver runs the compact version if there is one; the driver keeps using the plain file.
+			compact = fhs.read_spool(os.path.join(self.uuid, 'compact', src + os.extsep + 'bin'), text = False, opened = False)
+			if compact is not None:
+				with open(compact, 'rb') as f:
+					header = f.read(8)
+				if len(header) < 8 or header[:4] != b'\xffFRC' or struct.unpack('=L', header[4:])[0] != compact_version:
+					# Written by an older version of the driver.
+					self._gcode_compact(src)
+				filename = compact
+		self._gcode_start(filename, src, paused)
+	# }}}
+	def _gcode_open(self, filename, stream = False): # {{{
+		'''Map a run file, for the strings and the context of the toolpath.'''
 		self.gcode_fd = os.open(filename, os.O_RDONLY)
 		self.gcode_map = mmap.mmap(self.gcode_fd, 0, prot = mmap.PROT_READ)
 		filesize = os.fstat(self.gcode_fd).st_size
+		self.gcode_strings = []
+		if stream:
+			# The strings are in a separate file; the records start with the stream start record.
+			with open(filename + os.extsep + 'str', 'rb') as f:
+				data = f.read()
+			pos = 0
+			while pos + 4 <= len(data):
+				size = struct.unpack('=l', data[pos:pos + 4])[0]
+				self.gcode_strings.append(data[pos + 4:pos + 4 + size].decode('utf-8', 'replace'))
+				pos += 4 + size
+			self.gcode_num_records = filesize // struct.calcsize(record_format)
+			return
 		bboxsize = 8 * struct.calcsize('=d')
 		def unpack(format, pos):
 			return struct.unpack(format, self.gcode_map[pos:pos + struct.calcsize(format)])
 		num_strings = unpack('=I', filesize - bboxsize - struct.calcsize('=I'))[0]
-		self.gcode_strings = []
 		sizes = [unpack('=I', filesize - bboxsize - struct.calcsize('=I') * (num_strings + 1 - x))[0] for x in range(num_strings)]
 		first_string = filesize - bboxsize - struct.calcsize('=I') * (num_strings + 1) - sum(sizes)
 		pos = 0
@@ -1479,6 +1535,9 @@ class Machine: # {{{
 			self.gcode_strings.append(self.gcode_map[first_string + pos:first_string + pos + sizes[x]].decode('utf-8', 'replace'))
 			pos += sizes[x]
 		self.gcode_num_records = first_string / struct.calcsize(record_format)
+	# }}}
+	def _gcode_start(self, filename, src, paused): # {{{
+		'''Let cdriver run a run file.'''
 		if self.probemap is not None:
 			self.gcode_file = True
 			self._globals_update()
@@ -1504,7 +1563,9 @@ class Machine: # {{{
 			self._globals_update()
 			self._send_packet(struct.pack('=BBddBB', protocol.command['RUN_FILE'], 1 if not paused and self.confirmer is None else 0, self.gcode_angle[0], self.gcode_angle[1], 0xff, 0) + filename.encode('utf8'))
 	# }}}
-	def _gcode_parse(self, src, name): # {{{
+	def _gcode_parse(self, src, name, stream = None): # {{{
+		'''Parse g-code from src into a run file.
+		If stream is not None, a streamed run file is written (see cdriver/run.cpp) and stream is called with its name as soon as it can be run.'''
 		assert len(self.spaces) > 0
 		self._broadcast(None, 'blocked', 'parsing g-code')
 		errors = []
@@ -1537,7 +1598,15 @@ class Machine: # {{{
 			elif type == protocol.parsed['WAIT']:
 				time_dist[0] += nums[1]
 			return nums + time_dist
-		with fhs.write_spool(os.path.join(self.uuid, 'gcode', os.path.splitext(name)[0] + os.path.extsep + 'bin'), text = False) as dst:
+		with fhs.write_spool(os.path.join(self.uuid, 'gcode' if stream is None else 'stream', os.path.splitext(name)[0] + os.path.extsep + 'bin'), text = False) as dst:
+			if stream is not None:
+				# Strings are written to the string file before the records that use them.
+				strdst = open(dst.name + os.extsep + 'str', 'wb')
+				strdst.write(struct.pack('=l', 0))
+				strdst.flush()
+				dst.write(struct.pack(record_format, protocol.parsed['STREAM'], 0, *[0.] * 8))
+				dst.flush()
+				stream(dst.name)
 			epsilon = .5	# TODO: check if this should be configurable
 			aepsilon = math.radians(36)	# TODO: check if this should be configurable
 			rlimit = 500	# TODO: check if this should be configurable
@@ -1655,6 +1724,10 @@ class Machine: # {{{
 					return 0
 				if string not in strings:
 					strings.append(string)
+					if stream is not None:
+						us = string.encode('utf-8')
+						strdst.write(struct.pack('=l', len(us)) + us)
+						strdst.flush()
 				return strings.index(string)
 			current_extruder = 0
 			for lineno, origline in enumerate(src):
@@ -1693,6 +1766,12 @@ class Machine: # {{{
 						errors.append('Warning: system command %s is forbidden and will not be run' % comment[7:])
 					add_record(protocol.parsed['SYSTEM'], [add_string(comment[7:])])
 					continue
+				elif comment.startswith('SYSTEM_NOWAIT:'):
+					# Like SYSTEM:, but the print continues while the command runs.
+					if not re.match(self.allow_system, comment[14:]):
+						errors.append('Warning: system command %s is forbidden and will not be run' % comment[14:])
+					add_record(protocol.parsed['SYSTEM'], [add_string(comment[14:]), 1])
+					continue
 				if line == '':
 					continue
 				line = line.split()
@@ -1964,15 +2043,16 @@ class Machine: # {{{
 						errors.append('%d:invalid gcode command %s' % (lineno, repr((cmd, args))))
 					message = None
 			flush_pending()
-			stringmap = []
-			size = 0
-			for s in strings:
-				us = s.encode('utf-8')
-				stringmap.append(len(us))
-				dst.write(us)
-				size += len(us)
-			for s in stringmap:
-				dst.write(struct.pack('=L', s))
+			if stream is None:
+				stringmap = []
+				size = 0
+				for s in strings:
+					us = s.encode('utf-8')
+					stringmap.append(len(us))
+					dst.write(us)
+					size += len(us)
+				for s in stringmap:
+					dst.write(struct.pack('=L', s))
 			ret = bbox
 			if any(x is None for x in bbox[:4]):
 				bbox = bbox_last
@@ -1984,10 +2064,75 @@ class Machine: # {{{
 				for t, b in enumerate(bbox):
 					if b is None:
 						bbox[t] = 0;
-			dst.write(struct.pack('=L' + 'd' * 8, len(strings), *(bbox + time_dist)))
+			if stream is None:
+				dst.write(struct.pack('=L' + 'd' * 8, len(strings), *(bbox + time_dist)))
+			else:
+				# The end record tells cdriver that the file is complete.
+				dst.write(struct.pack(record_format, protocol.parsed['STREAM'], 1, *(bbox + time_dist)))
+				strdst.close()
 		self._broadcast(None, 'blocked', None)
 		return ret and ret + time_dist, errors
 	# }}}
+	def _gcode_compact(self, name, quantum = 1e-6, block_records = 256): # {{{
+		'''Write the compact version of a parsed file for cdriver to run.
+		The format is described in cdriver/run.cpp.  The plain file is kept, because the driver reads it for strings and context.'''
+		with open(fhs.read_spool(os.path.join(self.uuid, 'gcode', name + os.extsep + 'bin'), text = False, opened = False), 'rb') as f:
+			data = f.read()
+		record_size = struct.calcsize(record_format)
+		trailer = 8 * 8
+		num_strings = struct.unpack('=L', data[-trailer - 4:-trailer])[0]
+		lengths = struct.unpack('=%dL' % num_strings, data[-trailer - 4 - 4 * num_strings:-trailer - 4])
+		first_string = len(data) - trailer - 4 - 4 * num_strings - sum(lengths)
+		num_records = first_string // record_size
+		def varint(v):
+			ret = b''
+			while v >= 0x80:
+				ret += bytes((v & 0x7f | 0x80,))
+				v >>= 7
+			return ret + bytes((v,))
+		def zigzag(v):
+			return v << 1 if v >= 0 else (-v << 1) - 1
+		blocks = []
+		for start in range(0, num_records, block_records):
+			block = []
+			tool = 0
+			value = [0.] * 8
+			q = [0] * 8
+			for n in range(start, min(start + block_records, num_records)):
+				record = struct.unpack(record_format, data[n * record_size:(n + 1) * record_size])
+				head = record[0]
+				body = b''
+				if record[1] != tool:
+					head |= 0x10
+					body += varint(zigzag(record[1] - tool))
+					tool = record[1]
+				for i, v in enumerate(record[2:]):
+					if struct.pack('=d', v) == struct.pack('=d', value[i]):
+						continue
+					if math.isfinite(v) and abs(v / quantum) < 2 ** 52:
+						qv = round(v / quantum)
+						if qv * quantum == value[i]:
+							continue
+						body += varint(zigzag(qv - q[i]) + 1)
+						q[i] = qv
+						value[i] = qv * quantum
+					else:
+						body += varint(0) + struct.pack('=d', v)
+						value[i] = v
+					head |= 0x20 << i
+				block.append(varint(head) + body)
+			blocks.append(b''.join(block))
+		with fhs.write_spool(os.path.join(self.uuid, 'compact', name + os.extsep + 'bin'), text = False) as dst:
+			dst.write(struct.pack(compact_format, b'\xffFRC', compact_version, block_records, 0, num_records, quantum))
+			pos = struct.calcsize(compact_format) + 8 * (len(blocks) + 1)
+			for block in blocks:
+				dst.write(struct.pack('=Q', pos))
+				pos += len(block)
+			dst.write(struct.pack('=Q', pos))
+			for block in blocks:
+				dst.write(block)
+			dst.write(data[first_string:])
+	# }}}
 	def _reset_extruders(self, axes): # {{{
 		for i, sp in enumerate(axes):
 			for a, pos in enumerate(sp):
@@ -2026,6 +2171,10 @@ class Machine: # {{{
 			self.polar_max_r = float('inf')
 			self.extruder = []
 			self.follower = []
+			self.shaper = SHAPER_NONE
+			for a in 'xyz':
+				setattr(self, 'shaper_freq_' + a, 0.)
+				setattr(self, 'shaper_damping_' + a, 0.)
 		def read(self, data):
 			axes, motors = data
 			if self.id == 1:
@@ -2057,7 +2206,9 @@ class Machine: # {{{
 				if self.id == 1 and m < len(self.machine.multipliers):
 					self.motor[m]['steps_per_unit'] /= self.machine.multipliers[m]
 		def write_info(self, num_axes = None):
-			data = struct.pack('=B', self.type)
+			data = struct.pack('=BB', self.type, int(self.shaper))
+			for a in 'xyz':
+				data += struct.pack('=dd', getattr(self, 'shaper_freq_' + a), getattr(self, 'shaper_damping_' + a))
 			if self.type == TYPE_CARTESIAN:
 				data += struct.pack('=B', num_axes if num_axes is not None else len(self.axis))
 			elif self.type == TYPE_DELTA:
@@ -2071,9 +2222,9 @@ class Machine: # {{{
 				data += struct.pack('=B', num)
 				for a in range(num):
 					if a < len(self.extruder):
-						data += struct.pack('=ddd', self.extruder[a]['dx'], self.extruder[a]['dy'], self.extruder[a]['dz'])
+						data += struct.pack('=ddddd', self.extruder[a]['dx'], self.extruder[a]['dy'], self.extruder[a]['dz'], self.extruder[a]['advance'], self.extruder[a]['advance_smooth'])
 					else:
-						data += struct.pack('=ddd', 0, 0, 0)
+						data += struct.pack('=ddddd', 0, 0, 0, 0, 0)
 			elif self.type == TYPE_FOLLOWER:
 				num = num_axes if num_axes is not None else len(self.axis)
 				data += struct.pack('=B', num)
@@ -2145,6 +2296,8 @@ class Machine: # {{{
 			type = self.type if self.id != 0 or self.machine.home_phase is None else self.machine.home_orig_type
 			if self.id == 0:
 				ret += 'type = %d\r\n' % type
+			ret += 'shaper = %d\r\n' % self.shaper
+			ret += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in SHAPER_KEYS])
 			if type == TYPE_CARTESIAN:
 				ret += 'num_axes = %d\r\n' % len(self.axis)
 			elif type == TYPE_DELTA:
@@ -2158,7 +2311,7 @@ class Machine: # {{{
 				ret += 'num_axes = %d\r\n' % len(self.axis)
 				for i in range(len(self.extruder)):
 					ret += '[extruder %d %d]\r\n' % (self.id, i)
-					ret += ''.join(['%s = %f\r\n' % (x, self.extruder[i][x]) for x in ('dx', 'dy', 'dz')])
+					ret += ''.join(['%s = %f\r\n' % (x, self.extruder[i][x]) for x in ('dx', 'dy', 'dz', 'advance', 'advance_smooth')])
 			elif type == TYPE_FOLLOWER:
 				ret += 'num_axes = %d\r\n' % len(self.axis)
 				for i in range(len(self.follower)):
@@ -2705,7 +2858,7 @@ class Machine: # {{{
 		message += 'unit_name=%s\r\n' % self.unit_name
 		message += 'spi_setup=%s\r\n' % self._mangle_spi()
 		message += ''.join(['%s = %s\r\n' % (x, write_pin(getattr(self, x))) for x in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin')])
-		message += ''.join(['%s = %d\r\n' % (x, getattr(self, x)) for x in ('bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout')])
+		message += ''.join(['%s = %d\r\n' % (x, getattr(self, x)) for x in ('bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 's_curve', 'timeout')])
 		message += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('probe_dist', 'probe_safe_dist', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v')])
 		for i, s in enumerate(self.spaces):
 			message += s.export_settings()
@@ -2737,13 +2890,13 @@ class Machine: # {{{
 		globals_changed = True
 		changed = {'space': set(), 'temp': set(), 'gpio': set(), 'axis': set(), 'motor': set(), 'extruder': set(), 'delta': set(), 'follower': set()}
 		keys = {
-				'general': {'num_temps', 'num_gpios', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v'},
-				'space': {'type', 'num_axes', 'delta_angle', 'polar_max_r'},
+				'general': {'num_temps', 'num_gpios', 'pin_names', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v', 's_curve'},
+				'space': {'type', 'num_axes', 'delta_angle', 'polar_max_r', 'shaper'} | set(SHAPER_KEYS),
 				'temp': {'name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time'},
 				'gpio': {'name', 'pin', 'state', 'reset', 'duty'},
 				'axis': {'name', 'park', 'park_order', 'min', 'max', 'home_pos2'},
 				'motor': {'step_pin', 'dir_pin', 'enable_pin', 'limit_min_pin', 'limit_max_pin', 'steps_per_unit', 'home_pos', 'limit_v', 'limit_a', 'home_order'},
-				'extruder': {'dx', 'dy', 'dz'},
+				'extruder': {'dx', 'dy', 'dz', 'advance', 'advance_smooth'},
 				'delta': {'axis_min', 'axis_max', 'rodlength', 'radius'},
 				'follower': {'space', 'motor'}
 			}
@@ -2880,12 +3033,14 @@ class Machine: # {{{
 		'''Run a string of g-code.
 		'''
 		self.probemap = probemap
-		with fhs.write_temp(text = False) as f:
+		with fhs.write_temp() as f:
 			f.write(code)
 			f.seek(0)
-			self.gcode_id = id
+			# The code is run while it is parsed.
 			# Break this in two, otherwise tail recursion may destroy f before call is done?
-			ret = self._gcode_run(f.filename, paused = paused)
+			ret = self._gcode_run(f, paused = paused, stream = True)
+			# Set this after starting, so aborting the previous job doesn't reply to it.
+			self.gcode_id = id
 			return ret
 	# }}}
 	@delayed
@@ -2982,6 +3137,12 @@ class Machine: # {{{
 			self._broadcast(None, 'audioqueue', tuple(self.audioqueue.keys()))
 		else:
 			filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', name + os.extsep + 'bin'), opened = False)
+			compact = fhs.read_spool(os.path.join(self.uuid, 'compact', name + os.extsep + 'bin'), opened = False)
+			if compact is not None:
+				try:
+					os.unlink(compact)
+				except:
+					log('unable to unlink %s' % compact)
 			del self.jobqueue[name]
 			self._broadcast(None, 'queue', [(q, self.jobqueue[q]) for q in self.jobqueue])
 		try:
@@ -3143,7 +3304,7 @@ class Machine: # {{{
 	def get_globals(self): # {{{
 		#log('getting globals')
 		ret = {'num_temps': len(self.temps), 'num_gpios': len(self.gpios)}
-		for key in ('name', 'pin_names', 'uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'paused', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v'):
+		for key in ('name', 'pin_names', 'uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'targetangle', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'paused', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v', 's_curve'):
 			ret[key] = getattr(self, key)
 		return ret
 	# }}}
@@ -3165,7 +3326,7 @@ class Machine: # {{{
 			self.spi_setup = self._unmangle_spi(ka.pop('spi_setup'))
 			if self.spi_setup:
 				self._spi_send(self.spi_setup)
-		for key in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout'):
+		for key in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 's_curve', 'timeout'):
 			if key in ka:
 				setattr(self, key, int(ka.pop(key)))
 		for key in ('probe_dist', 'probe_safe_dist', 'feedrate', 'targetx', 'targety', 'targetangle', 'zoffset', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v'):
@@ -3200,7 +3361,9 @@ class Machine: # {{{
 		return self.spaces[space].set_current_pos(axis, pos)
 	# }}}
 	def get_space(self, space): # {{{
-		ret = {'name': self.spaces[space].name, 'num_axes': len(self.spaces[space].axis), 'num_motors': len(self.spaces[space].motor)}
+		ret = {'name': self.spaces[space].name, 'num_axes': len(self.spaces[space].axis), 'num_motors': len(self.spaces[space].motor), 'shaper': self.spaces[space].shaper}
+		for key in SHAPER_KEYS:
+			ret[key] = getattr(self.spaces[space], key)
 		if self.spaces[space].type == TYPE_CARTESIAN:
 			pass
 		elif self.spaces[space].type == TYPE_DELTA:
@@ -3218,7 +3381,7 @@ class Machine: # {{{
 			ret['extruder'] = []
 			for a in range(len(self.spaces[space].axis)):
 				ret['extruder'].append({})
-				for key in ('dx', 'dy', 'dz'):
+				for key in ('dx', 'dy', 'dz', 'advance', 'advance_smooth'):
 					ret['extruder'][-1][key] = self.spaces[space].extruder[a][key]
 		elif self.spaces[space].type == TYPE_FOLLOWER:
 			ret['follower'] = []
@@ -3254,12 +3417,17 @@ class Machine: # {{{
 	def expert_set_space(self, space, readback = True, update = True, **ka): # {{{
 		if space == 0 and 'type' in ka:
 			self.spaces[space].type = int(ka.pop('type'))
+		if 'shaper' in ka:
+			self.spaces[space].shaper = int(ka.pop('shaper'))
+		for key in SHAPER_KEYS:
+			if key in ka:
+				setattr(self.spaces[space], key, float(ka.pop(key)))
 		if self.spaces[space].type == TYPE_EXTRUDER:
 			if 'extruder' in ka:
 				e = ka.pop('extruder')
 				for ei, ee in e.items():
 					i = int(ei)
-					for key in ('dx', 'dy', 'dz'):
+					for key in ('dx', 'dy', 'dz', 'advance', 'advance_smooth'):
 						if key in ee:
 							self.spaces[space].extruder[i][key] = ee.pop(key)
 					assert len(ee) == 0
@@ -868,6 +868,7 @@ function globals_update(uuid) { // {{{
 	update_float(p, [null, 'feedrate']);
 	update_float(p, [null, 'max_deviation']);
 	update_float(p, [null, 'max_v']);
+	update_checkbox(p, [null, 's_curve']);
 	update_float(p, [null, 'targetx']);
 	update_float(p, [null, 'targety']);
 	update_float(p, [null, 'targetangle']);
@@ -141,6 +141,7 @@ function _setup_updater() {
 					feedrate: 1,
 					max_deviation: 0,
 					max_v: 0,
+					s_curve: false,
 					targetx: 0,
 					targety: 0,
 					targetangle: 0,
@@ -224,19 +225,20 @@ function _setup_updater() {
 			machines[machine].feedrate = values[16];
 			machines[machine].max_deviation = values[17];
 			machines[machine].max_v = values[18];
-			machines[machine].targetx = values[19];
-			machines[machine].targety = values[20];
-			machines[machine].targetangle = values[21];
-			machines[machine].zoffset = values[22];
-			machines[machine].store_adc = values[23];
-			machines[machine].park_after_print = values[24];
-			machines[machine].sleep_after_print = values[25];
-			machines[machine].cool_after_print = values[26];
-			machines[machine].spi_setup = values[27];
-			machines[machine].temp_scale_min = values[28];
-			machines[machine].temp_scale_max = values[29];
-			machines[machine].connected = values[30];
-			machines[machine].status = values[31];
+			machines[machine].s_curve = values[19];
+			machines[machine].targetx = values[20];
+			machines[machine].targety = values[21];
+			machines[machine].targetangle = values[22];
+			machines[machine].zoffset = values[23];
+			machines[machine].store_adc = values[24];
+			machines[machine].park_after_print = values[25];
+			machines[machine].sleep_after_print = values[26];
+			machines[machine].cool_after_print = values[27];
+			machines[machine].spi_setup = values[28];
+			machines[machine].temp_scale_min = values[29];
+			machines[machine].temp_scale_max = values[30];
+			machines[machine].connected = values[31];
+			machines[machine].status = values[32];
 			for (var i = machines[machine].num_temps; i < new_num_temps; ++i) {
 				machines[machine].temps.push({
 					name: null,
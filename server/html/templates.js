@@ -672,6 +672,10 @@ function Machine(machine) {	// {{{
 	e.Add(Float(ret, [null, 'max_v'], 2, 1));
 	e.AddText(' ').Add(add_name(ret, 'unit', 0, 0));
 	e.AddText('/s');
+	e = setup.AddElement('div');
+	l = e.AddElement('label');
+	l.Add(Checkbox(ret, [null, 's_curve']));
+	l.AddText('S-Curve Velocity Profiles');
 	// Cartesian. {{{
 	setup.Add([make_table(ret).AddMultipleTitles([
 		'Cartesian/Other',
@@ -119,6 +119,7 @@ parsed = {
 	'WAIT': 9,
 	'CONFIRM': 10,
 	'PARK': 11,
+	'STREAM': 12,
 }
 
 mask = [[0xc0, 0xc3, 0xff, 0x09],